@@ -28,9 +28,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <syscall.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <linux/types.h>
 
 #include "list.h"
@@ -38,13 +41,9 @@
 #include "tgtadm_error.h"
 #include "util.h"
 #include "bs_thread.h"
-#ifdef NUMA_CACHE
-#include "cache.h"
-#endif
+#include "cache_tgt.h"
 
-#ifdef NUMA_CACHE
 extern struct host_cache hc;
-#endif
 
 LIST_HEAD(bst_list);
 
@@ -54,7 +53,8 @@ static pthread_mutex_t finished_lock;
 /* used by both bs_rdwr.c and bs_rbd.c */
 int nr_iothreads = 16;
 
-static int sig_fd = -1;
+/* readable while a pool has done commands */
+static int done_efd = -1;
 
 static int command_fd[2];
 static int done_fd[2];
@@ -63,6 +63,45 @@ static pthread_t ack_thread;
 static LIST_HEAD(ack_list);
 static pthread_cond_t finished_cond;
 
+/* workers shared by all lus, one pool per numa node with the cache */
+struct bs_worker_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* a lu has commands to hand out */
+	pthread_cond_t idle_cond;	/* a closing lu has no busy worker */
+	/* bs_thread_queue of lus with commands, served round robin */
+	struct list_head ready_list;
+	int nr_threads;
+	int node;
+	/* read by workers of other pools without the lock */
+	int nr_pending;			/* queued commands */
+	int nr_idle;			/* workers waiting for commands */
+	uint64_t svc_ns;		/* average time of a command */
+	uint8_t distance[BS_MAX_POOLS];	/* numa distance, 10 is local */
+
+	/* commands its workers are done with, newest first. pushed
+	 * without lock, taken all at once by tgtd.
+	 */
+	struct scsi_cmd *done __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+static struct bs_worker_pool pools[BS_MAX_POOLS];
+static int nr_pools;
+/* serializes pool start and growth */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+/* pool of the next single threaded lu */
+static int next_single_pool;
+
+/* 0 sizes the pools to the online cpus */
+int nr_workers;
+
+/* an idle worker runs commands queued to another node once their
+ * expected wait there is longer than BS_STEAL_NS, or more than
+ * BS_STEAL_DEPTH wait for each worker of the node, and the wait is
+ * longer than the extra time a remote node takes for a command.
+ */
+#define BS_STEAL_NS	100000
+#define BS_STEAL_DEPTH	4
+
 int register_backingstore_template(struct backingstore_template *bst)
 {
 	list_add(&bst->backingstore_siblings, &bst_list);
@@ -165,150 +204,307 @@ rewrite:
 	}
 }
 
-static void bs_sig_request_done(int fd, int events, void *data)
+static void bs_eventfd_request_done(int fd, int events, void *data)
 {
-	int ret;
-	struct scsi_cmd *cmd;
-	struct signalfd_siginfo siginfo[16];
-	LIST_HEAD(list);
+	struct scsi_cmd *cmd, *next, *list;
+	uint64_t nr;
+	int i, ret;
 
-	ret = read(fd, (char *)siginfo, sizeof(siginfo));
-	if (ret <= 0) {
+	/* cleared first, a command pushed from now on wakes us again */
+	ret = read(fd, &nr, sizeof(nr));
+	if (ret < 0)
 		return;
+
+	for (i = 0; i < nr_pools; i++) {
+		list = __atomic_exchange_n(&pools[i].done, NULL,
+					   __ATOMIC_ACQUIRE);
+
+		/* oldest first */
+		for (cmd = NULL; list; list = next) {
+			next = list->bs_next;
+			list->bs_next = cmd;
+			cmd = list;
+		}
+
+		for (; cmd; cmd = next) {
+			next = cmd->bs_next;
+			target_cmd_io_done(cmd, scsi_get_result(cmd));
+		}
 	}
+}
 
-	pthread_mutex_lock(&finished_lock);
-	list_splice_init(&finished_list, &list);
-	pthread_mutex_unlock(&finished_lock);
+/* only the completion that finds the list empty writes the eventfd */
+static void bs_cmd_done(struct bs_worker_pool *pool, struct scsi_cmd *cmd)
+{
+	struct scsi_cmd *head;
+	uint64_t one = 1;
+	int ret;
 
-	while (!list_empty(&list)) {
-		cmd = list_first_entry(&list, struct scsi_cmd, bs_list);
+	head = __atomic_load_n(&pool->done, __ATOMIC_RELAXED);
+	do {
+		cmd->bs_next = head;
+	} while (!__atomic_compare_exchange_n(&pool->done, &head, cmd, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
 
-		list_del(&cmd->bs_list);
+	if (head)
+		return;
 
-		target_cmd_io_done(cmd, scsi_get_result(cmd));
+	ret = write(done_efd, &one, sizeof(one));
+	if (ret < 0)
+		eprintf("can't wake tgtd, %m\n");
+}
+
+/* the pool lock is held */
+static void bs_queue_ready(struct bs_worker_pool *pool, struct bs_thread_queue *q)
+{
+	if (!list_empty(&q->ready_list) || list_empty(&q->pending_list) ||
+	    q->busy >= q->info->nr_worker_threads || q->stop)
+		return;
+
+	list_add_tail(&q->ready_list, &pool->ready_list);
+	pthread_cond_signal(&pool->cond);
+}
+
+/* how much sooner a worker of thief would finish a command queued to
+ * pool than its workers, 0 if pool is not backlogged
+ */
+static uint64_t bs_steal_gain(struct bs_worker_pool *thief,
+			      struct bs_worker_pool *pool)
+{
+	uint64_t pending, svc, wait, penalty;
+	int nr_threads;
+
+	pending = __atomic_load_n(&pool->nr_pending, __ATOMIC_RELAXED);
+	svc = __atomic_load_n(&pool->svc_ns, __ATOMIC_RELAXED);
+	nr_threads = __atomic_load_n(&pool->nr_threads, __ATOMIC_RELAXED);
+	if (!nr_threads)
+		return 0;
+
+	wait = pending * svc / nr_threads;
+	if (wait <= BS_STEAL_NS && pending <= nr_threads * BS_STEAL_DEPTH)
+		return 0;
+
+	/* remote memory is about distance / 10 times slower */
+	penalty = svc * (thief->distance[pool->node] - 10) / 10;
+	if (wait < penalty)
+		return 0;
+
+	return wait - penalty + 1;
+}
+
+/* the pool with the most to gain from a worker of thief */
+static struct bs_worker_pool *bs_steal_victim(struct bs_worker_pool *thief)
+{
+	struct bs_worker_pool *victim = NULL;
+	uint64_t gain, best = 0;
+	int i;
+
+	for (i = 0; i < nr_pools; i++) {
+		if (&pools[i] == thief)
+			continue;
+		gain = bs_steal_gain(thief, &pools[i]);
+		if (gain > best) {
+			best = gain;
+			victim = &pools[i];
+		}
 	}
+
+	return victim;
+}
+
+/* wake an idle worker of another node if pool is backlogged */
+static void bs_steal_kick(struct bs_worker_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < nr_pools; i++) {
+		if (&pools[i] == pool ||
+		    !__atomic_load_n(&pools[i].nr_idle, __ATOMIC_RELAXED))
+			continue;
+		if (bs_steal_gain(&pools[i], pool)) {
+			pthread_cond_signal(&pools[i].cond);
+			return;
+		}
+	}
+}
+
+static void bs_queue_cmd(struct bs_thread_info *info, struct scsi_cmd *cmd,
+			 int pi)
+{
+	struct bs_worker_pool *pool = &pools[pi];
+
+	pthread_mutex_lock(&pool->lock);
+	list_add_tail(&cmd->bs_list, &info->q[pi].pending_list);
+	bs_queue_ready(pool, &info->q[pi]);
+	__atomic_store_n(&pool->nr_pending, pool->nr_pending + 1,
+			 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (nr_pools > 1)
+		bs_steal_kick(pool);
+}
+
+/* one command of the first lu, which then goes last. a single
+ * threaded lu is left to its own pool. the pool lock is held.
+ */
+static struct scsi_cmd *bs_queue_take(struct bs_worker_pool *pool,
+				      struct bs_thread_queue **qp, int steal)
+{
+	struct bs_thread_queue *q;
+	struct scsi_cmd *cmd;
+
+	list_for_each_entry(q, &pool->ready_list, ready_list)
+		if (!steal || q->info->pool < 0)
+			goto found;
+
+	return NULL;
+found:
+	cmd = list_first_entry(&q->pending_list,
+			       struct scsi_cmd, bs_list);
+	list_del(&cmd->bs_list);
+	list_del_init(&q->ready_list);
+	q->busy++;
+	bs_queue_ready(pool, q);
+	__atomic_store_n(&pool->nr_pending, pool->nr_pending - 1,
+			 __ATOMIC_RELAXED);
+
+	*qp = q;
+	return cmd;
+}
+
+static void bs_queue_idle(struct bs_worker_pool *pool, struct bs_thread_queue *q)
+{
+	q->busy--;
+	if (q->stop) {
+		if (!q->busy)
+			pthread_cond_broadcast(&pool->idle_cond);
+	} else
+		bs_queue_ready(pool, q);
 }
 
 static void *bs_thread_worker_fn(void *arg)
 {
-	struct bs_thread_info *info = arg;
+	struct bs_worker_pool *pool = arg, *from;
+	struct bs_thread_info *info;
+	struct bs_thread_queue *q;
 	struct scsi_cmd *cmd;
 	sigset_t set;
-#ifdef NUMA_CACHE
-	int nc_id;
-#endif
+	struct timespec t0, t1;
+	uint64_t ns;
+	int stole = 0;
 
 	sigfillset(&set);
 	sigprocmask(SIG_BLOCK, &set, NULL);
 
-	pthread_mutex_lock(&info->startup_lock);
-#ifdef NUMA_CACHE
-	/* round robin create thread on each node */
-	nc_id = info->thr_node_id;
-	dprintf("started this thread on node: %d\n", nc_id);
+	dprintf("started this thread on node: %d\n", pool->node);
 
-	if (numa_run_on_node(info->thr_node_id) != 0) {
+	if (cache_run_on_node(pool->node) != 0) {
 		eprintf("numa cache: numa_run_on_node fail\n");
 		pthread_exit(NULL);
 	}
 
-	numa_set_preferred(info->thr_node_id);
-
-	info->thr_node_id = (info->thr_node_id + 1) % info->nr_numa_nodes;
-#endif
-	pthread_mutex_unlock(&info->startup_lock);
-
-	while (!info->stop) {
-#ifndef NUMA_CACHE
-		pthread_mutex_lock(&info->pending_lock);
-#else
-		pthread_mutex_lock(&info->pending_lock[nc_id]);
-#endif
-	retest:
-#ifndef NUMA_CACHE
-		if (list_empty(&info->pending_list)) {
-			pthread_cond_wait(&info->pending_cond, &info->pending_lock);
-#else
-		if (list_empty(&info->pending_list[nc_id])) {
-			pthread_cond_wait(&info->pending_cond[nc_id], &info->pending_lock[nc_id]);
-#endif
-			if (info->stop) {
-#ifndef NUMA_CACHE
-				pthread_mutex_unlock(&info->pending_lock);
-#else
-				pthread_mutex_unlock(&info->pending_lock[nc_id]);
-#endif
-				pthread_exit(NULL);
+	if (nr_pools > 1)
+		cache_set_preferred(pool->node);
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		/* the pool the command was queued to */
+		from = pool;
+		cmd = bs_queue_take(pool, &q, 0);
+		if (!cmd) {
+			/* try another node once per wakeup */
+			from = stole || nr_pools == 1 ? NULL :
+				bs_steal_victim(pool);
+			stole = 1;
+			if (from) {
+				pthread_mutex_unlock(&pool->lock);
+				pthread_mutex_lock(&from->lock);
+				cmd = bs_queue_take(from, &q, 1);
+				if (!cmd) {
+					pthread_mutex_unlock(&from->lock);
+					pthread_mutex_lock(&pool->lock);
+					continue;
+				}
+				pthread_mutex_unlock(&from->lock);
+				goto run;
 			}
-			goto retest;
-		}
 
-#ifndef NUMA_CACHE
-		cmd = list_first_entry(&info->pending_list,
-				       struct scsi_cmd, bs_list);
-#else
-		cmd = list_first_entry(&info->pending_list[nc_id],
-				       struct scsi_cmd, bs_list);
-#endif
-
-		list_del(&cmd->bs_list);
+			__atomic_store_n(&pool->nr_idle, pool->nr_idle + 1,
+					 __ATOMIC_RELAXED);
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			__atomic_store_n(&pool->nr_idle, pool->nr_idle - 1,
+					 __ATOMIC_RELAXED);
+			stole = 0;
+			continue;
+		}
 
-#ifndef NUMA_CACHE
-		pthread_mutex_unlock(&info->pending_lock);
-#else
-		pthread_mutex_unlock(&info->pending_lock[nc_id]);
-#endif
+		pthread_mutex_unlock(&pool->lock);
+run:
+		stole = 0;
+		info = q->info;
 
-#ifdef NUMA_CACHE
 		/* split cmd */
 		if (cmd->nodeid == -1)
 			cmd->nodeid = split_io(cmd, &hc);
-		if (cmd->nodeid != nc_id) {
+		if (cmd->nodeid != from->node && info->pool < 0) {
 			/* give this cmd to another node */
-			dprintf("numa cache: give this cmd from node %d to %d\n", nc_id, cmd->nodeid);
-			pthread_mutex_lock(&info->pending_lock[cmd->nodeid]);
-			list_add_tail(&cmd->bs_list, &info->pending_list[cmd->nodeid]);
-			pthread_mutex_unlock(&info->pending_lock[cmd->nodeid]);
-			pthread_cond_signal(&info->pending_cond[cmd->nodeid]);
-			continue;
+			dprintf("numa cache: give this cmd from node %d to %d\n", from->node, cmd->nodeid);
+			__atomic_fetch_add(&(hc.node_stat[from->node].forwarded), \
+					   1, __ATOMIC_RELAXED);
+			bs_queue_cmd(info, cmd, cmd->nodeid);
+			ns = 0;
+			goto idle;
 		}
+		if (from != pool)
+			__atomic_fetch_add(&(hc.node_stat[pool->node].stolen), \
+					   1, __ATOMIC_RELAXED);
 		dprintf("numa cache: worker thread perform\n");
-#endif
+		clock_gettime(CLOCK_MONOTONIC, &t0);
 		info->request_fn(cmd);
+		/* only local runs tell how long the node takes */
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		ns = from != pool ? 0 : (t1.tv_sec - t0.tv_sec) * 1000000000ULL +
+			t1.tv_nsec - t0.tv_nsec;
+
+		if (done_efd >= 0)
+			bs_cmd_done(pool, cmd);
+		else {
+			pthread_mutex_lock(&finished_lock);
+			list_add_tail(&cmd->bs_list, &finished_list);
+			pthread_mutex_unlock(&finished_lock);
 
-		pthread_mutex_lock(&finished_lock);
-		list_add_tail(&cmd->bs_list, &finished_list);
-		pthread_mutex_unlock(&finished_lock);
-
-		if (sig_fd < 0)
 			pthread_cond_signal(&finished_cond);
-		else
-			kill(getpid(), SIGUSR2);
+		}
+
+idle:
+		pthread_mutex_lock(&from->lock);
+		if (ns)
+			__atomic_store_n(&pool->svc_ns, pool->svc_ns -
+					 pool->svc_ns / 8 + ns / 8,
+					 __ATOMIC_RELAXED);
+		bs_queue_idle(from, q);
+		if (from != pool) {
+			pthread_mutex_unlock(&from->lock);
+			pthread_mutex_lock(&pool->lock);
+		}
 	}
 
-	pthread_exit(NULL);
+	return NULL;
 }
 
-static int bs_init_signalfd(void)
+static int bs_init_eventfd(void)
 {
-	sigset_t mask;
 	int ret;
 
-	pthread_mutex_init(&finished_lock, NULL);
-
-	sigemptyset(&mask);
-	sigaddset(&mask, SIGUSR2);
-	sigprocmask(SIG_BLOCK, &mask, NULL);
-
-	sig_fd = __signalfd(-1, &mask, 0);
-	if (sig_fd < 0)
+	done_efd = eventfd(0, EFD_NONBLOCK);
+	if (done_efd < 0)
 		return 1;
 
-	ret = tgt_event_add(sig_fd, EPOLLIN, bs_sig_request_done, NULL);
+	ret = tgt_event_add(done_efd, EPOLLIN, bs_eventfd_request_done, NULL);
 	if (ret < 0) {
-		close (sig_fd);
-		sig_fd = -1;
+		close(done_efd);
+		done_efd = -1;
 
 		return 1;
 	}
@@ -372,9 +568,9 @@ int bs_init(void)
 {
 	int ret;
 
-	ret = bs_init_signalfd();
+	ret = bs_init_eventfd();
 	if (!ret) {
-		eprintf("use signalfd notification\n");
+		eprintf("use eventfd notification\n");
 		return 0;
 	}
 
@@ -387,111 +583,192 @@ int bs_init(void)
 	return 1;
 }
 
-tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
-			  int nr_threads)
+/*
+ * memory the network drivers do their data transfers in, backing stores
+ * able to pin it for their I/O (bs_uring) take it from here. only the
+ * main thread touches it.
+ */
+#define BS_MAX_FIXED_BUFS	64
+#define BS_FIXED_BUF_MAX	(1UL << 30)	/* io_uring limit per buffer */
+
+static struct iovec fixed_bufs[BS_MAX_FIXED_BUFS];
+static int nr_fixed_bufs;
+static unsigned int fixed_bufs_gen = 1;
+
+int bs_add_fixed_buffer(void *addr, size_t len)
 {
-	int i, ret;
+	char *p = addr;
+	size_t n;
+
+	while (len) {
+		if (nr_fixed_bufs == BS_MAX_FIXED_BUFS) {
+			eprintf("too many fixed buffers, %p is not pinned\n",
+				p);
+			return -1;
+		}
+		n = min_t(size_t, len, BS_FIXED_BUF_MAX);
+		fixed_bufs[nr_fixed_bufs].iov_base = p;
+		fixed_bufs[nr_fixed_bufs].iov_len = n;
+		nr_fixed_bufs++;
+		p += n;
+		len -= n;
+	}
+	fixed_bufs_gen++;
 
-	info->worker_thread = zalloc(sizeof(pthread_t) * nr_threads);
-	if (!info->worker_thread)
-		return TGTADM_NOMEM;
+	return 0;
+}
 
-	eprintf("%d\n", nr_threads);
-	info->request_fn = rfn;
+/* drop the buffer starting at addr, with the chunks it was split into */
+void bs_del_fixed_buffer(void *addr)
+{
+	char *p = addr;
+	int i, j;
 
-#ifndef NUMA_CACHE
-	INIT_LIST_HEAD(&info->pending_list);
-	pthread_cond_init(&info->pending_cond, NULL);
-	pthread_mutex_init(&info->pending_lock, NULL);
-#else
-	/* add numa nodes support */
-	if (numa_available() != 0) {
-		eprintf("numa cache: Does not support NUMA API\n");
-		return -1;
-	}
+	for (i = 0; i < nr_fixed_bufs; i++)
+		if (fixed_bufs[i].iov_base == addr)
+			break;
+	if (i == nr_fixed_bufs)
+		return;
 
-	info->nr_numa_nodes = numa_num_configured_nodes();
-	info->thr_node_id = 0;
+	for (j = i; j < nr_fixed_bufs && fixed_bufs[j].iov_base == p; j++)
+		p += fixed_bufs[j].iov_len;
 
-	for (i = 0; i < info->nr_numa_nodes; i++) {
-		INIT_LIST_HEAD(&info->pending_list[i]);
+	memmove(&fixed_bufs[i], &fixed_bufs[j],
+		(nr_fixed_bufs - j) * sizeof(fixed_bufs[0]));
+	nr_fixed_bufs -= j - i;
+	fixed_bufs_gen++;
+}
 
-		pthread_cond_init(&info->pending_cond[i], NULL);
-		pthread_mutex_init(&info->pending_lock[i], NULL);
-	}
-#endif
-	pthread_mutex_init(&info->startup_lock, NULL);
+/* the buffers and a generation that changes whenever they do */
+int bs_fixed_buffers(struct iovec **iov, unsigned int *gen)
+{
+	*iov = fixed_bufs;
+	*gen = fixed_bufs_gen;
 
-	pthread_mutex_lock(&info->startup_lock);
-	for (i = 0; i < nr_threads; i++) {
-		ret = pthread_create(&info->worker_thread[i], NULL,
-				     bs_thread_worker_fn, info);
+	return nr_fixed_bufs;
+}
 
+/* start workers until the pool has nr, the pools lock is held */
+static int bs_pool_grow(struct bs_worker_pool *pool, int nr)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int n, ret = 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (n = pool->nr_threads; n < nr; n++) {
+		ret = pthread_create(&thread, &attr, bs_thread_worker_fn, pool);
 		if (ret) {
 			eprintf("failed to create a worker thread, %d %s\n",
-				i, strerror(ret));
-			if (ret)
-				goto destroy_threads;
+				n, strerror(ret));
+			break;
 		}
 	}
-	pthread_mutex_unlock(&info->startup_lock);
-	info->nr_worker_threads = nr_threads;
 
-	return TGTADM_SUCCESS;
-destroy_threads:
-	info->stop = 1;
+	pthread_attr_destroy(&attr);
+
+	/* workers of other pools read it to weigh stealing */
+	__atomic_store_n(&pool->nr_threads, n, __ATOMIC_RELAXED);
 
-	pthread_mutex_unlock(&info->startup_lock);
-	for (; i > 0; i--) {
-		pthread_join(info->worker_thread[i - 1], NULL);
-		eprintf("stopped the worker thread %d\n", i - 1);
+	return n ? 0 : ret;
+}
+
+tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
+			  int nr_threads)
+{
+	long nr_cpus;
+	int i, nr;
+	int j, d;
+
+	pthread_mutex_lock(&pools_lock);
+	if (!nr_pools) {
+		nr_pools = cache_nr_nodes();
+		for (i = 0; i < nr_pools; i++) {
+			pthread_mutex_init(&pools[i].lock, NULL);
+			pthread_cond_init(&pools[i].cond, NULL);
+			pthread_cond_init(&pools[i].idle_cond, NULL);
+			INIT_LIST_HEAD(&pools[i].ready_list);
+			pools[i].nr_threads = 0;
+			pools[i].node = i;
+			pools[i].nr_pending = 0;
+			pools[i].nr_idle = 0;
+			pools[i].svc_ns = 0;
+			for (j = 0; j < nr_pools; j++) {
+				d = i == j ? 10 : cache_node_distance(i, j);
+				/* unknown, take it as another socket */
+				if (d < 10 || d > 255)
+					d = 20;
+				pools[i].distance[j] = d;
+			}
+		}
+	}
+
+	/* as many workers as cpus, or as the lu may use at once. a lu
+	 * asking for one thread runs its commands in order, on one pool
+	 */
+	info->nr_worker_threads = (nr_threads + nr_pools - 1) / nr_pools;
+	info->pool = -1;
+	if (nr_threads == 1)
+		info->pool = next_single_pool++ % nr_pools;
+	if (nr_workers)
+		nr = (nr_workers + nr_pools - 1) / nr_pools;
+	else {
+		nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr = max_t(int, nr_cpus / nr_pools, 1);
+		nr = max(nr, info->nr_worker_threads);
 	}
 
-#ifndef NUMA_CACHE
-	pthread_cond_destroy(&info->pending_cond);
-	pthread_mutex_destroy(&info->pending_lock);
-#else
-	for (i = 0; i < info->nr_numa_nodes; i++) {
-		pthread_cond_destroy(&info->pending_cond[i]);
-		pthread_mutex_destroy(&info->pending_lock[i]);
+	for (i = 0; i < nr_pools; i++) {
+		if (bs_pool_grow(&pools[i], nr)) {
+			pthread_mutex_unlock(&pools_lock);
+			return TGTADM_NOMEM;
+		}
 	}
-#endif
-	pthread_mutex_destroy(&info->startup_lock);
-	free(info->worker_thread);
+	pthread_mutex_unlock(&pools_lock);
+
+	eprintf("%d workers per pool, %d for the lu\n", pools[0].nr_threads,
+		info->nr_worker_threads);
+	info->request_fn = rfn;
 
-	return TGTADM_NOMEM;
+	for (i = 0; i < nr_pools; i++) {
+		INIT_LIST_HEAD(&info->q[i].pending_list);
+		INIT_LIST_HEAD(&info->q[i].ready_list);
+		info->q[i].busy = 0;
+		info->q[i].stop = 0;
+		info->q[i].info = info;
+	}
+
+	return TGTADM_SUCCESS;
 }
 
 void bs_thread_close(struct bs_thread_info *info)
 {
+	struct bs_worker_pool *pool;
+	struct scsi_cmd *cmd;
 	int i;
 
-	info->stop = 1;
-#ifndef NUMA_CACHE
-	pthread_cond_broadcast(&info->pending_cond);
-#else
-	for (i = 0; i < info->nr_numa_nodes; i++) {
-		pthread_cond_broadcast(&info->pending_cond[i]);
+	for (i = 0; i < nr_pools; i++) {
+		pthread_mutex_lock(&pools[i].lock);
+		info->q[i].stop = 1;
+		list_del_init(&info->q[i].ready_list);
+		/* commands left are dropped */
+		list_for_each_entry(cmd, &info->q[i].pending_list, bs_list)
+			__atomic_store_n(&pools[i].nr_pending,
+					 pools[i].nr_pending - 1,
+					 __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&pools[i].lock);
 	}
-#endif
 
-
-	for (i = 0; info->worker_thread[i] && i < info->nr_worker_threads; i++)
-		pthread_join(info->worker_thread[i], NULL);
-
-#ifndef NUMA_CACHE
-	pthread_cond_destroy(&info->pending_cond);
-	pthread_mutex_destroy(&info->pending_lock);
-#else
-	for (i = 0; i < info->nr_numa_nodes; i++) {
-		pthread_cond_destroy(&info->pending_cond[i]);
-		pthread_mutex_destroy(&info->pending_lock[i]);
+	/* the workers stay for other lus, wait until they leave this one */
+	for (i = 0; i < nr_pools; i++) {
+		pool = &pools[i];
+		pthread_mutex_lock(&pool->lock);
+		while (info->q[i].busy)
+			pthread_cond_wait(&pool->idle_cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
 	}
-#endif
-	pthread_mutex_destroy(&info->startup_lock);
-	free(info->worker_thread);
-
-	info->stop = 0;
 }
 
 int bs_thread_cmd_submit(struct scsi_cmd *cmd)
@@ -499,40 +776,27 @@ int bs_thread_cmd_submit(struct scsi_cmd *cmd)
 	struct scsi_lu *lu = cmd->dev;
 	struct bs_thread_info *info = BS_THREAD_I(lu);
 
-#ifndef NUMA_CACHE
-	pthread_mutex_lock(&info->pending_lock);
-
-	list_add_tail(&cmd->bs_list, &info->pending_list);
-
-	pthread_mutex_unlock(&info->pending_lock);
-
-	pthread_cond_signal(&info->pending_cond);
-#else
 	int nodeid;
 
-	/* split io request into sub io request
-	nodeid = split_io(cmd, &hc);
-	cmd->nodeid = nodeid;
-	nodeid = cmd->nodeid;
-	dprintf("numa cache: dispatch cmd to node %d\n", nodeid);
-	dprintf("numa cache: dispatch offset %ld, to numa node: %d\n", \
-	cmd->offset, nodeid); */
-
-	/* dispatch this IO to a NUMA node randomly */
-	nodeid = rand_r(&(hc.seed)) % hc.nr_numa_nodes;
-
-	cmd->nodeid = -1;
+	/* dispatch this IO to the pool of a single threaded lu, or to
+	 * the node split_io chose for it lately, else to a NUMA node
+	 * randomly
+	 */
+	nodeid = info->pool;
+	if (nodeid < 0 && info->clu)
+		nodeid = cache_cmd_node(&hc, cmd->tid, cmd->lun, cmd->scb, \
+					scsi_get_out_length(cmd) ? \
+					scsi_get_out_length(cmd) : \
+					scsi_get_in_length(cmd));
+	if (nodeid < 0)
+		nodeid = rand_r(&(hc.seed)) % hc.nr_numa_nodes;
+
+	/* uncached LUs have nothing to split, any node serves them */
+	cmd->nodeid = info->clu ? -1 : nodeid;
 	/* numa cache support */
 	dprintf("numa cache: dispatch cmd to node %d\n", nodeid);
 
-	pthread_mutex_lock(&info->pending_lock[nodeid]);
-
-	list_add_tail(&cmd->bs_list, &info->pending_list[nodeid]);
-
-	pthread_mutex_unlock(&info->pending_lock[nodeid]);
-
-	pthread_cond_signal(&info->pending_cond[nodeid]);
-#endif
+	bs_queue_cmd(info, cmd, nodeid);
 
 	set_cmd_async(cmd);
 
@@ -29,6 +29,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <linux/fs.h>
@@ -40,14 +41,28 @@
 #include "scsi.h"
 #include "spc.h"
 #include "bs_thread.h"
-#ifdef NUMA_CACHE
-#include "cache.h"
-#endif
+#include "target.h"
+#include "parser.h"
+#include "cache_tgt.h"
 
-#ifdef NUMA_CACHE
 extern struct host_cache hc;
+
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT	0x00000008
 #endif
 
+struct bs_rdwr_info {
+	/* first, BS_THREAD_I() finds it at the start of the private data */
+	struct bs_thread_info thread;
+	/* reads try the page cache on the main thread first */
+	int nowait;
+};
+
+static inline struct bs_rdwr_info *BS_RDWR_I(struct scsi_lu *lu)
+{
+	return (struct bs_rdwr_info *) ((char *)lu + sizeof(*lu));
+}
+
 static void set_medium_error(int *result, uint8_t *key, uint16_t *asc)
 {
 	*result = SAM_STAT_CHECK_CONDITION;
@@ -65,15 +80,256 @@ static void bs_sync_sync_range(struct scsi_cmd *cmd, uint32_t length,
 		set_medium_error(result, key, asc);
 }
 
+/* move the partition lock held by this thread to nc, NULL drops it */
+static inline void nc_hold(struct numa_cache **held, struct numa_cache *nc)
+{
+	if (*held == nc)
+		return;
+	if (*held)
+		nc_mutex_unlock(&((*held)->mutex));
+	if (nc)
+		nc_lock(nc);
+	*held = nc;
+}
+
+/* contiguous sub-IOs of a command to be written through together, their
+ * cache blocks are CACHE_PENDING
+ */
+struct cache_batch {
+	int first;			/* first sub-IO */
+	int nr;
+	struct cache_block *cb[CACHE_MAX_RUN];
+	struct numa_cache *nc[CACHE_MAX_RUN];
+	char filled[CACHE_MAX_RUN];	/* rest of the block is valid */
+};
+
+/* write a batch with one pwritev and empty it. a block is published
+ * only if the write succeeded and the rest of the block is not junk.
+ */
+static int write_cache_batch(struct scsi_cmd *cmd, struct cache_batch *b)
+{
+	struct iovec iov[CACHE_MAX_RUN];
+	struct sub_io_request ior;
+	struct numa_cache *held = NULL;
+	uint64_t offset = 0;
+	ssize_t ret, total = 0;
+	size_t pad;
+	int i, nr = b->nr;
+
+	for (i = 0; i < nr; i ++) {
+		get_sior(cmd, b->first + i, &ior, &hc);
+		if (i == 0)
+			offset = ior.offset + ior.in_offset;
+		iov[i].iov_base = cb_addr(b->cb[i], b->nc[i]) + ior.in_offset;
+		iov[i].iov_len = ior.length;
+		total += ior.length;
+	}
+
+	/* O_DIRECT only need 512 byte alignment, instead of page
+	   alignment. Block device is already 512 byte alignment.
+	   Therefore, we need only check whether the length is 512
+	   byte alignment. */
+	pad = roundup(iov[nr - 1].iov_len, hc.dio_align) - iov[nr - 1].iov_len;
+	iov[nr - 1].iov_len += pad;
+	total += pad;
+
+	ret = pwritev(cmd->dev->fd, iov, nr, offset);
+	if (ret != total)
+		eprintf("numa cache: pwritev %d blocks failed - %zd\n", nr, ret);
+
+	for (i = 0; i < nr; i ++) {
+		nc_hold(&held, b->nc[i]);
+		complete_cache_block(b->cb[i], b->nc[i], \
+			(ret == total && b->filled[i]) ? CACHE_VALID : CACHE_INVALID);
+	}
+	nc_hold(&held, NULL);
+
+	b->nr = 0;
+
+	return ret == total ? 0 : -1;
+}
+
+#define CACHE_AROUND_ADMIT	1	/* misses turned down by admission */
+#define CACHE_AROUND_LARGE	2	/* all misses */
+
+/* contiguous sub-IOs of a command that go around the cache */
+struct cache_around {
+	int first;			/* first sub-IO */
+	int nr;
+	uint64_t offset;		/* on disk */
+	uint32_t m_offset;		/* in the command buffer */
+	uint32_t length;
+};
+
+/* how the misses of a command may go around the cache. direct I/O
+ * needs an aligned buffer, and a write must not pass dirty blocks.
+ */
+static int cache_around_mode(struct scsi_cmd *cmd, char *buf, int write)
+{
+	if (write && cmd->dev->attrs.cache_wb)
+		return 0;
+	if (((unsigned long) buf | cmd->offset | cmd->sior_length) & \
+	    (hc.dio_align - 1))
+		return 0;
+	if (hc.bypass && cmd->sior_length >= hc.bypass)
+		return CACHE_AROUND_LARGE;
+
+	return hc.admit ? CACHE_AROUND_ADMIT : 0;
+}
+
+/* add sub-IO i to a if it goes around the cache, nc is held */
+static int go_around(struct numa_cache *nc, struct sub_io_request *ior, \
+		     int i, int mode, struct cache_around *a)
+{
+	if (!mode || ht_lookup(&(nc->ht), ior->tid, ior->lun, ior->cb_id))
+		return 0;
+	if (mode == CACHE_AROUND_ADMIT && \
+	    admit_cache_block(nc, ior->tid, ior->lun, ior->cb_id, 1))
+		return 0;
+
+	nc->stat.misses ++;
+	nc->stat.bypassed ++;
+
+	if (a->nr == 0) {
+		a->first = i;
+		a->offset = ior->offset + ior->in_offset;
+		a->m_offset = ior->m_offset;
+		a->length = 0;
+	}
+	a->length += ior->length;
+	a->nr ++;
+
+	return 1;
+}
+
+/* read or write the sub-IOs gathered in a with one call and empty it,
+ * no partition lock may be held
+ */
+static int flush_around(struct scsi_cmd *cmd, struct cache_around *a, \
+			int write)
+{
+	struct sub_io_request ior;
+	struct numa_cache *held = NULL;
+	ssize_t ret;
+	int i;
+
+	if (a->nr == 0)
+		return 0;
+
+	if (write) {
+		ret = pwrite64(cmd->dev->fd, scsi_get_out_buffer(cmd) + \
+			       a->m_offset, a->length, a->offset);
+
+		for (i = 0; i < a->nr; i ++) {
+			get_sior(cmd, a->first + i, &ior, &hc);
+			nc_hold(&held, &(hc.nc[ior.nc_id]));
+			bypass_cache_block(ior.tid, ior.lun, ior.cb_id, held);
+		}
+		nc_hold(&held, NULL);
+	} else
+		ret = pread64(cmd->dev->fd, scsi_get_in_buffer(cmd) + \
+			      a->m_offset, a->length, a->offset);
+
+	a->nr = 0;
+
+	if (ret != a->length) {
+		eprintf("numa cache: %s around the cache at %" PRIu64 \
+			" failed - %zd\n", write ? "write" : "read", \
+			a->offset, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* hand the data-in pieces of a read to the transport, the sub-IOs that
+ * are not hits are in the buffer and merged where adjacent
+ */
+static void set_cmd_zc(struct scsi_cmd *cmd, struct scsi_zc *zc, int pinned)
+{
+	struct sub_io_request ior;
+	int i, n = 0;
+
+	if (pinned == 0) {
+		free(zc);
+		return;
+	}
+
+	for (i = 0; i < cmd->nr_sior; i ++) {
+		if (zc[i].cb == NULL) {
+			get_sior(cmd, i, &ior, &hc);
+			zc[i].addr = scsi_get_in_buffer(cmd) + ior.m_offset;
+			zc[i].length = ior.length;
+		}
+
+		if (n && !zc[i].cb && !zc[n - 1].cb && \
+		    zc[n - 1].addr + zc[n - 1].length == zc[i].addr)
+			zc[n - 1].length += zc[i].length;
+		else
+			zc[n ++] = zc[i];
+	}
+
+	cmd->zc = zc;
+	cmd->nr_zc = n;
+}
+
+/* copy the hits of sub-IOs before n into the buffer and unpin their
+ * blocks, a miss of the same command may wait for them otherwise
+ */
+static void unpin_hits(struct scsi_cmd *cmd, struct scsi_zc *zc, int n, \
+		       struct numa_cache **held)
+{
+	struct sub_io_request ior;
+	int i;
+
+	for (i = 0; i < n; i ++) {
+		if (zc[i].cb == NULL)
+			continue;
+
+		get_sior(cmd, i, &ior, &hc);
+		nc_hold(held, &(hc.nc[zc[i].nc_id]));
+		memcpy(scsi_get_in_buffer(cmd) + ior.m_offset, zc[i].addr, \
+		       zc[i].length);
+		unpin_cache_block(zc[i].cb, *held, zc[i].addr);
+		zc[i].cb = NULL;
+	}
+}
+
+/* punch a hole through the cache. the range is dropped from the cache
+ * before it, so that no dirty block is written over the hole later, and
+ * again after it for fills that raced with it.
+ */
+static int cache_unmap_region(struct cache_lu *clu, int fd, uint64_t offset, \
+			      uint32_t tl)
+{
+	int ret;
+
+	invalidate_cache_range(&hc, clu->tid, clu->lun, offset, tl);
+	ret = unmap_file_region(fd, offset, tl);
+	invalidate_cache_range(&hc, clu->tid, clu->lun, offset, tl);
+
+	return ret;
+}
+
+/* drop the blocks a command wrote on the disk around the cache, whole
+ * ones, the lu was destaged before so none of them is dirty
+ */
+static void cache_drop_region(struct cache_lu *clu, uint64_t offset, \
+			      uint64_t length)
+{
+	uint64_t first = offset / hc.cbs * hc.cbs;
+
+	invalidate_cache_range(&hc, clu->tid, clu->lun, first, \
+			       roundup(offset + length, hc.cbs) - first);
+}
+
 static void bs_rdwr_request(struct scsi_cmd *cmd)
 {
 	int ret, fd = cmd->dev->fd;
-	int fd_od = cmd->dev->fd_od;
 	uint32_t length;
 	int result = SAM_STAT_GOOD;
 	uint8_t key;
 	uint16_t asc;
-	uint32_t info = 0;
 	char *tmpbuf;
 	size_t blocksize;
 	uint64_t offset = cmd->offset;
@@ -83,25 +339,38 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 	char *ptr;
 	const char *write_buf = NULL;
 
-#ifdef NUMA_CACHE
-	struct sub_io_request *ior;
+	struct cache_lu *clu = BS_THREAD_I(cmd->dev)->clu;
+	struct sub_io_request sio, *ior = &sio;
 	struct cache_block *cb;
-	struct numa_cache *nc, *nc_pre;
-	int sio_size;
-#endif
+	struct numa_cache *nc;
+	struct mode_pg *pg;
+	struct numa_cache *held;
+	struct cache_key ckey;
+	struct cache_block *run[CACHE_MAX_RUN];
+	struct numa_cache *rnc[CACHE_MAX_RUN];
+	struct cache_batch batch;
+	struct cache_around around;
+	struct scsi_zc *zc;
+	int fua, wb, filled, full, joined, mode, pinned;
+	int j, nr;
+	int hits = 0, misses = 0;
 
 	ret = length = 0;
 	key = asc = 0;
 
-#ifdef NUMA_CACHE
 	dprintf("numa cache: cmd is %x\n", cmd->scb[0]);
-#endif
 	switch (cmd->scb[0])
 	{
 	case ORWRITE_16:
+		/* old data comes from the disk, the result goes back to it */
+		if (clu && flush_cache_lu(&hc, cmd->tid, cmd->dev->lun)) {
+			set_medium_error(&result, &key, &asc);
+			break;
+		}
 		length = scsi_get_out_length(cmd);
 
-		tmpbuf = malloc(length);
+		/* aligned, a cached lu is opened with O_DIRECT */
+		tmpbuf = valloc(length);
 		if (!tmpbuf) {
 			result = SAM_STAT_CHECK_CONDITION;
 			key = HARDWARE_ERROR;
@@ -124,10 +393,6 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 		free(tmpbuf);
 
 		write_buf = scsi_get_out_buffer(cmd);
-#ifdef NUMA_CACHE
-		eprintf("This cmd: %d is not supported by NUMA Cache\n", \
-			cmd->scb[0]);
-#endif
 		goto write;
 	case COMPARE_AND_WRITE:
 		/* Blocks are transferred twice, first the set that
@@ -142,7 +407,12 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 			break;
 		}
 
-		tmpbuf = malloc(length);
+		if (clu && flush_cache_lu(&hc, cmd->tid, cmd->dev->lun)) {
+			set_medium_error(&result, &key, &asc);
+			break;
+		}
+
+		tmpbuf = valloc(length);
 		if (!tmpbuf) {
 			result = SAM_STAT_CHECK_CONDITION;
 			key = HARDWARE_ERROR;
@@ -159,20 +429,6 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 		}
 
 		if (memcmp(scsi_get_out_buffer(cmd), tmpbuf, length)) {
-			uint32_t pos = 0;
-			char *spos = scsi_get_out_buffer(cmd);
-			char *dpos = tmpbuf;
-
-			/*
-			 * Data differed, this is assumed to be 'rare'
-			 * so use a much more expensive byte-by-byte
-			 * comparasion to find out at which offset the
-			 * data differs.
-			 */
-			for (pos = 0; pos < length && *spos++ == *dpos++;
-			     pos++)
-				;
-			info = pos;
 			result = SAM_STAT_CHECK_CONDITION;
 			key = MISCOMPARE;
 			asc = ASC_MISCOMPARE_DURING_VERIFY_OPERATION;
@@ -187,10 +443,6 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 		free(tmpbuf);
 
 		write_buf = scsi_get_out_buffer(cmd) + length;
-#ifdef NUMA_CACHE
-		eprintf("This cmd: %d is not supported by NUMA Cache\n", \
-			cmd->scb[0]);
-#endif
 		goto write;
 	case SYNCHRONIZE_CACHE:
 	case SYNCHRONIZE_CACHE_16:
@@ -201,8 +453,14 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 			result = SAM_STAT_CHECK_CONDITION;
 			key = ILLEGAL_REQUEST;
 			asc = ASC_INVALID_FIELD_IN_CDB;
-		} else
+		} else {
+			/* destage dirty cache blocks of this LUN first */
+			if (clu && flush_cache_lu(&hc, cmd->tid, cmd->dev->lun)) {
+				set_medium_error(&result, &key, &asc);
+				break;
+			}
 			bs_sync_sync_range(cmd, length, &result, &key, &asc);
+		}
 		break;
 	case WRITE_VERIFY:
 	case WRITE_VERIFY_12:
@@ -212,12 +470,15 @@ static void bs_rdwr_request(struct scsi_cmd *cmd)
 	case WRITE_10:
 	case WRITE_12:
 	case WRITE_16:
-#ifndef NUMA_CACHE
+		if (clu)
+			goto cache_write;
 		length = scsi_get_out_length(cmd);
 		write_buf = scsi_get_out_buffer(cmd);
 write:
 		ret = pwrite64(fd, write_buf, length,
 			       offset);
+		if (clu)
+			cache_drop_region(clu, offset, length);
 		if (ret == length) {
 			struct mode_pg *pg;
 			/*
@@ -245,103 +506,174 @@ write:
 
 		if (do_verify)
 			goto verify;
-#else
-write:
+		break;
+cache_write:
 		dprintf("numa cache: =================================\n");
 		dprintf("numa cache: start serving a WRITE io request\n");
 
-		nc = nc_pre = NULL;
+		/* write-back only if the LUN asks for it, the caching
+		 * mode page has WCE set, and this is not a FUA write.
+		 */
+		pg = find_mode_page(cmd->dev, 0x08, 0);
+		fua = ((cmd->scb[0] != WRITE_6) && (cmd->scb[1] & 0x8)) ||
+			pg == NULL || !(pg->mode_data[0] & 0x04);
+		wb = cmd->dev->attrs.cache_wb && !fua;
+
+		held = NULL;
+		batch.nr = 0;
+		around.nr = 0;
+		mode = cache_around_mode(cmd, scsi_get_out_buffer(cmd), 1);
 
-		for (i = 0; i < cmd->nr_sior; i ++, nc_pre = nc) {
+		for (i = 0; i < cmd->nr_sior; i ++) {
 			dprintf("numa cache: sub request %d\n", i);
-			ior = &(cmd->sior[i]);
+			get_sior(cmd, i, ior, &hc);
 			nc = &(hc.nc[ior->nc_id]);
-
-			if (nc != nc_pre) {
-				if (nc_pre != NULL)
-					nc_mutex_unlock(&(nc_pre->mutex));
-				nc_mutex_lock(&(nc->mutex));
+			nc_hold(&held, nc);
+
+			/* a batch is contiguous on disk, it ends here */
+			if (go_around(nc, ior, i, mode, &around)) {
+				misses ++;
+				if (batch.nr) {
+					nc_hold(&held, NULL);
+					if (write_cache_batch(cmd, &batch) != 0)
+						set_medium_error(&result, &key, &asc);
+				}
+				continue;
+			}
+			if (around.nr) {
+				nc_hold(&held, NULL);
+				if (flush_around(cmd, &around, 1) != 0)
+					set_medium_error(&result, &key, &asc);
+				nc_hold(&held, nc);
 			}
 
+			/* a write covering the whole block needs no fill */
+			full = ior->in_offset == 0 && \
+				(ior->length == nc->cbs || \
+				 ior->offset + ior->length >= cmd->dev->size);
+			joined = 0;
 
+retry_write:
 			/* if block is in cache, update it */
 			cb = get_cache_block(ior->tid, ior->lun, \
 					     ior->cb_id, nc);
+			if (cb == NULL || cb->is_valid == CACHE_PENDING) {
+				/* never wait with blocks of a batch reserved,
+				 * they may be the ones waited for
+				 */
+				if (batch.nr) {
+					nc_hold(&held, NULL);
+					if (write_cache_batch(cmd, &batch) != 0)
+						set_medium_error(&result, &key, &asc);
+					nc_hold(&held, nc);
+				} else
+					wait_cache_block(nc);
+				goto retry_write;
+			}
+
+			/* shared data is copied first, wait if that needs
+			 * a slot that is not free yet
+			 */
+			if (cb->is_valid == CACHE_VALID && \
+			    own_cache_block(cb, nc) < 0) {
+				if (batch.nr) {
+					nc_hold(&held, NULL);
+					if (write_cache_batch(cmd, &batch) != 0)
+						set_medium_error(&result, &key, &asc);
+					nc_hold(&held, nc);
+				} else
+					wait_cache_block(nc);
+				goto retry_write;
+			}
+
 			if (cb->is_valid == CACHE_VALID) {	/* hit */
 				dprintf("numa cache: cache hit - update it and write back\n");
-				memcpy(cb->addr + ior->in_offset, \
+				hits ++;
+				memcpy(cb_addr(cb, nc) + ior->in_offset, \
 				       scsi_get_out_buffer(cmd) + ior->m_offset, \
 				       ior->length);
-				/* O_DIRECT only need 512 byte
-				   alignment, instead of page
-				   alignment. Block device is already
-				   512 byte alignment. Therefore, we
-				   need only check whether the length
-				   is 512 byte alignment. */
-				sio_size = ior->length;
-				if ((ior->length % hc.dio_align) != 0) {
-					sio_size = (ior->length / hc.dio_align + 1) * hc.dio_align;
+				if (wb)
+					dirty_cache_block(cb, nc);
+				else {
+					pend_cache_block(cb, nc);
+					filled = 1;
+					joined = 1;
 				}
-
-				ret = pwrite64(fd, cb->addr + ior->in_offset, sio_size, \
-					       ior->offset + ior->in_offset);
-				if (ret != sio_size) {
-					eprintf("numa cache: pwirte64 failed - %d\n", ret);
+			} else {
+				dprintf("numa cache: cache not hit - read it,"
+					" and update it, and write back \n");
+				misses ++;
+				cb->cb_id = ior->cb_id;
+				cb->tid = ior->tid;
+				cb->lun = ior->lun;
+				pend_cache_block(cb, nc);
+
+				filled = full;
+				if (!full) {
+					nc_hold(&held, NULL);
+					filled = read_cache_run(&hc, fd, \
+						cmd->dev->size, ior->cb_id, 1, \
+						&cb, &nc) == 0;
 				}
 
-				continue;
+				/* update cache block */
+				memcpy(cb_addr(cb, nc) + ior->in_offset, \
+				       scsi_get_out_buffer(cmd) + ior->m_offset,\
+				       ior->length);
+
+				if (wb && filled) {
+					nc_hold(&held, nc);
+					dirty_cache_block(cb, nc);
+					complete_cache_block(cb, nc, CACHE_VALID);
+				} else
+					joined = 1;
 			}
 
-			dprintf("numa cache: cache not hit - read it,"
-				" and update it, and write back \n");
-			if ((ior->offset + cb->cbs) < cmd->dev->size)
-				sio_size = cb->cbs;
-			else
-				sio_size = cmd->dev->size - ior->offset - (uint64_t) ior->in_offset;
-			ret = pread64(fd, cb->addr, sio_size, ior->offset);
-			if (ret != sio_size)
-				eprintf("numa cache: pread64 failed - %d\n", ret);
-
-			/* update cache block */
-			memcpy(cb->addr + ior->in_offset, \
-			       scsi_get_out_buffer(cmd) + ior->m_offset,\
-			       ior->length);
-
-			/* write back */
-			sio_size = ior->length;
-			if ((ior->length % hc.dio_align) != 0) {
-				sio_size = (ior->length / hc.dio_align + 1) * hc.dio_align;
+			if (joined) {
+				if (batch.nr == 0)
+					batch.first = i;
+				batch.cb[batch.nr] = cb;
+				batch.nc[batch.nr] = nc;
+				batch.filled[batch.nr] = filled;
+				batch.nr ++;
 			}
-			ret = pwrite64(fd, \
-				       cb->addr + ior->in_offset, \
-				       sio_size, \
-				       ior->offset + ior->in_offset);
-			if (ret != sio_size)
-				eprintf("numa cache: write64 failed - %d\n", ret);
-
-			/* update cb into cache */
-			cb->is_valid = CACHE_VALID;
-			cb->cb_id = ior->cb_id;
-			cb->dev_id = ior->dev_id;
-			cb->tid = ior->tid;
-			cb->lun = ior->lun;
 
-			dprintf("numa cache: insert cache block\n");
-			insert_cache_block(cb, nc);
+			/* write back the sub-IOs gathered so far, they are
+			 * contiguous on disk
+			 */
+			if (batch.nr && (!joined || batch.nr == CACHE_MAX_RUN)) {
+				nc_hold(&held, NULL);
+				if (write_cache_batch(cmd, &batch) != 0)
+					set_medium_error(&result, &key, &asc);
+			}
 		}
 
-		/* unlock current partition */
-		nc_mutex_unlock(&(nc->mutex));
+		nc_hold(&held, NULL);
+		if (batch.nr && write_cache_batch(cmd, &batch) != 0)
+			set_medium_error(&result, &key, &asc);
+		if (flush_around(cmd, &around, 1) != 0)
+			set_medium_error(&result, &key, &asc);
+
+		if (fua && result == SAM_STAT_GOOD)
+			bs_sync_sync_range(cmd, length, &result, &key, &asc);
+
+		count_cache_lu(clu, max(cmd->nodeid, 0), \
+			       hits, misses, 0, cmd->sior_length);
 
 		dprintf("numa cache: finish serve an io request\n");
 		dprintf("numa cache: --------------------------------\n");
-#endif
+
+		if (do_verify && result == SAM_STAT_GOOD)
+			goto verify;
 
 		break;
 	case WRITE_SAME:
 	case WRITE_SAME_16:
 		/* WRITE_SAME used to punch hole in file */
 		if (cmd->scb[1] & 0x08) {
+			if (clu)
+				ret = cache_unmap_region(clu, fd, offset, tl);
+			else
 			ret = unmap_file_region(fd, offset, tl);
 			if (ret != 0) {
 				eprintf("Failed to punch hole for WRITE_SAME"
@@ -353,6 +685,10 @@ write:
 			}
 			break;
 		}
+		if (clu && flush_cache_lu(&hc, cmd->tid, cmd->dev->lun)) {
+			set_medium_error(&result, &key, &asc);
+			break;
+		}
 		while (tl > 0) {
 			blocksize = 1 << cmd->dev->blk_shift;
 			tmpbuf = scsi_get_out_buffer(cmd);
@@ -374,12 +710,15 @@ write:
 			offset += blocksize;
 			tl     -= blocksize;
 		}
+		if (clu)
+			cache_drop_region(clu, cmd->offset, cmd->tl);
 		break;
 	case READ_6:
 	case READ_10:
 	case READ_12:
 	case READ_16:
-#ifndef NUMA_CACHE
+		if (clu)
+			goto cache_read;
 		length = scsi_get_in_length(cmd);
 		ret = pread64(fd, scsi_get_in_buffer(cmd), length,
 			      offset);
@@ -390,68 +729,145 @@ write:
 		if ((cmd->scb[0] != READ_6) && (cmd->scb[1] & 0x10))
 			posix_fadvise(fd, offset, length,
 				      POSIX_FADV_NOREUSE);
-#else
+		break;
+cache_read:
 		/* length = scsi_get_in_length(cmd); */
 		dprintf("numa cache: =================================\n");
 		dprintf("numa cache: start serving a READ io request\n");
 
-		nc = nc_pre = NULL;
-
-		for (i = 0; i < cmd->nr_sior; i ++, nc_pre = nc) {
+		/* queue the next window of a sequential stream before
+		 * this command waits for its own misses, a command too
+		 * large to be cached reads around it
+		 */
+		mode = cache_around_mode(cmd, scsi_get_in_buffer(cmd), 0);
+		if (cmd->nr_sior && mode != CACHE_AROUND_LARGE)
+			cache_readahead(&hc, cmd->tid, cmd->dev->lun, \
+					cmd->sior_cb_id, \
+					cmd->sior_cb_id + cmd->nr_sior - 1);
+
+		held = NULL;
+		around.nr = 0;
+
+		/* over tcp, hits are sent from the blocks themselves */
+		zc = NULL;
+		pinned = 0;
+		if (!cmd->rdma && cmd->nr_sior)
+			zc = calloc(cmd->nr_sior, sizeof(*zc));
+
+		for (i = 0; i < cmd->nr_sior; i ++) {
 			dprintf("numa cache: sub request %d\n", i);
-			ior = &(cmd->sior[i]);
+			get_sior(cmd, i, ior, &hc);
 			nc = &(hc.nc[ior->nc_id]);
+			nc_hold(&held, nc);
 
-			if (nc != nc_pre) {
-				if (nc_pre != NULL)
-					nc_mutex_unlock(&(nc_pre->mutex));
-				nc_mutex_lock(&(nc->mutex));
+			if (go_around(nc, ior, i, mode, &around)) {
+				misses ++;
+				continue;
+			}
+			if (around.nr) {
+				nc_hold(&held, NULL);
+				if (flush_around(cmd, &around, 0) != 0)
+					set_medium_error(&result, &key, &asc);
+				nc_hold(&held, nc);
 			}
 
+retry_read:
 			/* chech if block is in cache */
 			cb = get_cache_block(ior->tid, ior->lun, \
 					     ior->cb_id, nc);
+			if (cb == NULL && pinned) {
+				unpin_hits(cmd, zc, i, &held);
+				pinned = 0;
+				nc_hold(&held, nc);
+				goto retry_read;
+			}
+			if (cb == NULL || cb->is_valid == CACHE_PENDING) {
+				wait_cache_block(nc);
+				goto retry_read;
+			}
+
 			if (cb->is_valid == CACHE_VALID) {	/* hit */
 				dprintf("numa cache: cache hit\n");
-				memcpy(scsi_get_in_buffer(cmd) + ior->m_offset, cb->addr + ior->in_offset, ior->length);
+				hits ++;
+				if (zc && pin_cache_block(cb, nc) == 0) {
+					zc[i].addr = cb_addr(cb, nc) + \
+						ior->in_offset;
+					zc[i].length = ior->length;
+					zc[i].nc_id = ior->nc_id;
+					zc[i].cb = cb;
+					pinned ++;
+					continue;
+				}
+				memcpy(scsi_get_in_buffer(cmd) + ior->m_offset, cb_addr(cb, nc) + ior->in_offset, ior->length);
 				continue;
 			}
 
 			dprintf("numa cache: cache not hit\n");
 			/* not hit */
-			/* load data (cache block) into cache memory */
-			if ((ior->offset + cb->cbs) < cmd->dev->size)
-				sio_size = cb->cbs;
-			else
-				sio_size = cmd->dev->size - ior->offset - (uint64_t) ior->in_offset;
-			dprintf("numa cache: pread data %d bytes offset %ld\n", sio_size, ior->offset);
-			ret = pread64(fd, cb->addr, sio_size, ior->offset);
-			if (ret != cb->cbs)
-				set_medium_error(&result, &key, &asc);
-
-			/* copy data into memory */
-			dprintf("numa cache: copy data into memory\n");
-			dprintf("numa cache: memcpy %" PRId64 " %" PRId64 " %d\n", scsi_get_in_buffer(cmd) + (uint64_t) ior->m_offset, cb->addr + ((uint64_t) ior->in_offset), ior->length);
-			memcpy(scsi_get_in_buffer(cmd) + (uint64_t) ior->m_offset, cb->addr + ((uint64_t) ior->in_offset), ior->length);
-
-			/* update cb into cache */
-			cb->is_valid = CACHE_VALID;
+			/* reserve the block and drop the partition lock */
 			cb->cb_id = ior->cb_id;
-			cb->dev_id = ior->dev_id;
 			cb->tid = ior->tid;
 			cb->lun = ior->lun;
+			pend_cache_block(cb, nc);
+			nc_hold(&held, NULL);
 
-			dprintf("numa cache: insert cache block\n");
-			insert_cache_block(cb, nc);
+			/* the uncached blocks right after it are read with
+			 * the same preadv
+			 */
+			run[0] = cb;
+			rnc[0] = nc;
+			ckey.tid = ior->tid;
+			ckey.lun = ior->lun;
+			ckey.cb_id = ior->cb_id + 1;
+			nr = 1 + reserve_cache_run(&hc, &ckey, \
+				min(cmd->nr_sior - i, CACHE_MAX_RUN) - 1, \
+				run + 1, rnc + 1);
+
+			/* load data (cache blocks) into cache memory */
+			dprintf("numa cache: preadv %d blocks from %" PRIu64 "\n", \
+				nr, ior->cb_id);
+			if (read_cache_run(&hc, fd, cmd->dev->size, ior->cb_id, \
+					   nr, run, rnc) != 0) {
+				set_medium_error(&result, &key, &asc);
+				complete_cache_run(run, rnc, nr, CACHE_INVALID);
+				i += nr - 1;
+				continue;
+			}
+
+			/* copy data into memory */
+			misses += nr;
+			for (j = 0; j < nr; j ++) {
+				get_sior(cmd, i + j, ior, &hc);
+				memcpy(scsi_get_in_buffer(cmd) + (uint64_t) ior->m_offset, \
+				       cb_addr(run[j], rnc[j]) + ior->in_offset, \
+				       ior->length);
+			}
+
+			/* publish cbs in cache */
+			dprintf("numa cache: publish cache blocks\n");
+			complete_cache_run(run, rnc, nr, CACHE_VALID);
+			i += nr - 1;
 		}
-		nc_mutex_unlock(&(nc->mutex));
+		nc_hold(&held, NULL);
+		if (flush_around(cmd, &around, 0) != 0)
+			set_medium_error(&result, &key, &asc);
+		set_cmd_zc(cmd, zc, pinned);
+
+		count_cache_lu(clu, max(cmd->nodeid, 0), \
+			       hits, misses, cmd->sior_length, 0);
 
 		dprintf("numa cache: finish serve an io request\n");
 		dprintf("numa cache: --------------------------------\n");
-#endif
 		break;
 	case PRE_FETCH_10:
 	case PRE_FETCH_16:
+		/* a length of 0 reaches to the end of the lu */
+		if (clu) {
+			cache_prefetch(&hc, cmd->tid, cmd->dev->lun, \
+				       offset / hc.cbs, cmd->tl ? \
+				       (offset + cmd->tl - 1) / hc.cbs : UINT64_MAX);
+			break;
+		}
 		ret = posix_fadvise(fd, offset, cmd->tl,
 				POSIX_FADV_WILLNEED);
 
@@ -461,12 +877,15 @@ write:
 	case VERIFY_10:
 	case VERIFY_12:
 	case VERIFY_16:
-#ifndef NUMA_CACHE
 verify:
-#endif
+		/* compared with the disk, which must hold what was written */
+		if (clu && flush_cache_lu(&hc, cmd->tid, cmd->dev->lun)) {
+			set_medium_error(&result, &key, &asc);
+			break;
+		}
 		length = scsi_get_out_length(cmd);
 
-		tmpbuf = malloc(length);
+		tmpbuf = valloc(length);
 		if (!tmpbuf) {
 			result = SAM_STAT_CHECK_CONDITION;
 			key = HARDWARE_ERROR;
@@ -523,7 +942,12 @@ verify:
 			}
 
 			if (tl > 0) {
-				if (unmap_file_region(fd, offset, tl) != 0) {
+				if (clu)
+					ret = cache_unmap_region(clu, fd, \
+								 offset, tl);
+				else
+				ret = unmap_file_region(fd, offset, tl);
+				if (ret != 0) {
 					eprintf("Failed to punch hole for"
 						" UNMAP at offset:%" PRIu64
 						" length:%d\n",
@@ -554,49 +978,167 @@ verify:
 	}
 }
 
+enum {
+	Opt_cache, Opt_err,
+};
+
+static match_table_t rdwr_tokens = {
+	{Opt_cache, "cache=%s"},
+	{Opt_err, NULL},
+};
+
+/* bsopts of a rdwr LU, "cache=on|off", LUs are not cached by default */
+static int bs_rdwr_parse_opts(struct scsi_lu *lu, int *cache)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *opts, *p, *q, buf[8];
+	int ret = 0;
+
+	*cache = 0;
+	if (!lu->bsopts)
+		return 0;
+
+	opts = q = strdup(lu->bsopts);
+	if (!opts)
+		return -1;
+
+	while (!ret && (p = strsep(&q, ";")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, rdwr_tokens, args)) {
+		case Opt_cache:
+			match_strncpy(buf, &args[0], sizeof(buf));
+			if (!strcmp(buf, "on") || !strcmp(buf, "1"))
+				*cache = 1;
+			else if (!strcmp(buf, "off") || !strcmp(buf, "0"))
+				*cache = 0;
+			else
+				ret = -1;
+			break;
+		default:
+			ret = -1;
+		}
+		if (ret)
+			eprintf("invalid bsopts %s\n", p);
+	}
+
+	free(opts);
+
+	return ret;
+}
+
 static int bs_rdwr_open(struct scsi_lu *lu, char *path, int *fd, uint64_t *size)
 {
 	uint32_t blksize = 0;
+	int oflags = O_LARGEFILE | lu->bsoflags;
+	int cache;
 
+	if (bs_rdwr_parse_opts(lu, &cache) != 0)
+		return -1;
 
-#ifdef NUMA_CACHE
-	*fd = backed_file_open(path, O_RDWR|O_LARGEFILE|O_DIRECT|lu->bsoflags, size,
-				&blksize);
-	if (*fd < 0)
-		eprintf("open file with O_DIRECT fail - %d(%s)\n", \
-			errno, strerror(errno));
-#else
-	*fd = backed_file_open(path, O_RDWR|O_LARGEFILE|lu->bsoflags, size,
-				&blksize);
-#endif
+	/* cache blocks are read and written with O_DIRECT, an uncached
+	 * LU keeps the page cache
+	 */
+	if (cache)
+		oflags |= O_DIRECT;
+
+	*fd = backed_file_open(path, O_RDWR|oflags, size, &blksize);
 	/* If we get access denied, try opening the file in readonly mode */
 	if (*fd == -1 && (errno == EACCES || errno == EROFS)) {
-#ifdef NUMA_CACHE
-		*fd = backed_file_open(path, O_RDONLY|O_LARGEFILE|O_DIRECT|lu->bsoflags,
-				       size, &blksize);
-		if (*fd < 0)
-			eprintf("open file with O_DIRECT fail - %d(%s)\n", \
-				errno, strerror(errno));
-#else
-		*fd = backed_file_open(path, O_RDONLY|O_LARGEFILE|lu->bsoflags,
-				       size, &blksize);
-#endif
+		*fd = backed_file_open(path, O_RDONLY|oflags, size, &blksize);
 		lu->attrs.readonly = 1;
 	}
-	if (*fd < 0)
+	if (*fd < 0) {
+		if (cache)
+			eprintf("open file with O_DIRECT fail - %d(%s)\n", \
+				errno, strerror(errno));
 		return *fd;
+	}
 
 	if (!lu->attrs.no_auto_lbppbe)
 		update_lbppbe(lu, blksize);
 
+	/* O_DIRECT reads never find their data in the page cache */
+	BS_RDWR_I(lu)->nowait = !(oflags & O_DIRECT);
+
+	lu->attrs.cache = cache;
+	if (!cache)
+		return 0;
+
+	/* the write-back destager needs the backing file */
+	BS_THREAD_I(lu)->clu = cache_lu_add(&hc, lu->tgt->tid, lu->lun, \
+					    *fd, *size);
+	if (BS_THREAD_I(lu)->clu == NULL) {
+		close(*fd);
+		return -1;
+	}
+
 	return 0;
 }
 
 static void bs_rdwr_close(struct scsi_lu *lu)
 {
+	if (BS_THREAD_I(lu)->clu) {
+		cache_lu_del(&hc, lu->tgt->tid, lu->lun);
+		BS_THREAD_I(lu)->clu = NULL;
+	}
 	close(lu->fd);
 }
 
+/*
+ * a READ whose data is all in the page cache is served right here, the
+ * rest go to the worker threads. a read that would block fails with
+ * EAGAIN instead.
+ */
+static int bs_rdwr_try_nowait(struct scsi_cmd *cmd)
+{
+	struct bs_rdwr_info *info = BS_RDWR_I(cmd->dev);
+	uint32_t length = scsi_get_in_length(cmd);
+	struct iovec iov;
+	ssize_t ret;
+
+	switch (cmd->scb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		break;
+	default:
+		return -1;
+	}
+
+	iov.iov_base = scsi_get_in_buffer(cmd);
+	iov.iov_len = length;
+	ret = preadv2(cmd->dev->fd, &iov, 1, cmd->offset, RWF_NOWAIT);
+	if (ret != length) {
+		/* no preadv2, or the file system can't tell, stop asking */
+		if (ret < 0 && (errno == EOPNOTSUPP || errno == ENOSYS || \
+				errno == EINVAL)) {
+			eprintf("no RWF_NOWAIT reads for tgt:%d lun:%"PRId64 "\n",
+				cmd->dev->tgt->tid, cmd->dev->lun);
+			info->nowait = 0;
+		}
+		return -1;
+	}
+
+	if ((cmd->scb[0] != READ_6) && (cmd->scb[1] & 0x10))
+		posix_fadvise(cmd->dev->fd, cmd->offset, length,
+			      POSIX_FADV_NOREUSE);
+
+	dprintf("io done inline %p %x %u\n", cmd, cmd->scb[0], length);
+	scsi_set_result(cmd, SAM_STAT_GOOD);
+
+	return 0;
+}
+
+static int bs_rdwr_cmd_submit(struct scsi_cmd *cmd)
+{
+	if (BS_RDWR_I(cmd->dev)->nowait && !bs_rdwr_try_nowait(cmd))
+		return 0;
+
+	return bs_thread_cmd_submit(cmd);
+}
+
 static tgtadm_err bs_rdwr_init(struct scsi_lu *lu)
 {
 	struct bs_thread_info *info = BS_THREAD_I(lu);
@@ -613,12 +1155,12 @@ static void bs_rdwr_exit(struct scsi_lu *lu)
 
 static struct backingstore_template rdwr_bst = {
 	.bs_name		= "rdwr",
-	.bs_datasize		= sizeof(struct bs_thread_info),
+	.bs_datasize		= sizeof(struct bs_rdwr_info),
 	.bs_open		= bs_rdwr_open,
 	.bs_close		= bs_rdwr_close,
 	.bs_init		= bs_rdwr_init,
 	.bs_exit		= bs_rdwr_exit,
-	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_cmd_submit		= bs_rdwr_cmd_submit,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
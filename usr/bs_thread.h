@@ -3,8 +3,9 @@
 
 typedef void (request_func_t) (struct scsi_cmd *);
 
-#ifdef NUMA_CACHE
+#ifndef MAX_NR_NUMA_NODES
 #define MAX_NR_NUMA_NODES	128
+#endif
 
 /*
  * Pre-registered memory.  Buffers are allocated by iscsi from us, handed
@@ -29,32 +30,31 @@ struct tcp_data_buf {
 	char *cur_addr;
 	struct list_head list;
 };
-#endif
-struct bs_thread_info {
-	pthread_t *worker_thread;
-	int nr_worker_threads;
+#define BS_MAX_POOLS	MAX_NR_NUMA_NODES
 
-#ifndef NUMA_CACHE
-	/* wokers sleep on this and signaled by tgtd */
-	pthread_cond_t pending_cond;
-	/* locked by tgtd and workers */
-	pthread_mutex_t pending_lock;
-	/* protected by pending_lock */
+/* commands of a lu for the workers of one pool, protected by the
+ * pool lock
+ */
+struct bs_thread_queue {
 	struct list_head pending_list;
-#else
-	int nr_numa_nodes;
-	int thr_node_id;	/* current thread node id for numa */
+	/* on the ready list of the pool while it has work to hand out */
+	struct list_head ready_list;
+	int busy;			/* workers running its commands */
+	int stop;			/* the lu is closing */
+	struct bs_thread_info *info;
+};
 
-	/* wokers sleep on this and signaled by tgtd */
-	pthread_cond_t pending_cond[MAX_NR_NUMA_NODES];
-	/* locked by tgtd and workers */
-	pthread_mutex_t pending_lock[MAX_NR_NUMA_NODES];
-	/* protected by pending_lock */
-	struct list_head pending_list[MAX_NR_NUMA_NODES];
-#endif
-	pthread_mutex_t startup_lock;
+/* lus share one pool of workers per numa node, or a single pool. the
+ * workers of a pool go round the lus with pending commands.
+ */
+struct bs_thread_info {
+	/* workers of a pool running its commands at most */
+	int nr_worker_threads;
+	/* the one pool of a lu asking for a single thread, else -1 */
+	int pool;
 
-	int stop;
+	struct cache_lu *clu;	/* cache state of this lu */
+	struct bs_thread_queue q[BS_MAX_POOLS];
 
 	request_func_t *request_fn;
 };
@@ -70,6 +70,7 @@ extern void bs_thread_close(struct bs_thread_info *info);
 extern int bs_thread_cmd_submit(struct scsi_cmd *cmd);
 
 extern int nr_iothreads;
+extern int nr_workers;
 
 #endif
 
@@ -0,0 +1,788 @@
+/*
+ * io_uring backing store
+ *
+ * Each LU has a ring with its file registered as fixed file 0. Commands
+ * queued in one event loop iteration are submitted together, the ring
+ * signals completions through an eventfd drained in the main loop.
+ * Reads and writes into the memory pools of the network drivers use
+ * their registered buffers. "sqpoll=on" in bsopts lets a kernel thread,
+ * shared by all such rings, poll the submission queue.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "target.h"
+#include "scsi.h"
+#include "parser.h"
+
+#ifndef O_DIRECT
+#define O_DIRECT 040000
+#endif
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#define __NR_io_uring_enter	426
+#define __NR_io_uring_register	427
+#endif
+
+#ifndef RWF_DSYNC
+#define RWF_DSYNC	0x00000002
+#endif
+
+#define URING_IODEPTH		128
+#define URING_SQ_THREAD_IDLE	1000	/* ms */
+
+struct bs_uring_info {
+	/* on bs_uring_dev_list while it has sqes to submit */
+	struct list_head dev_list_entry;
+
+	int ring_fd;
+	int evt_fd;
+	int sqpoll;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	/* sqes filled and not yet submitted */
+	unsigned nqueued;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+
+	/* cmds waiting for room in the ring */
+	struct list_head cmd_wait_list;
+	unsigned int nwaiting;
+	unsigned int npending;
+
+	/* bs_fixed_buffers() generation registered with the ring */
+	unsigned int buf_gen;
+	int nr_bufs;
+
+	struct scsi_lu *lu;
+};
+
+static struct list_head bs_uring_dev_list = LIST_HEAD_INIT(bs_uring_dev_list);
+
+/* ring whose sq thread the others with sqpoll share */
+static int sqpoll_fd = -1;
+
+static inline struct bs_uring_info *BS_URING_I(struct scsi_lu *lu)
+{
+	return (struct bs_uring_info *) ((char *)lu + sizeof(*lu));
+}
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+			     unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* register the buffer pools the network drivers have now */
+static void bs_uring_update_buffers(struct bs_uring_info *info)
+{
+	struct iovec *iov;
+	unsigned int gen;
+	int nr, ret;
+
+	nr = bs_fixed_buffers(&iov, &gen);
+	if (gen == info->buf_gen)
+		return;
+
+	if (info->nr_bufs)
+		io_uring_register(info->ring_fd, IORING_UNREGISTER_BUFFERS,
+				  NULL, 0);
+	info->nr_bufs = 0;
+	info->buf_gen = gen;
+	if (!nr)
+		return;
+
+	ret = io_uring_register(info->ring_fd, IORING_REGISTER_BUFFERS,
+				iov, nr);
+	if (ret) {
+		/* plain reads and writes then */
+		eprintf("failed to register %d buffers for tgt:%d lun:%"PRId64
+			", %m\n", nr, info->lu->tgt->tid, info->lu->lun);
+		return;
+	}
+	info->nr_bufs = nr;
+}
+
+/* index of the registered buffer holding [buf, buf + len), or -1 */
+static int bs_uring_buf_index(struct bs_uring_info *info, char *buf,
+			      uint32_t len)
+{
+	struct iovec *iov;
+	unsigned int gen;
+	int i;
+
+	if (!info->nr_bufs)
+		return -1;
+
+	bs_fixed_buffers(&iov, &gen);
+	for (i = 0; i < info->nr_bufs; i++) {
+		if (buf >= (char *) iov[i].iov_base &&
+		    buf + len <= (char *) iov[i].iov_base + iov[i].iov_len)
+			return i;
+	}
+
+	return -1;
+}
+
+static struct io_uring_sqe *bs_uring_get_sqe(struct bs_uring_info *info)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *info->sq_tail + info->nqueued;
+
+	sqe = &info->sqes[tail & info->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	info->sq_array[tail & info->sq_mask] = tail & info->sq_mask;
+	info->nqueued++;
+
+	/* the file is fixed file 0 of the ring */
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+
+	return sqe;
+}
+
+/* next UNMAP descriptor from cmd->offset, which tracks the parameter
+ * list position of an UNMAP. 0 when there is none left.
+ */
+static uint32_t bs_uring_next_unmap(struct scsi_cmd *cmd, uint64_t *offset)
+{
+	char *buf = scsi_get_out_buffer(cmd);
+	uint32_t length = scsi_get_out_length(cmd), tl;
+
+	if (cmd->offset < 8)
+		cmd->offset = 8;
+
+	for (; cmd->offset + 16 <= length; cmd->offset += 16) {
+		*offset = get_unaligned_be64(buf + cmd->offset);
+		*offset <<= cmd->dev->blk_shift;
+		tl = get_unaligned_be32(buf + cmd->offset + 8);
+		if (tl) {
+			cmd->offset += 16;
+			return tl << cmd->dev->blk_shift;
+		}
+	}
+
+	return 0;
+}
+
+static void bs_uring_prep(struct bs_uring_info *info, struct scsi_cmd *cmd)
+{
+	struct io_uring_sqe *sqe = bs_uring_get_sqe(info);
+	unsigned int scsi_op = (unsigned int)cmd->scb[0];
+	uint64_t offset;
+	uint32_t len;
+	char *buf;
+	int idx;
+
+	sqe->user_data = (unsigned long) cmd;
+
+	switch (scsi_op) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		buf = scsi_get_out_buffer(cmd);
+		len = scsi_get_out_length(cmd);
+		sqe->opcode = IORING_OP_WRITE;
+		/* FUA */
+		if (scsi_op != WRITE_6 && (cmd->scb[1] & 0x8))
+			sqe->rw_flags = RWF_DSYNC;
+		break;
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		buf = scsi_get_in_buffer(cmd);
+		len = scsi_get_in_length(cmd);
+		sqe->opcode = IORING_OP_READ;
+		break;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+		return;
+	case UNMAP:
+		len = bs_uring_next_unmap(cmd, &offset);
+		if (!len) {
+			sqe->opcode = IORING_OP_NOP;
+			sqe->flags = 0;
+			return;
+		}
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+		sqe->off = offset;
+		sqe->addr = len;
+		return;
+	default:
+		return;
+	}
+
+	idx = bs_uring_buf_index(info, buf, len);
+	if (idx >= 0) {
+		sqe->opcode = sqe->opcode == IORING_OP_WRITE ?
+			IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = idx;
+	}
+	sqe->addr = (unsigned long) buf;
+	sqe->len = len;
+	sqe->off = cmd->offset;
+
+	dprintf("prep cmd:%p op:%x buf:%p sz:%x fixed:%d\n",
+		cmd, scsi_op, buf, len, idx);
+}
+
+/* move waiting cmds into the ring while there is room */
+static void bs_uring_fill(struct bs_uring_info *info)
+{
+	struct scsi_cmd *cmd;
+
+	while (info->nwaiting &&
+	       info->npending + info->nqueued < info->sq_entries) {
+		cmd = list_first_entry(&info->cmd_wait_list,
+				       struct scsi_cmd, bs_list);
+		list_del(&cmd->bs_list);
+		info->nwaiting--;
+		bs_uring_prep(info, cmd);
+	}
+}
+
+/* sqes published but not taken by the kernel yet, a short submit
+ * leaves them in the ring
+ */
+static inline unsigned bs_uring_unsubmitted(struct bs_uring_info *info)
+{
+	if (info->sqpoll)
+		return 0;
+
+	return *info->sq_tail - __atomic_load_n(info->sq_head,
+						__ATOMIC_ACQUIRE);
+}
+
+static int bs_uring_submit_dev_batch(struct bs_uring_info *info)
+{
+	unsigned nsubmit;
+	int ret;
+
+	bs_uring_update_buffers(info);
+	bs_uring_fill(info);
+
+	/* the kernel sees the sqes once the tail is published */
+	if (info->nqueued) {
+		__atomic_store_n(info->sq_tail, *info->sq_tail + info->nqueued,
+				 __ATOMIC_RELEASE);
+		info->npending += info->nqueued;
+		info->nqueued = 0;
+	}
+
+	/* the sq thread takes the sqes, it only needs a wakeup */
+	if (info->sqpoll) {
+		if ((__atomic_load_n(info->sq_flags, __ATOMIC_ACQUIRE) &
+		     IORING_SQ_NEED_WAKEUP) &&
+		    io_uring_enter(info->ring_fd, 0, 0,
+				   IORING_ENTER_SQ_WAKEUP) < 0)
+			eprintf("failed to wake up sq thread, %m\n");
+		goto out;
+	}
+
+	/* the kernel may take fewer sqes than asked, enter until all are */
+	while ((nsubmit = bs_uring_unsubmitted(info)) != 0) {
+		ret = io_uring_enter(info->ring_fd, nsubmit, 0, 0);
+		if (ret >= 0) {
+			dprintf("submitted %d of %d cmds to tgt:%d lun:%"PRId64
+				", waiting:%d pending:%d\n", ret, nsubmit,
+				info->lu->tgt->tid, info->lu->lun,
+				info->nwaiting, info->npending);
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EBUSY) {
+			/* the rest go with the enter after the next
+			 * completion when one is on its way
+			 */
+			if (info->npending > (unsigned) nsubmit)
+				break;
+			continue;
+		}
+		eprintf("failed to submit %d cmds to tgt:%d lun:%"PRId64
+			", %m\n", nsubmit, info->lu->tgt->tid, info->lu->lun);
+		return -1;
+	}
+out:
+	if (!info->nwaiting)
+		list_del_init(&info->dev_list_entry);
+
+	return 0;
+}
+
+static int bs_uring_submit_all_devs(void)
+{
+	struct bs_uring_info *dev_info, *next_dev;
+	int err;
+
+	/* pass over all devices having some queued cmds and submit */
+	list_for_each_entry_safe(dev_info, next_dev, &bs_uring_dev_list,
+				 dev_list_entry) {
+		err = bs_uring_submit_dev_batch(dev_info);
+		if (unlikely(err))
+			return err;
+	}
+	return 0;
+}
+
+static int bs_uring_cmd_submit(struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	struct bs_uring_info *info = BS_URING_I(lu);
+	unsigned int scsi_op = (unsigned int)cmd->scb[0];
+
+	switch (scsi_op) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		break;
+
+	case UNMAP:
+		/* descriptors are punched one after another */
+		cmd->offset = 0;
+		break;
+
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		eprintf("WRITE_SAME not yet supported for io_uring backend.\n");
+		return -1;
+
+	default:
+		dprintf("skipped cmd:%p op:%x\n", cmd, scsi_op);
+		return 0;
+	}
+
+	list_add_tail(&cmd->bs_list, &info->cmd_wait_list);
+	if (list_empty(&info->dev_list_entry))
+		list_add_tail(&info->dev_list_entry, &bs_uring_dev_list);
+	info->nwaiting++;
+	set_cmd_async(cmd);
+
+	if (!cmd_not_last(cmd)) /* last cmd in batch */
+		return bs_uring_submit_all_devs();
+
+	if (info->nwaiting == info->sq_entries - info->npending)
+		return bs_uring_submit_dev_batch(info);
+
+	return 0;
+}
+
+static void bs_uring_complete_one(struct bs_uring_info *info,
+				  struct io_uring_cqe *cqe)
+{
+	struct scsi_cmd *cmd = (void *)(unsigned long)cqe->user_data;
+	unsigned char key = MEDIUM_ERROR;
+	uint16_t asc = 0;
+	uint32_t length;
+	int result;
+
+	switch (cmd->scb[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		length = scsi_get_out_length(cmd);
+		break;
+	case UNMAP:
+		if (cqe->res == 0 && cmd->offset + 16 <= scsi_get_out_length(cmd)) {
+			/* punch the next descriptor */
+			list_add(&cmd->bs_list, &info->cmd_wait_list);
+			info->nwaiting++;
+			return;
+		}
+		key = HARDWARE_ERROR;
+		asc = ASC_INTERNAL_TGT_FAILURE;
+		/* fall through */
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		length = 0;
+		break;
+	default:
+		length = scsi_get_in_length(cmd);
+		break;
+	}
+
+	if (likely(cqe->res == length))
+		result = SAM_STAT_GOOD;
+	else {
+		eprintf("cmd:%p op:%x failed, %d\n", cmd, cmd->scb[0],
+			cqe->res);
+		sense_data_build(cmd, key, asc);
+		result = SAM_STAT_CHECK_CONDITION;
+	}
+	dprintf("cmd: %p\n", cmd);
+	target_cmd_io_done(cmd, result);
+}
+
+static void bs_uring_get_completions(int fd, int events, void *data)
+{
+	struct bs_uring_info *info = data;
+	struct io_uring_cqe *cqe;
+	unsigned head, tail;
+	uint64_t evts_complete;
+	int ret;
+
+retry_read:
+	ret = read(info->evt_fd, &evts_complete, sizeof(evts_complete));
+	if (unlikely(ret < 0)) {
+		if (errno == EINTR)
+			goto retry_read;
+		if (errno != EAGAIN)
+			eprintf("failed to read io_uring completions, %m\n");
+		return;
+	}
+
+	head = *info->cq_head;
+	tail = __atomic_load_n(info->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		for (; head != tail; head++) {
+			cqe = &info->cqes[head & info->cq_mask];
+			info->npending--;
+			bs_uring_complete_one(info, cqe);
+		}
+		__atomic_store_n(info->cq_head, head, __ATOMIC_RELEASE);
+		tail = __atomic_load_n(info->cq_tail, __ATOMIC_ACQUIRE);
+	}
+
+	if (info->nwaiting || bs_uring_unsubmitted(info)) {
+		dprintf("submit waiting cmds to tgt:%d lun:%"PRId64 "\n",
+			info->lu->tgt->tid, info->lu->lun);
+		if (list_empty(&info->dev_list_entry))
+			list_add_tail(&info->dev_list_entry,
+				      &bs_uring_dev_list);
+		bs_uring_submit_dev_batch(info);
+	}
+}
+
+static void bs_uring_unmap_rings(struct bs_uring_info *info)
+{
+	if (info->sqes)
+		munmap(info->sqes, info->sqes_sz);
+	if (info->cq_ring)
+		munmap(info->cq_ring, info->cq_ring_sz);
+	if (info->sq_ring)
+		munmap(info->sq_ring, info->sq_ring_sz);
+	info->sqes = NULL;
+	info->cq_ring = NULL;
+	info->sq_ring = NULL;
+}
+
+static int bs_uring_setup(struct bs_uring_info *info)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	if (info->sqpoll) {
+		p.flags = IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_THREAD_IDLE;
+		if (sqpoll_fd >= 0) {
+			p.flags |= IORING_SETUP_ATTACH_WQ;
+			p.wq_fd = sqpoll_fd;
+		}
+	}
+
+	info->ring_fd = io_uring_setup(URING_IODEPTH, &p);
+	if (info->ring_fd < 0) {
+		eprintf("failed to create io_uring, %m\n");
+		return -1;
+	}
+	if (info->sqpoll && sqpoll_fd < 0)
+		sqpoll_fd = info->ring_fd;
+
+	info->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	info->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	info->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq = mmap(NULL, info->sq_ring_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, info->ring_fd, IORING_OFF_SQ_RING);
+	cq = mmap(NULL, info->cq_ring_sz, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, info->ring_fd, IORING_OFF_CQ_RING);
+	info->sqes = mmap(NULL, info->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, info->ring_fd,
+			  IORING_OFF_SQES);
+	info->sq_ring = sq == MAP_FAILED ? NULL : sq;
+	info->cq_ring = cq == MAP_FAILED ? NULL : cq;
+	if (info->sqes == MAP_FAILED)
+		info->sqes = NULL;
+	if (!info->sq_ring || !info->cq_ring || !info->sqes) {
+		eprintf("failed to map io_uring, %m\n");
+		bs_uring_unmap_rings(info);
+		close(info->ring_fd);
+		return -1;
+	}
+
+	info->sq_head = (unsigned *) (sq + p.sq_off.head);
+	info->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	info->sq_flags = (unsigned *) (sq + p.sq_off.flags);
+	info->sq_array = (unsigned *) (sq + p.sq_off.array);
+	info->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+	info->sq_entries = p.sq_entries;
+
+	info->cq_head = (unsigned *) (cq + p.cq_off.head);
+	info->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	info->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+	info->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+static void bs_uring_teardown(struct bs_uring_info *info)
+{
+	bs_uring_unmap_rings(info);
+	if (sqpoll_fd == info->ring_fd)
+		sqpoll_fd = -1;
+	close(info->ring_fd);
+	info->ring_fd = -1;
+}
+
+enum {
+	Opt_sqpoll, Opt_err,
+};
+
+static match_table_t uring_tokens = {
+	{Opt_sqpoll, "sqpoll=%s"},
+	{Opt_err, NULL},
+};
+
+/* bsopts of an io_uring LU, "sqpoll=on|off", off by default */
+static int bs_uring_parse_opts(struct scsi_lu *lu, int *sqpoll)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *opts, *p, *q, buf[8];
+	int ret = 0;
+
+	*sqpoll = 0;
+	if (!lu->bsopts)
+		return 0;
+
+	opts = q = strdup(lu->bsopts);
+	if (!opts)
+		return -1;
+
+	while (!ret && (p = strsep(&q, ";")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, uring_tokens, args)) {
+		case Opt_sqpoll:
+			match_strncpy(buf, &args[0], sizeof(buf));
+			if (!strcmp(buf, "on") || !strcmp(buf, "1"))
+				*sqpoll = 1;
+			else if (!strcmp(buf, "off") || !strcmp(buf, "0"))
+				*sqpoll = 0;
+			else
+				ret = -1;
+			break;
+		default:
+			ret = -1;
+		}
+		if (ret)
+			eprintf("invalid bsopts %s\n", p);
+	}
+
+	free(opts);
+
+	return ret;
+}
+
+static int bs_uring_open(struct scsi_lu *lu, char *path, int *fd, uint64_t *size)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+	uint32_t blksize = 0;
+	int ret, efd;
+
+	if (bs_uring_parse_opts(lu, &info->sqpoll) != 0)
+		return -1;
+
+	eprintf("create io_uring for tgt:%d lun:%"PRId64 ", depth:%d%s\n",
+		info->lu->tgt->tid, info->lu->lun, URING_IODEPTH,
+		info->sqpoll ? ", sqpoll" : "");
+	ret = bs_uring_setup(info);
+	if (ret)
+		return -1;
+
+	efd = eventfd(0, O_NONBLOCK);
+	if (efd < 0) {
+		eprintf("failed to create eventfd for tgt:%d lun:%"PRId64 ", %m\n",
+			info->lu->tgt->tid, info->lu->lun);
+		ret = efd;
+		goto close_ring;
+	}
+
+	ret = io_uring_register(info->ring_fd, IORING_REGISTER_EVENTFD,
+				&efd, 1);
+	if (ret) {
+		eprintf("failed to register eventfd, %m\n");
+		goto close_eventfd;
+	}
+
+	ret = tgt_event_add(efd, EPOLLIN, bs_uring_get_completions, info);
+	if (ret)
+		goto close_eventfd;
+	info->evt_fd = efd;
+
+	eprintf("open %s, RW, O_DIRECT for tgt:%d lun:%"PRId64 "\n",
+		path, info->lu->tgt->tid, info->lu->lun);
+	*fd = backed_file_open(path, O_RDWR|O_LARGEFILE|O_DIRECT, size,
+				&blksize);
+	/* If we get access denied, try opening the file in readonly mode */
+	if (*fd == -1 && (errno == EACCES || errno == EROFS)) {
+		eprintf("open %s, READONLY, O_DIRECT for tgt:%d lun:%"PRId64 "\n",
+			path, info->lu->tgt->tid, info->lu->lun);
+		*fd = backed_file_open(path, O_RDONLY|O_LARGEFILE|O_DIRECT,
+				       size, &blksize);
+		lu->attrs.readonly = 1;
+	}
+	if (*fd < 0) {
+		eprintf("failed to open %s, for tgt:%d lun:%"PRId64 ", %m\n",
+			path, info->lu->tgt->tid, info->lu->lun);
+		ret = *fd;
+		goto remove_tgt_evt;
+	}
+
+	ret = io_uring_register(info->ring_fd, IORING_REGISTER_FILES, fd, 1);
+	if (ret) {
+		eprintf("failed to register %s, %m\n", path);
+		close(*fd);
+		goto remove_tgt_evt;
+	}
+
+	bs_uring_update_buffers(info);
+
+	eprintf("%s opened successfully for tgt:%d lun:%"PRId64 "\n",
+		path, info->lu->tgt->tid, info->lu->lun);
+
+	if (!lu->attrs.no_auto_lbppbe)
+		update_lbppbe(lu, blksize);
+
+	return 0;
+
+remove_tgt_evt:
+	tgt_event_del(efd);
+close_eventfd:
+	close(efd);
+	info->evt_fd = -1;
+close_ring:
+	bs_uring_teardown(info);
+	return ret;
+}
+
+static void bs_uring_close(struct scsi_lu *lu)
+{
+	close(lu->fd);
+}
+
+static tgtadm_err bs_uring_init(struct scsi_lu *lu)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+
+	memset(info, 0, sizeof(*info));
+	INIT_LIST_HEAD(&info->dev_list_entry);
+	INIT_LIST_HEAD(&info->cmd_wait_list);
+	info->lu = lu;
+	info->ring_fd = -1;
+	info->evt_fd = -1;
+
+	return TGTADM_SUCCESS;
+}
+
+static void bs_uring_exit(struct scsi_lu *lu)
+{
+	struct bs_uring_info *info = BS_URING_I(lu);
+
+	if (info->evt_fd >= 0) {
+		tgt_event_del(info->evt_fd);
+		close(info->evt_fd);
+	}
+	if (info->ring_fd >= 0)
+		bs_uring_teardown(info);
+	list_del_init(&info->dev_list_entry);
+}
+
+static struct backingstore_template uring_bst = {
+	.bs_name		= "uring",
+	.bs_datasize		= sizeof(struct bs_uring_info),
+	.bs_init		= bs_uring_init,
+	.bs_exit		= bs_uring_exit,
+	.bs_open		= bs_uring_open,
+	.bs_close		= bs_uring_close,
+	.bs_cmd_submit		= bs_uring_cmd_submit,
+};
+
+__attribute__((constructor)) static void bs_uring_constructor(void)
+{
+	register_backingstore_template(&uring_bst);
+}
@@ -2,7 +2,14 @@
  * Yufei Ren (yufei.ren@stonybrook.edu)
  */
 
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+
 #include "cache.h"
+#include "util.h"
 
 void init_cache_param(struct cache_param *cp)
 {
@@ -10,21 +17,564 @@ void init_cache_param(struct cache_param *cp)
 	cp->cache_way = 1;
 	cp->cb_group = 1;
 	cp->buffer_size = 1024 * 1024 * 1024;
+	cp->policy = "lru";
+	cp->ra_max = CACHE_RA_MAX;
+	cp->admit = 1;
+	cp->bypass = 0;
+	cp->dedup = 0;
+	cp->node_size = NULL;
+	cp->page = CACHE_PAGE_NORMAL;
+	cp->mem = NULL;
 
 	return;
 }
 
-int init_cache(struct host_cache *hc, struct cache_param *cp)
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB	(21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB	(30 << MAP_HUGE_SHIFT)
+#endif
+
+/* libnuma is loaded at run time. a host without it, or where it finds
+ * no NUMA support, runs the cache as one node.
+ */
+static struct {
+	int (*available)(void);
+	int (*num_configured_nodes)(void);
+	int (*run_on_node)(int node);
+	int (*run_on_node_mask)(struct bitmask *mask);
+	struct bitmask *(*get_run_node_mask)(void);
+	void (*bitmask_free)(struct bitmask *mask);
+	void (*set_preferred)(int node);
+	void (*tonode_memory)(void *start, size_t size, int node);
+	void *(*alloc_onnode)(size_t size, int node);
+	long long (*node_size64)(int node, long long *freep);
+	int (*distance)(int from, int to);
+} numa_fn;
+
+static int cache_numa = -1;
+
+#define NUMA_SYM(h, f)	(*(void **) &(numa_fn.f) = dlsym(h, "numa_" #f))
+
+static int load_libnuma(void)
+{
+	void *h;
+
+	h = dlopen("libnuma.so.1", RTLD_NOW);
+	if (h == NULL) {
+		eprintf("numa cache: %s\n", dlerror());
+		return 0;
+	}
+
+	if (!NUMA_SYM(h, available) || !NUMA_SYM(h, num_configured_nodes) || \
+	    !NUMA_SYM(h, run_on_node) || !NUMA_SYM(h, run_on_node_mask) || \
+	    !NUMA_SYM(h, get_run_node_mask) || !NUMA_SYM(h, bitmask_free) || \
+	    !NUMA_SYM(h, set_preferred) || !NUMA_SYM(h, tonode_memory) || \
+	    !NUMA_SYM(h, alloc_onnode) || !NUMA_SYM(h, node_size64) || \
+	    !NUMA_SYM(h, distance)) {
+		eprintf("numa cache: %s\n", dlerror());
+		dlclose(h);
+		return 0;
+	}
+
+	if (numa_fn.available() < 0) {
+		dlclose(h);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int cache_numa_on(void)
+{
+	if (cache_numa < 0) {
+		cache_numa = load_libnuma();
+		if (!cache_numa)
+			eprintf("numa cache: no NUMA support, use one node\n");
+	}
+
+	return cache_numa;
+}
+
+int cache_nr_nodes(void)
+{
+	return cache_numa_on() ? numa_fn.num_configured_nodes() : 1;
+}
+
+int cache_run_on_node(int node)
+{
+	return cache_numa_on() ? numa_fn.run_on_node(node) : 0;
+}
+
+/* nodes the calling thread runs on, for cache_restore_run_mask() */
+struct bitmask *cache_save_run_mask(void)
+{
+	return cache_numa_on() ? numa_fn.get_run_node_mask() : NULL;
+}
+
+void cache_restore_run_mask(struct bitmask *mask)
+{
+	if (mask == NULL)
+		return;
+
+	numa_fn.run_on_node_mask(mask);
+	numa_fn.bitmask_free(mask);
+}
+
+void cache_set_preferred(int node)
+{
+	if (cache_numa_on())
+		numa_fn.set_preferred(node);
+}
+
+/* SLIT distance of two nodes, 0 if not known */
+int cache_node_distance(int from, int to)
+{
+	return cache_numa_on() ? numa_fn.distance(from, to) : 0;
+}
+
+/* free memory of a node, of the host without NUMA */
+static long long cache_node_free(int node)
+{
+	long long free_size;
+
+	if (!cache_numa_on())
+		return (long long) sysconf(_SC_AVPHYS_PAGES) * \
+			sysconf(_SC_PAGESIZE);
+
+	if (numa_fn.node_size64(node, &free_size) < 0)
+		return 0;
+
+	return free_size;
+}
+
+static void cache_tonode_memory(void *addr, size_t len, int node)
+{
+	if (cache_numa_on())
+		numa_fn.tonode_memory(addr, len, node);
+}
+
+/* small metadata arrays of a partition, zeroed */
+void *cache_numa_alloc(size_t size, int node)
+{
+	void *addr;
+
+	if (cache_numa_on())
+		return numa_fn.alloc_onnode(size, node);
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, \
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return addr == MAP_FAILED ? NULL : addr;
+}
+
+static struct {
+	const char *name;
+	int page;
+} cache_page_modes[] = {
+	{"4k", CACHE_PAGE_NORMAL},
+	{"thp", CACHE_PAGE_THP},
+	{"2m", CACHE_PAGE_2M},
+	{"1g", CACHE_PAGE_1G},
+};
+
+int cache_page_mode(const char *name)
 {
 	int i;
-	int total_nc;
 
-	if (numa_available() != 0) {
-		eprintf("Does not support NUMA API\n");
+	for (i = 0; i < ARRAY_SIZE(cache_page_modes); i ++)
+		if (strcasecmp(cache_page_modes[i].name, name) == 0)
+			return cache_page_modes[i].page;
+
+	return -1;
+}
+
+static size_t cache_page_size(int page)
+{
+	switch (page) {
+	case CACHE_PAGE_1G:
+		return 1UL << 30;
+	case CACHE_PAGE_2M:
+	case CACHE_PAGE_THP:
+		return 1UL << 21;
+	default:
+		return getpagesize();
+	}
+}
+
+/* hugetlb pages are reserved per host but faulted per node, a node
+ * running out of them would SIGBUS on first touch
+ */
+static long node_free_hugepages(int node, size_t pgsz)
+{
+	char path[128];
+	FILE *fp;
+	long nr = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/"
+		 "hugepages/hugepages-%zukB/free_hugepages", node, pgsz >> 10);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	if (fscanf(fp, "%ld", &nr) != 1)
+		nr = 0;
+	fclose(fp);
+
+	return nr;
+}
+
+/* map memory bound to a numa node, backed by hugetlb pages if there
+ * are enough free on the node, else by transparent hugepages. memory
+ * is not touched, see cache_fault_in().
+ */
+void *cache_alloc_onnode(size_t size, int node, int page, size_t *len)
+{
+	size_t pgsz, head;
+	char *p;
+
+	if (page == CACHE_PAGE_2M || page == CACHE_PAGE_1G) {
+		pgsz = cache_page_size(page);
+		*len = (size + pgsz - 1) & ~(pgsz - 1);
+
+		if (node_free_hugepages(node, pgsz) >= (long) (*len / pgsz)) {
+			p = mmap(NULL, *len, PROT_READ | PROT_WRITE, \
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | \
+				 (page == CACHE_PAGE_1G ? MAP_HUGE_1GB : MAP_HUGE_2MB), \
+				 -1, 0);
+			if (p != MAP_FAILED) {
+				cache_tonode_memory(p, *len, node);
+				return p;
+			}
+		}
+		eprintf("numa cache: not enough %zukB hugepages on node %d, "
+			"use transparent hugepages\n", pgsz >> 10, node);
+		page = CACHE_PAGE_THP;
+	}
+
+	pgsz = cache_page_size(page);
+	*len = (size + pgsz - 1) & ~(pgsz - 1);
+
+	/* over map so that the buffer starts on a hugepage boundary */
+	p = mmap(NULL, *len + pgsz, PROT_READ | PROT_WRITE, \
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	head = (pgsz - ((unsigned long) p & (pgsz - 1))) & (pgsz - 1);
+	if (head)
+		munmap(p, head);
+	munmap(p + head + *len, pgsz - head);
+	p += head;
+
+	if (page == CACHE_PAGE_THP && madvise(p, *len, MADV_HUGEPAGE))
+		eprintf("numa cache: madvise hugepage failed, %m\n");
+
+	cache_tonode_memory(p, *len, node);
+
+	return p;
+}
+
+void cache_free_onnode(void *addr, size_t len)
+{
+	munmap(addr, len);
+}
+
+static void *cache_fault_fn(void *arg)
+{
+	struct cache_fault *f = arg;
+	size_t off, pgsz = getpagesize();
+
+	cache_run_on_node(f->node);
+
+	for (off = 0; off < f->len; off += pgsz) {
+		if (f->keep)
+			(void) *(volatile char *) (f->addr + off);
+		else
+			*(volatile char *) (f->addr + off) = 0;
+	}
+
+	return NULL;
+}
+
+/* touch every page, one thread per range, so that nodes fault in
+ * their memory in parallel rather than one memset after another
+ */
+void cache_fault_in(struct cache_fault *f, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i ++) {
+		if (pthread_create(&(f[i].thread), NULL, cache_fault_fn, &f[i])) {
+			eprintf("numa cache: fault in thread failed\n");
+			cache_fault_fn(&f[i]);
+			f[i].thread = 0;
+		}
+	}
+
+	for (i = 0; i < nr; i ++)
+		if (f[i].thread)
+			pthread_join(f[i].thread, NULL);
+}
+
+/* warm restart. with cache_param.mem each partition lives in a file
+ * under that directory, on tmpfs or DAX, and is mapped again on the
+ * next start. a partition is only trusted if it was saved clean with
+ * the lu table of the same generation, and a lu only keeps its blocks
+ * if it is added again with the same backing file.
+ */
+static void load_saved_lu(struct host_cache *hc)
+{
+	struct cache_shm_lu_hdr h;
+	char path[PATH_MAX];
+	FILE *fp;
+
+	hc->generation = 0;
+	hc->saved_lu = NULL;
+	hc->nr_saved_lu = 0;
+
+	snprintf(path, sizeof(path), "%s/tgtd-cache-lu", hc->mem);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+
+	if (fread(&h, sizeof(h), 1, fp) != 1 || h.magic != CACHE_SHM_MAGIC || \
+	    h.version != CACHE_SHM_VERSION)
+		goto out;
+
+	hc->saved_lu = calloc(h.nr + 1, sizeof(struct cache_shm_lu));
+	if (hc->saved_lu == NULL)
+		goto out;
+
+	if (fread(hc->saved_lu, sizeof(struct cache_shm_lu), h.nr, fp) != h.nr) {
+		free(hc->saved_lu);
+		hc->saved_lu = NULL;
+		goto out;
+	}
+
+	hc->generation = h.generation;
+	hc->nr_saved_lu = h.nr;
+out:
+	fclose(fp);
+}
+
+static int find_saved_lu(struct host_cache *hc, int tid, uint64_t lun)
+{
+	int i;
+
+	for (i = 0; i < hc->nr_saved_lu; i ++)
+		if (hc->saved_lu[i].tid == tid && hc->saved_lu[i].lun == lun)
+			return i;
+
+	return -1;
+}
+
+/* map partition file, returns 1 if its contents can be used */
+static int map_nc_file(struct numa_cache *nc, struct host_cache *hc)
+{
+	struct cache_shm_hdr *h;
+	struct stat st;
+	char path[PATH_MAX];
+	size_t pgsz, cb_len;
+	char *p;
+	int fd, warm;
+
+	pgsz = cache_page_size(hc->page);
+	nc->buffer_len = (nc->buffer_size + pgsz - 1) & ~(pgsz - 1);
+	cb_len = (nc->nb * sizeof(struct cache_block) + pgsz - 1) & ~(pgsz - 1);
+	nc->shm_len = pgsz + nc->buffer_len + cb_len;
+
+	snprintf(path, sizeof(path), "%s/tgtd-cache-%d", hc->mem, nc->id);
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		eprintf("numa cache: open %s failed, %m\n", path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size != (off_t) nc->shm_len) {
+		/* different geometry, start over */
+		if (ftruncate(fd, 0) < 0 || \
+		    ftruncate(fd, nc->shm_len) < 0) {
+			eprintf("numa cache: truncate %s failed, %m\n", path);
+			close(fd);
+			return -1;
+		}
+	}
+
+	p = mmap(NULL, nc->shm_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		eprintf("numa cache: mmap %s failed, %m\n", path);
+		return -1;
+	}
+
+	if (hc->page == CACHE_PAGE_THP)
+		madvise(p, nc->shm_len, MADV_HUGEPAGE);
+	cache_tonode_memory(p, nc->shm_len, nc->on_numa_node);
+
+	h = (struct cache_shm_hdr *) p;
+	warm = h->magic == CACHE_SHM_MAGIC && \
+		h->version == CACHE_SHM_VERSION && \
+		h->generation == hc->generation && h->generation && \
+		h->buffer_size == nc->buffer_size && h->cbs == nc->cbs && \
+		h->cb_size == sizeof(struct cache_block) && \
+		h->nb == nc->nb && h->clean;
+
+	/* not clean until save_cache(), a crash leaves it cold */
+	h->magic = CACHE_SHM_MAGIC;
+	h->version = CACHE_SHM_VERSION;
+	h->generation = hc->generation + 1;
+	h->buffer_size = nc->buffer_size;
+	h->cbs = nc->cbs;
+	h->cb_size = sizeof(struct cache_block);
+	h->nb = nc->nb;
+	h->clean = 0;
+	msync(h, pgsz, MS_SYNC);
+
+	nc->shm = h;
+	nc->buffer = p + pgsz;
+	nc->cb = (struct cache_block *) (p + pgsz + nc->buffer_len);
+
+	return warm;
+}
+
+/* split the cache over numa nodes, in proportion to free memory of
+ * each node unless sizes are given per node
+ */
+static int size_cache_nodes(struct host_cache *hc, struct cache_param *cp)
+{
+	size_t node_size[MAX_NR_NUMA_NODES];
+	long long node_free[MAX_NR_NUMA_NODES];
+	long long total_free = 0;
+	char *list, *tok, *save;
+	int i, j;
+
+	for (i = 0; i < hc->nr_numa_nodes; i ++) {
+		node_free[i] = cache_node_free(i);
+		total_free += node_free[i];
+		node_size[i] = 0;
+	}
+
+	if (cp->node_size) {
+		list = strdup(cp->node_size);
+		if (list == NULL) {
+			eprintf("numa cache: malloc failed\n");
+			return -1;
+		}
+
+		hc->buffer_size = 0;
+		tok = strtok_r(list, ",", &save);
+		for (i = 0; tok && i < hc->nr_numa_nodes; i ++) {
+			node_size[i] = byte_atoi(tok);
+			hc->buffer_size += node_size[i];
+			tok = strtok_r(NULL, ",", &save);
+		}
+		free(list);
+	} else {
+		for (i = 0; i < hc->nr_numa_nodes; i ++) {
+			if (total_free)
+				node_size[i] = (double) hc->buffer_size * \
+					node_free[i] / total_free;
+			else
+				node_size[i] = hc->buffer_size / hc->nr_numa_nodes;
+		}
+	}
+
+	for (i = 0; i < hc->nr_numa_nodes; i ++) {
+		if ((long long) node_size[i] > node_free[i])
+			eprintf("numa cache: node %d has %lld bytes free, "
+				"less than its cache %zu\n", \
+				i, node_free[i], node_size[i]);
+		eprintf("numa cache: node %d caches %zu bytes\n", \
+			i, node_size[i]);
+
+		for (j = 0; j < hc->nr_cache_area; j ++)
+			hc->nc[i * hc->nr_cache_area + j].buffer_size = \
+				node_size[i] / hc->nr_cache_area;
+	}
+
+	return 0;
+}
+
+static uint64_t gcd64(uint64_t a, uint64_t b)
+{
+	uint64_t t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/* map block groups to partitions in proportion to their number of
+ * blocks. smooth weighted round robin spreads the entries of each
+ * partition evenly, with equal partitions the map is plain modulo.
+ */
+static int build_nc_map(struct host_cache *hc)
+{
+	int total_nc = hc->nr_numa_nodes * hc->nr_cache_area;
+	uint64_t w[total_nc], sum = 0, g = 0;
+	int64_t cur[total_nc];
+	int i, k, best;
+
+	for (i = 0; i < total_nc; i ++) {
+		w[i] = hc->nc[i].nb;
+		sum += w[i];
+		g = gcd64(g, w[i]);
+	}
+	if (sum == 0) {
+		eprintf("numa cache: no cache block on any node\n");
+		return -1;
+	}
+
+	/* keep the map small, a partition with blocks keeps an entry */
+	for (i = 0, k = 0; i < total_nc; i ++) {
+		if (sum / g > CACHE_MAP_MAX) {
+			if (w[i])
+				w[i] = max_t(uint64_t, 1, \
+					     w[i] * CACHE_MAP_MAX / sum);
+		} else
+			w[i] /= g;
+		k += w[i];
+		cur[i] = 0;
+	}
+
+	hc->nc_map = malloc(k * sizeof(int));
+	if (hc->nc_map == NULL) {
+		eprintf("numa cache: malloc failed\n");
 		return -1;
 	}
+	hc->nc_map_sz = k;
+
+	for (k = 0; k < hc->nc_map_sz; k ++) {
+		best = -1;
+		for (i = 0; i < total_nc; i ++) {
+			if (w[i] == 0)
+				continue;
+			cur[i] += w[i];
+			if (best < 0 || cur[i] > cur[best])
+				best = i;
+		}
+		cur[best] -= hc->nc_map_sz;
+		hc->nc_map[k] = best;
+	}
+
+	return 0;
+}
+
+int init_cache(struct host_cache *hc, struct cache_param *cp)
+{
+	int i;
+	int total_nc;
 
-	hc->nr_numa_nodes = numa_num_configured_nodes();
+	hc->nr_numa_nodes = cache_nr_nodes();
 	eprintf("numa cache: this host have %d numa nodes in total\n", \
 		hc->nr_numa_nodes);
 
@@ -40,9 +590,67 @@ int init_cache(struct host_cache *hc, struct cache_param *cp)
 	dprintf("numa cache: direct IO alignment is %d bytes\n", \
 		hc->dio_align);
 
+	hc->policy = find_cache_policy(cp->policy);
+	if (hc->policy == NULL) {
+		eprintf("numa cache: unknown replacement policy %s\n", \
+			cp->policy);
+		return -1;
+	}
+	eprintf("numa cache: %s replacement\n", hc->policy->name);
+
+	hc->ra_max = cp->ra_max;
+	hc->admit = cp->admit;
+	hc->bypass = cp->bypass;
+	hc->dedup = cp->dedup;
+	hc->page = cp->page;
+	hc->mem = cp->mem;
+	if (hc->dedup && hc->mem) {
+		eprintf("numa cache: dedup does not keep cache files\n");
+		return -1;
+	}
+	hc->saved_lu = NULL;
+	hc->nr_saved_lu = 0;
+	if (hc->mem)
+		load_saved_lu(hc);
+
 	hc->seed = getpid();
 	srand(hc->seed);
 
+	pthread_rwlock_init(&(hc->lu_lock), NULL);
+	INIT_LIST_HEAD(&(hc->lu_list));
+	hc->fl = NULL;
+
+	pthread_mutex_init(&(hc->purge_lock), NULL);
+	pthread_cond_init(&(hc->purge_cond), NULL);
+	INIT_LIST_HEAD(&(hc->purge_list));
+
+	if (posix_memalign((void **) &(hc->node_stat), 64, \
+			   hc->nr_numa_nodes * sizeof(struct cache_stat))) {
+		eprintf("malloc failed\n");
+		return -1;
+	}
+	memset(hc->node_stat, 0, hc->nr_numa_nodes * sizeof(struct cache_stat));
+
+	hc->split_memo = calloc(CACHE_SPLIT_MEMO, sizeof(uint64_t));
+	if (hc->split_memo == NULL) {
+		eprintf("malloc failed\n");
+		return -1;
+	}
+
+	/* no memory, no partition. workers and network buffers still
+	 * go by node, no lu can be cached.
+	 */
+	if (hc->buffer_size == 0 && cp->node_size == NULL) {
+		if (hc->mem) {
+			eprintf("numa cache: a cache file needs a cache size\n");
+			return -1;
+		}
+		eprintf("numa cache: no cache size, lus are not cached\n");
+		hc->nr_cache_area = 0;
+		hc->nc = NULL;
+		return 0;
+	}
+
 	total_nc = hc->nr_numa_nodes * hc->nr_cache_area;
 	hc->nc = (struct numa_cache *) \
 		malloc(total_nc * sizeof(struct numa_cache));
@@ -52,7 +660,10 @@ int init_cache(struct host_cache *hc, struct cache_param *cp)
 	}
 
 	struct bitmask *nodemask;
-	nodemask = numa_get_run_node_mask();
+	nodemask = cache_save_run_mask();
+
+	if (size_cache_nodes(hc, cp) != 0)
+		return -1;
 
 	for (i = 0; i < total_nc; i ++) {
 		hc->nc[i].id = i;
@@ -66,7 +677,30 @@ int init_cache(struct host_cache *hc, struct cache_param *cp)
 			i, hc->nc[i].on_numa_node);
 	}
 
-	numa_run_on_node_mask(nodemask);
+	cache_restore_run_mask(nodemask);
+
+	struct cache_fault f[total_nc];
+	int nr = 0;
+
+	for (i = 0; i < total_nc; i ++) {
+		if (hc->nc[i].nb == 0)
+			continue;
+		f[nr].addr = hc->nc[i].buffer;
+		f[nr].len = hc->nc[i].buffer_len;
+		f[nr].node = hc->nc[i].on_numa_node;
+		f[nr].keep = hc->nc[i].shm != NULL;
+		nr ++;
+	}
+	cache_fault_in(f, nr);
+
+	if (build_nc_map(hc) != 0)
+		return -1;
+
+	if (hc->mem)
+		hc->generation ++;
+
+	if (start_cache_flusher(hc) != 0)
+		return -1;
 
 	return 0;
 }
@@ -75,293 +709,1790 @@ int alloc_nc(struct numa_cache *nc, struct host_cache *hc)
 {
 	int i;
 	int ret;
+	int warm = 0, nr_warm = 0;
+	struct cache_block *cb;
 
 	nc_mutex_init(&(nc->mutex));
+	pthread_cond_init(&(nc->cond), NULL);
+	nc->nr_waiters = 0;
+
+	nc->cbs = hc->cbs;
+	nc->nb = (int) (nc->buffer_size / nc->cbs);
+	if (hc->dedup)
+		nc->nb *= CACHE_DEDUP_RATIO;
+	nc->nb_active = nc->nb_target = nc->nb;
+
+	/* init unused list */
+	INIT_LIST_HEAD(&(nc->unused_list));
+	for (i = 0; i < CACHE_LU_BUCKETS; i ++) {
+		INIT_LIST_HEAD(&(nc->lu_blocks[i]));
+		nc->nr_lu_blocks[i] = 0;
+	}
+
+	/* init replacement policy state */
+	nc->policy = hc->policy;
+	for (i = 0; i < 2; i ++) {
+		INIT_LIST_HEAD(&(nc->q[i]));
+		nc->nr_q[i] = 0;
+		INIT_LIST_HEAD(&(nc->ghost_q[i]));
+		nc->nr_ghost_q[i] = 0;
+	}
+	INIT_LIST_HEAD(&(nc->ghost_free));
+	nc->ghost = NULL;
+	nc->hand = &(nc->q[0]);
+	nc->arc_p = 0;
+	nc->sketch = NULL;
+	nc->nr_pinned = 0;
+	nc->data = NULL;
+	nc->nr_data = nc->nr_data_free = 0;
+
+	nc->nr_queued = 0;
+	nc->nr_dirty = 0;
+	nc->fl = NULL;
+	memset(&(nc->stat), 0, sizeof(nc->stat));
+
+	/* no cache on this node, offset2ncid() never maps here */
+	if (nc->nb == 0) {
+		nc->buffer_size = 0;
+		nc->buffer_len = 0;
+		nc->buffer = NULL;
+		nc->cb = NULL;
+		nc->dirty = NULL;
+		nc->shm = NULL;
+		return ht_init(&(nc->ht), NULL, 0, nc->on_numa_node);
+	}
 
 	/* alloc cache memory trunk */
 	/* even if we alloc memory by numa_alloc_onnode(), page cache
 	 * is not at this time. So, we call numa_run_onnode() for thread
 	 * and set memory content which will trigger memory allocation.
 	 */
-	ret = numa_run_on_node(nc->on_numa_node);
+	ret = cache_run_on_node(nc->on_numa_node);
 	if (ret == -1) {
 		eprintf("numa cache: numa_run_on_node(%d) failed.\n", \
 			nc->on_numa_node);
 		return -1;
 	}
 
-	nc->buffer_size = hc->buffer_size / (hc->nr_numa_nodes * hc->nr_cache_area);
-	nc->buffer = (char *) numa_alloc_onnode(nc->buffer_size, nc->on_numa_node);
-	if (nc->buffer == NULL) {
-		eprintf("numa_alloc_onnode numa_cache buffer failed\n");
-		return -1;
+	/* faulted in by init_cache() */
+	if (hc->mem) {
+		warm = map_nc_file(nc, hc);
+		if (warm < 0)
+			return -1;
+	} else {
+		nc->shm = NULL;
+		nc->buffer = (char *) cache_alloc_onnode(nc->buffer_size, \
+							 nc->on_numa_node, \
+							 hc->page, \
+							 &(nc->buffer_len));
+		if (nc->buffer == NULL) {
+			eprintf("numa_alloc_onnode numa_cache buffer failed\n");
+			return -1;
+		}
+
+		/* alloc cache blocks info */
+		nc->cb = (struct cache_block *) \
+			cache_numa_alloc(nc->nb * sizeof(struct cache_block), \
+					  nc->on_numa_node);
+		if (nc->cb == NULL) {
+			eprintf("numa_alloc_onnode cache blocks failed\n");
+			return -1;
+		}
 	}
 	dprintf("numa cache[%d]: alloc %ld bytes in numa node %d\n", \
 		nc->id, nc->buffer_size, nc->on_numa_node);
 
-	memset(nc->buffer, '\0', nc->buffer_size);
-
 	/* alloc hash table */
-	nc->cbs = hc->cbs;
-	nc->nb = (int) (nc->buffer_size / nc->cbs);
-	nc->ht.sz = nc->nb;
-	dprintf("numa cache: hash table size is: %d\n", nc->ht.sz);
-	nc->ht.tablecell = (struct cache_block *) \
-		numa_alloc_onnode(nc->ht.sz * sizeof(struct cache_block), \
-				  nc->on_numa_node);
-	if (nc->ht.tablecell == NULL) {
+	if (ht_init(&(nc->ht), nc->cb, nc->nb, nc->on_numa_node) != 0) {
 		eprintf("numa_alloc_onnode hash table failed\n");
 		return -1;
 	}
+	dprintf("numa cache: hash table size is: %u\n", nc->ht.sz);
 
-	/* init hash table */
-	dprintf("numa cache: init hash table lock %" PRIx64 "\n", \
-		&(nc->ht.lock));
-	for (i = 0; i < nc->ht.sz; i ++) {
-		INIT_LIST_HEAD(&(nc->ht.tablecell[i].list));
+	if (hc->admit && sketch_init(nc) != 0) {
+		eprintf("numa cache: alloc admission sketch failed\n");
+		return -1;
 	}
 
-	/* init unused list */
-	INIT_LIST_HEAD(&(nc->unused_list.list));
+	if (hc->dedup && dedup_init(nc) != 0) {
+		eprintf("numa cache: alloc dedup slots failed\n");
+		return -1;
+	}
 
-	/* init hit list */
-	INIT_LIST_HEAD(&(nc->hit_list.hit_list));
+	/* init replacement policy */
+	if (nc->policy->init && nc->policy->init(nc) != 0) {
+		eprintf("numa cache: init %s policy failed\n", \
+			nc->policy->name);
+		return -1;
+	}
 
-	/* alloc cache blocks info */
-	nc->cb = (struct cache_block *) \
-		numa_alloc_onnode(nc->nb * sizeof(struct cache_block), \
-				  nc->on_numa_node);
-	if (nc->cb == NULL) {
-		eprintf("numa_alloc_onnode cache blocks failed\n");
+	/* dirty block indexes for write-back */
+	nc->dirty = (uint32_t *) \
+		cache_numa_alloc(nc->nb * sizeof(uint32_t), nc->on_numa_node);
+	if (nc->dirty == NULL) {
+		eprintf("numa_alloc_onnode dirty array failed\n");
 		return -1;
 	}
 
-	/* add all cache blocks into unused list */
+	/* index blocks kept from last run, add the others into unused list */
 	for (i = 0; i < nc->nb; i ++) {
-		nc->cb[i].is_valid = CACHE_INVALID;
-		nc->cb[i].cb_id = -1;
-		nc->cb[i].cbs = hc->cbs;
-		nc->cb[i].hit_count = 0;
-		nc->cb[i].addr = nc->buffer + (uint64_t) i * hc->cbs;
-		/*		dprintf("numa cache: cb addr: %" PRId64 "\n", nc->cb[i].addr); */
-		INIT_LIST_HEAD(&(nc->cb[i].list));
-		INIT_LIST_HEAD(&(nc->cb[i].hit_list));
+		cb = &(nc->cb[i]);
+		INIT_LIST_HEAD(&(cb->list));
+		INIT_LIST_HEAD(&(cb->lu_list));
+		cb->pin = 0;
+		cb->data = nc->data ? CACHE_NO_DATA : (uint32_t) i;
 
-		list_add_tail(&(nc->cb[i].list), &(nc->unused_list.list));
+		if (warm && cb->is_valid == CACHE_VALID && \
+		    !(cb->flags & CB_DIRTY) && \
+		    find_saved_lu(hc, cb->tid, cb->lun) >= 0) {
+			cb->flags = CB_NEW;
+			index_cache_block(nc, cb);
+			nc->policy->insert(cb, nc);
+			nr_warm ++;
+			continue;
+		}
+
+		cb->is_valid = CACHE_INVALID;
+		cb->flags = 0;
+		cb->cb_id = -1;
+
+		list_add_tail(&(cb->list), &(nc->unused_list));
 	}
 
+	if (warm)
+		eprintf("numa cache[%d]: %d blocks kept from last run\n", \
+			nc->id, nr_warm);
+
 	return 0;
 }
 
 void insert_cache_block(struct cache_block *cb, struct numa_cache *nc)
 {
-	int key;
-	struct cache_block *clist;	/* hash table cell list */
+	/* insert into hash table */
+	index_cache_block(nc, cb);
+	/* hand over to replacement policy */
+	cb->flags |= CB_NEW;
+	cb->is_valid = CACHE_VALID;
+	nc->policy->insert(cb, nc);
 
-	key = ht_hash_key(cb->cb_id, &(nc->ht));
-	clist = &(nc->ht.tablecell[key]);
+	return;
+}
 
-	/* insert into hash table */
-	list_add(&(cb->list), &(clist->list));
-	/* insert into hit list */
-	list_add(&(cb->hit_list), &(nc->hit_list.hit_list));
+void pend_cache_block(struct cache_block *cb, struct numa_cache *nc)
+{
+	/* a valid block keeps its place in policy queues, evict() skips it */
+	if (cb->is_valid != CACHE_VALID) {
+		/* miss - make it visible to other threads */
+		index_cache_block(nc, cb);
+		cb->flags |= CB_NEW;
+	}
+
+	cb->is_valid = CACHE_PENDING;
+	cb->flags &= ~CB_STALE;
 
 	return;
 }
 
-int nc_mutex_init(pthread_mutex_t *mutex)
+void complete_cache_block(struct cache_block *cb, struct numa_cache *nc, \
+			  int is_valid)
 {
-	pthread_mutex_init(mutex, NULL);
-	return 0;
+	/* a write went around the cache meanwhile, the block may be stale */
+	if (is_valid == CACHE_VALID && (cb->flags & CB_STALE) && \
+	    !(cb->flags & CB_DIRTY))
+		is_valid = CACHE_INVALID;
+	cb->flags &= ~CB_STALE;
+
+	if (is_valid == CACHE_VALID) {
+		cb->is_valid = CACHE_VALID;
+		if (nc->data && (cb->flags & CB_NEW) && \
+		    !(cb->flags & CB_DIRTY))
+			share_cache_block(cb, nc);
+		if (cb->flags & CB_NEW)
+			nc->policy->insert(cb, nc);
+	} else {
+		unindex_cache_block(nc, cb);
+		if (!(cb->flags & CB_NEW))
+			nc->policy->remove(cb, nc);
+		if (cb->flags & CB_DIRTY)
+			nc->nr_dirty --;
+		cb->flags &= ~(CB_DIRTY | CB_NEW | CB_REF | CB_Q1);
+		cb->is_valid = CACHE_INVALID;
+		free_cache_block(cb, nc);
+	}
+
+	if (nc->nr_waiters)
+		pthread_cond_broadcast(&(nc->cond));
+
+	return;
 }
 
-int nc_mutex_lock(pthread_mutex_t *mutex)
+void free_cache_block(struct cache_block *cb, struct numa_cache *nc)
 {
-	if (pthread_mutex_lock(mutex) != 0) {
-		eprintf("lock fail\n");
-		return -1;
+	/* its data may still be on the way to an initiator */
+	if (cb->pin) {
+		cb->flags |= CB_ORPHAN;
+		return;
 	}
+
+	drop_cache_data(cb, nc);
+	list_add_tail(&(cb->list), &(nc->unused_list));
+}
+
+int pin_cache_block(struct cache_block *cb, struct numa_cache *nc)
+{
+	uint64_t nb = nc->nb_active;
+
+	/* a stalled initiator must not hold the partition. each pin
+	 * counts, with dedup a block may hold a slot per pin and there
+	 * may be fewer slots than blocks
+	 */
+	if (nc->data && nc->nr_data < nb)
+		nb = nc->nr_data;
+	if ((uint64_t) nc->nr_pinned * 100 >= nb * CACHE_PIN_RATIO)
+		return -1;
+
+	nc->nr_pinned ++;
+	cb->pin ++;
+	if (nc->data)
+		nc->data[cb->data].ref ++;
+
 	return 0;
 }
 
-int nc_mutex_unlock(pthread_mutex_t *mutex)
+void unpin_cache_block(struct cache_block *cb, struct numa_cache *nc, \
+		       char *addr)
 {
-	if (pthread_mutex_unlock(mutex) != 0) {
-		eprintf("lock fail\n");
+	/* the block may have moved to another slot since */
+	if (nc->data)
+		put_cache_data(nc, (addr - nc->buffer) / nc->cbs);
+
+	nc->nr_pinned --;
+	if (-- cb->pin == 0 && (cb->flags & CB_ORPHAN)) {
+		cb->flags &= ~CB_ORPHAN;
+		drop_cache_data(cb, nc);
+		list_add_tail(&(cb->list), &(nc->unused_list));
+	}
+
+	/* replacement may wait for this block or its slot */
+	if (nc->nr_waiters)
+		pthread_cond_broadcast(&(nc->cond));
+}
+
+/* called with nc->mutex held, caller looks up the block again */
+void wait_cache_block(struct numa_cache *nc)
+{
+	nc->nr_waiters ++;
+	pthread_cond_wait(&(nc->cond), &(nc->mutex));
+	nc->nr_waiters --;
+
+	return;
+}
+
+/* replacement policies */
+
+static inline int cb_evictable(struct cache_block *cb)
+{
+	return cb->is_valid == CACHE_VALID && \
+		!(cb->flags & CB_DIRTY) && cb->pin == 0;
+}
+
+static inline int cb_queue(struct cache_block *cb)
+{
+	return (cb->flags & CB_Q1) ? 1 : 0;
+}
+
+static void q_add(struct cache_block *cb, struct numa_cache *nc, int qi)
+{
+	if (qi)
+		cb->flags |= CB_Q1;
+	else
+		cb->flags &= ~CB_Q1;
+	list_add(&(cb->list), &(nc->q[qi]));
+	nc->nr_q[qi] ++;
+}
+
+static void q_del(struct cache_block *cb, struct numa_cache *nc)
+{
+	list_del_init(&(cb->list));
+	nc->nr_q[cb_queue(cb)] --;
+}
+
+/* least recently used clean block of a queue. a block passed over goes
+ * to the head, so the next replacement does not walk it again.
+ */
+static struct cache_block *q_evict(struct numa_cache *nc, int qi)
+{
+	struct cache_block *cb;
+	int n;
+
+	for (n = 0; n < CACHE_EVICT_SCAN && !list_empty(&(nc->q[qi])); n ++) {
+		cb = list_entry(nc->q[qi].prev, struct cache_block, list);
+		if (cb_evictable(cb)) {
+			q_del(cb, nc);
+			return cb;
+		}
+		list_move(&(cb->list), &(nc->q[qi]));
+	}
+
+	return NULL;
+}
+
+/* ghost entries remember keys of replaced blocks, so that a block
+ * coming back soon can be told from a block seen for the first time.
+ */
+static int ghost_init(struct numa_cache *nc)
+{
+	int i;
+
+	nc->ghost = (struct cache_block *) \
+		cache_numa_alloc(nc->nb * sizeof(struct cache_block), \
+				  nc->on_numa_node);
+	if (nc->ghost == NULL)
+		return -1;
+
+	if (ht_init(&(nc->ght), nc->ghost, nc->nb, nc->on_numa_node) != 0)
 		return -1;
+
+	for (i = 0; i < nc->nb; i ++) {
+		memset(&(nc->ghost[i]), '\0', sizeof(struct cache_block));
+		list_add_tail(&(nc->ghost[i].list), &(nc->ghost_free));
 	}
+
 	return 0;
 }
 
-/* return most affinitied node */
-int split_io(struct scsi_cmd *cmd, struct host_cache *hc)
+static void ghost_drop(struct numa_cache *nc, int gi)
+{
+	struct cache_block *g;
+
+	if (list_empty(&(nc->ghost_q[gi])))
+		return;
+
+	g = list_entry(nc->ghost_q[gi].prev, struct cache_block, list);
+	ht_delete(&(nc->ght), g);
+	list_move(&(g->list), &(nc->ghost_free));
+	nc->nr_ghost_q[gi] --;
+}
+
+static void ghost_add(struct cache_block *cb, struct numa_cache *nc, int gi)
+{
+	struct cache_block *g;
+
+	if (list_empty(&(nc->ghost_free)))
+		ghost_drop(nc, nc->nr_ghost_q[gi] ? gi : !gi);
+
+	g = list_first_entry(&(nc->ghost_free), struct cache_block, list);
+	g->tid = cb->tid;
+	g->lun = cb->lun;
+	g->cb_id = cb->cb_id;
+	g->flags = gi ? CB_Q1 : 0;
+	ht_insert(&(nc->ght), g);
+	list_move(&(g->list), &(nc->ghost_q[gi]));
+	nc->nr_ghost_q[gi] ++;
+}
+
+/* forget the ghost of cb, return its ghost queue or -1 */
+static int ghost_take(struct cache_block *cb, struct numa_cache *nc)
+{
+	struct cache_block *g;
+	int gi;
+
+	g = ht_lookup(&(nc->ght), cb->tid, cb->lun, cb->cb_id);
+	if (g == NULL)
+		return -1;
+
+	gi = g->flags & CB_Q1 ? 1 : 0;
+	ht_delete(&(nc->ght), g);
+	list_move(&(g->list), &(nc->ghost_free));
+	nc->nr_ghost_q[gi] --;
+
+	return gi;
+}
+
+static void policy_remove(struct cache_block *cb, struct numa_cache *nc)
+{
+	q_del(cb, nc);
+}
+
+/* lru: q[0] in recency order */
+static void lru_hit(struct cache_block *cb, struct numa_cache *nc)
+{
+	list_move(&(cb->list), &(nc->q[0]));
+}
+
+static void lru_insert(struct cache_block *cb, struct numa_cache *nc)
+{
+	cb->flags &= ~CB_NEW;
+	q_add(cb, nc, 0);
+}
+
+static struct cache_block *lru_evict(struct numa_cache *nc)
+{
+	return q_evict(nc, 0);
+}
+
+/* clock: q[0] is the ring, a hit only sets the reference bit */
+static void clock_hit(struct cache_block *cb, struct numa_cache *nc)
+{
+	cb->flags |= CB_REF;
+}
+
+static void clock_insert(struct cache_block *cb, struct numa_cache *nc)
+{
+	cb->flags &= ~(CB_NEW | CB_REF | CB_Q1);
+	/* just behind the hand, the last one it visits */
+	list_add_tail(&(cb->list), nc->hand);
+	nc->nr_q[0] ++;
+}
+
+static void clock_remove(struct cache_block *cb, struct numa_cache *nc)
+{
+	if (nc->hand == &(cb->list))
+		nc->hand = cb->list.next;
+	q_del(cb, nc);
+}
+
+static struct cache_block *clock_evict(struct numa_cache *nc)
 {
-	/* V is in request data (each V is a logic block)
-	 *
-	 * |uuuVVVVV|VVVVVVVV|VVVuuuuu|u...
-	 *  ^  ^                ^      ^
-         *  a_shadow
-	 *     cmd->offset
-	 *                      cmd->offset + length
-	 *                             b_shadow
+	struct list_head *pos;
+	struct cache_block *cb;
+	int n, skip = 0;
+
+	/* two sweeps clear every reference bit, the hand passes no more
+	 * than CACHE_EVICT_SCAN blocks that cannot go
 	 */
+	for (n = 2 * nc->nr_q[0] + 1; n > 0 && skip < CACHE_EVICT_SCAN; n --) {
+		pos = nc->hand;
+		if (pos == &(nc->q[0]))
+			pos = pos->next;
+		if (pos == &(nc->q[0]))
+			return NULL;
 
-	int i;
-	int nodeid;
-	int aff[32];
-	int aff_max;
-	uint32_t length;
-	uint64_t a_shadow;
-	uint64_t b_shadow;
-	struct sub_io_request *ior;
-	uint64_t lba;
+		cb = list_entry(pos, struct cache_block, list);
+		nc->hand = pos->next;
+
+		if (cb->flags & CB_REF) {
+			cb->flags &= ~CB_REF;
+			continue;
+		}
+		if (!cb_evictable(cb)) {
+			skip ++;
+			continue;
+		}
+
+		q_del(cb, nc);
+		return cb;
+	}
 
-	struct iser_membuf *data_buf;
-	struct tcp_data_buf *tcp_buf;
+	return NULL;
+}
 
-	dprintf("numa cache: start split io\n");
-	lba = scsi_rw_offset(cmd->scb);
+/* 2q (Johnson and Shasha): new blocks enter FIFO q[0] (A1in), blocks
+ * re-referenced after leaving it go to LRU q[1] (Am). ghost_q[0] (A1out)
+ * remembers blocks that left q[0]. a one pass scan only cycles q[0].
+ */
+#define Q2_KIN(nc)	((nc)->nb_active / 4 + 1)
+#define Q2_KOUT(nc)	((nc)->nb_active / 2 + 1)
 
-	cmd->offset = lba << cmd->dev->blk_shift;
+static void q2_hit(struct cache_block *cb, struct numa_cache *nc)
+{
+	if (cb->flags & CB_Q1)
+		list_move(&(cb->list), &(nc->q[1]));
+}
 
-	switch (cmd->scb[0])
-	{
-	case WRITE_6:
-	case WRITE_10:
-	case WRITE_12:
-	case WRITE_16:
-		length = scsi_get_out_length(cmd);
+static void q2_insert(struct cache_block *cb, struct numa_cache *nc)
+{
+	cb->flags &= ~CB_NEW;
+	q_add(cb, nc, ghost_take(cb, nc) >= 0);
+}
+
+static struct cache_block *q2_evict(struct numa_cache *nc)
+{
+	struct cache_block *cb = NULL;
+
+	if (nc->nr_q[0] > Q2_KIN(nc) || nc->nr_q[1] == 0) {
+		cb = q_evict(nc, 0);
+		if (cb) {
+			if (nc->nr_ghost_q[0] >= Q2_KOUT(nc))
+				ghost_drop(nc, 0);
+			ghost_add(cb, nc, 0);
+			return cb;
+		}
+	}
+
+	cb = q_evict(nc, 1);
+	if (cb == NULL)
+		cb = q_evict(nc, 0);
+
+	return cb;
+}
+
+/* arc (Megiddo and Modha): q[0] (T1) holds blocks seen once, q[1] (T2)
+ * blocks seen at least twice, ghost_q[0/1] (B1/B2) their replaced
+ * keys. arc_p, the target size of T1, follows ghost hits.
+ */
+static void arc_hit(struct cache_block *cb, struct numa_cache *nc)
+{
+	q_del(cb, nc);
+	q_add(cb, nc, 1);
+}
+
+static void arc_insert(struct cache_block *cb, struct numa_cache *nc)
+{
+	int b1 = nc->nr_ghost_q[0], b2 = nc->nr_ghost_q[1];
+	int delta;
+
+	cb->flags &= ~CB_NEW;
+
+	switch (ghost_take(cb, nc)) {
+	case 0:
+		delta = b1 >= b2 ? 1 : b2 / b1;
+		nc->arc_p = nc->arc_p + delta > nc->nb_active ? \
+			nc->nb_active : nc->arc_p + delta;
+		q_add(cb, nc, 1);
 		break;
-	case READ_6:
-	case READ_10:
-	case READ_12:
-	case READ_16:
-		length = scsi_get_in_length(cmd);
+	case 1:
+		delta = b2 >= b1 ? 1 : b1 / b2;
+		nc->arc_p = nc->arc_p > delta ? nc->arc_p - delta : 0;
+		q_add(cb, nc, 1);
 		break;
 	default:
-		dprintf("numa cache: command not support 0x%x\n", \
-			cmd->scb[0]);
-		return 0;
+		if (nc->nr_q[0] + nc->nr_ghost_q[0] >= nc->nb_active)
+			ghost_drop(nc, 0);
+		q_add(cb, nc, 0);
 		break;
 	}
+}
 
-	cmd->nr_sior = 0;
+static struct cache_block *arc_evict(struct numa_cache *nc)
+{
+	struct cache_block *cb;
+	int qi;
 
-	/* take care of x.999999999  = 1 */
-	a_shadow = (uint64_t) cmd->offset - (cmd->offset % (uint64_t) hc->cbs);
-	b_shadow = (uint64_t) (cmd->offset + (uint64_t) length - 1) - ((cmd->offset + (uint64_t) length - 1) % (uint64_t) hc->cbs) + hc->cbs;
-	cmd->nr_sior = (b_shadow - a_shadow) / (uint64_t) hc->cbs;
+	qi = (nc->nr_q[0] > 0 && nc->nr_q[0] >= nc->arc_p) ? 0 : 1;
 
-	for (i = 0; i < hc->nr_numa_nodes; i ++)
-		aff[i] = 0;
-
-	for (i = 0; i < cmd->nr_sior; i ++) {
-		ior = &(cmd->sior[i]);
-		if (cmd->nr_sior == 1) {		/* first and last */
-			ior->offset = a_shadow;
-			ior->in_offset = (uint32_t) cmd->offset - a_shadow;
-			ior->m_offset = 0;
-			ior->length = length;
-			ior->cb_id = a_shadow / hc->cbs;
-		} else if (i == 0) {		/* first but not last */
-			ior->offset = a_shadow;
-			ior->in_offset = (uint32_t) cmd->offset - a_shadow;
-			ior->m_offset = 0;
-			ior->length = hc->cbs - ior->in_offset;
-			ior->cb_id = a_shadow / hc->cbs;
-		} else if (i == cmd->nr_sior - 1) {	/* last sub io */
-			ior->offset = b_shadow - hc->cbs;
-			ior->in_offset = 0;
-			ior->m_offset = i * hc->cbs  - (cmd->offset - a_shadow);
-			ior->length = hc->cbs - (b_shadow - (cmd->offset + length));
-			ior->cb_id = b_shadow / hc->cbs - 1;
-		} else {			/* middle sub io */
-			ior->offset = a_shadow + (uint64_t) i * hc->cbs;
-			ior->in_offset = 0;
-			ior->m_offset = i * hc->cbs  - (cmd->offset - a_shadow);
-			ior->length = hc->cbs;
-			ior->cb_id = ior->offset / hc->cbs;
-		}
-		ior->dev_id = cmd->dev_id;
-		ior->tid = cmd->tid;
-		ior->lun = cmd->dev->lun;
-
-		ior->nc_id = offset2ncid(ior->offset, hc);
-		dprintf("numa cache: ior[%d] tid %d lun %ld off %ld, in_off %d, len %d, cb_id %ld, nc_id %d\n", \
-			i, ior->tid, ior->lun, ior->offset, \
-			ior->in_offset, ior->length, ior->cb_id, ior->nc_id);
-
-		aff[ncid2nodeid(ior->nc_id, hc)] ++;
-	}
-
-	nodeid = 0;
-	aff_max = aff[0];
-	for (i = 1; i < hc->nr_numa_nodes; i ++) {
-		if (aff[i] > aff_max) {
-			nodeid = i;
-			aff_max = aff[i];
-		}
-	}
-
-	dprintf("numa cache: start parse numa node split io\n");
-
-	/* reset network buffer location */
-	data_buf = NULL;
-	tcp_buf = NULL;
-	if (cmd->rdma == 1) {
-		data_buf = (struct iser_membuf *) cmd->netbuf;
-		/* ONLY read operation need reset nodeid */
-	switch (cmd->scb[0])
+	cb = q_evict(nc, qi);
+	if (cb == NULL) {
+		qi = !qi;
+		cb = q_evict(nc, qi);
+	}
+	if (cb)
+		ghost_add(cb, nc, qi);
+
+	return cb;
+}
+
+static struct cache_policy cache_policies[] = {
 	{
-	case READ_6:
-	case READ_10:
-	case READ_12:
-	case READ_16:
-		data_buf->cur_node = nodeid;
-		break;
-	default:
-		break;
+		.name = "lru",
+		.hit = lru_hit,
+		.insert = lru_insert,
+		.remove = policy_remove,
+		.evict = lru_evict,
+	},
+	{
+		.name = "clock",
+		.hit = clock_hit,
+		.insert = clock_insert,
+		.remove = clock_remove,
+		.evict = clock_evict,
+	},
+	{
+		.name = "2q",
+		.init = ghost_init,
+		.hit = q2_hit,
+		.insert = q2_insert,
+		.remove = policy_remove,
+		.evict = q2_evict,
+	},
+	{
+		.name = "arc",
+		.init = ghost_init,
+		.hit = arc_hit,
+		.insert = arc_insert,
+		.remove = policy_remove,
+		.evict = arc_evict,
+	},
+};
+
+struct cache_policy *find_cache_policy(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(cache_policies); i ++)
+		if (!strcmp(cache_policies[i].name, name))
+			return &(cache_policies[i]);
+
+	return NULL;
+}
+
+void dirty_cache_block(struct cache_block *cb, struct numa_cache *nc)
+{
+	if (!(cb->flags & CB_DIRTY)) {
+		cb->flags |= CB_DIRTY;
+		nc->nr_dirty ++;
 	}
-		cmd->nodeid = nodeid;
-		data_buf->addr = data_buf->numa_addr[data_buf->cur_node];
-	} else {
-		tcp_buf = (struct tcp_data_buf *) cmd->netbuf;
-		tcp_buf->cur_node = nodeid;
-		cmd->nodeid = nodeid;
-		tcp_buf->cur_addr = tcp_buf->addr[tcp_buf->cur_node];
+
+	if (!(cb->flags & CB_QUEUED)) {
+		cb->flags |= CB_QUEUED;
+		nc->dirty[nc->nr_queued ++] = (uint32_t) (cb - nc->cb);
 	}
-	dprintf("numa cache: parse this task to node %d\n", nodeid);
-	dprintf("numa cache: update network buf address\n");
 
-	switch (cmd->scb[0])
-	{
-	case WRITE_6:
-	case WRITE_10:
-	case WRITE_12:
-	case WRITE_16:
-		if (cmd->rdma == 1) {
-			scsi_set_out_buffer(cmd, data_buf->addr);
-		} else {
-			scsi_set_out_buffer(cmd, tcp_buf->cur_addr);
+	if (nc->fl && !nc->fl->kicked && \
+	    (uint64_t) nc->nr_dirty > \
+	    (uint64_t) nc->nb_active * CACHE_WB_DIRTY_RATIO / 100)
+		kick_cache_flusher(nc->fl);
+
+	return;
+}
+
+static void clean_cache_block(struct cache_block *cb, struct numa_cache *nc)
+{
+	cb->flags &= ~CB_DIRTY;
+	nc->nr_dirty --;
+}
+
+/* move up to max dirty blocks of a LUN (or of all LUNs) out of the
+ * dirty array of a partition. called with nc->mutex held.
+ */
+static int take_dirty_blocks(struct numa_cache *nc, int all, int tid, \
+			     uint64_t lun, struct cache_key *key, int max)
+{
+	struct cache_block *cb;
+	int i, j, n;
+
+	for (i = j = n = 0; i < nc->nr_queued; i ++) {
+		cb = &(nc->cb[nc->dirty[i]]);
+		if (!(cb->flags & CB_DIRTY)) {
+			/* stale, cleaned or invalidated */
+			cb->flags &= ~CB_QUEUED;
+			continue;
 		}
-		break;
-	case READ_6:
-	case READ_10:
-	case READ_12:
-	case READ_16:
-		if (cmd->rdma == 1) {
-			scsi_set_in_buffer(cmd, data_buf->addr);
-		} else {
-			scsi_set_in_buffer(cmd, tcp_buf->cur_addr);
+
+		if (n == max || (!all && (cb->tid != tid || cb->lun != lun))) {
+			nc->dirty[j ++] = nc->dirty[i];
+			continue;
 		}
-		break;
-	default:
-		dprintf("numa cache: command not support 0x%x\n", \
-			cmd->scb[0]);
+
+		cb->flags &= ~CB_QUEUED;
+		key[n].tid = cb->tid;
+		key[n].lun = cb->lun;
+		key[n].cb_id = cb->cb_id;
+		n ++;
+	}
+	nc->nr_queued = j;
+
+	return n;
+}
+
+static int cache_key_cmp(const void *a, const void *b)
+{
+	const struct cache_key *x = a, *y = b;
+
+	if (x->tid != y->tid)
+		return x->tid < y->tid ? -1 : 1;
+	if (x->lun != y->lun)
+		return x->lun < y->lun ? -1 : 1;
+	if (x->cb_id != y->cb_id)
+		return x->cb_id < y->cb_id ? -1 : 1;
+	return 0;
+}
+
+static struct cache_lu *cache_lu_lookup(struct host_cache *hc, int tid, \
+					uint64_t lun)
+{
+	struct cache_lu *clu;
+
+	list_for_each_entry(clu, &(hc->lu_list), list) {
+		if (clu->tid == tid && clu->lun == lun)
+			return clu;
+	}
+
+	return NULL;
+}
+
+/* write back one run of adjacent dirty blocks, starting at key. the
+ * run may span partitions, each block is reserved under its own
+ * partition mutex. with wait set, an in-flight first block is waited
+ * for instead of being queued again.
+ */
+static int destage_run(struct host_cache *hc, struct cache_key *key, int wait)
+{
+	struct cache_block *run[CACHE_MAX_RUN];
+	struct numa_cache *rnc[CACHE_MAX_RUN];
+	struct iovec iov[CACHE_MAX_RUN];
+	struct cache_block *cb;
+	struct numa_cache *nc;
+	struct cache_lu *clu;
+	uint64_t cb_id, offset;
+	ssize_t ret, total;
+	int i, nr;
+
+	for (nr = 0, cb_id = key->cb_id; nr < CACHE_MAX_RUN; nr ++, cb_id ++) {
+		nc = &(hc->nc[offset2ncid(cb_id * hc->cbs, hc)]);
+		nc_lock(nc);
+retry:
+		cb = ht_lookup(&(nc->ht), key->tid, key->lun, cb_id);
+		if (nr == 0 && cb && cb->is_valid == CACHE_PENDING && \
+		    (cb->flags & CB_DIRTY)) {
+			if (wait) {
+				wait_cache_block(nc);
+				goto retry;
+			}
+			dirty_cache_block(cb, nc);
+		}
+
+		if (!cb || cb->is_valid != CACHE_VALID || \
+		    !(cb->flags & CB_DIRTY)) {
+			nc_mutex_unlock(&(nc->mutex));
+			break;
+		}
+
+		pend_cache_block(cb, nc);
+		clean_cache_block(cb, nc);
+		nc_mutex_unlock(&(nc->mutex));
+
+		run[nr] = cb;
+		rnc[nr] = nc;
+		iov[nr].iov_base = cb_addr(cb, nc);
+		iov[nr].iov_len = hc->cbs;
+	}
+
+	if (nr == 0)
 		return 0;
-		break;
+
+	offset = key->cb_id * hc->cbs;
+	total = (ssize_t) nr * hc->cbs;
+
+	pthread_rwlock_rdlock(&(hc->lu_lock));
+	clu = cache_lu_lookup(hc, key->tid, key->lun);
+	if (clu == NULL) {
+		eprintf("numa cache: no backing file for tid %d lun %" PRIu64 \
+			"\n", key->tid, key->lun);
+		ret = -1;
+	} else {
+		/* do not write beyond the end of the LUN */
+		if (offset + total > clu->size) {
+			iov[nr - 1].iov_len -= offset + total - clu->size;
+			iov[nr - 1].iov_len = roundup(iov[nr - 1].iov_len, \
+						      hc->dio_align);
+			total -= hc->cbs - iov[nr - 1].iov_len;
+		}
+		ret = pwritev(clu->fd, iov, nr, offset);
+	}
+	pthread_rwlock_unlock(&(hc->lu_lock));
+
+	if (ret != total)
+		eprintf("numa cache: destage %d blocks at %" PRIu64 \
+			" failed - %zd\n", nr, offset, ret);
+
+	for (i = 0; i < nr; i ++) {
+		nc_lock(rnc[i]);
+		if (ret != total && clu != NULL)
+			dirty_cache_block(run[i], rnc[i]);
+		complete_cache_block(run[i], rnc[i], CACHE_VALID);
+		nc_mutex_unlock(&(rnc[i]->mutex));
+	}
+
+	return ret == total ? 0 : -1;
+}
+
+/* destage dirty blocks of one partition in LBA order, batch_lock
+ * (if any) is held across each batch.
+ */
+static int destage_nc(struct host_cache *hc, struct numa_cache *nc, int all, \
+		      int tid, uint64_t lun, struct cache_key *key, int wait, \
+		      pthread_mutex_t *batch_lock)
+{
+	int i, n, err = 0;
+
+	do {
+		if (batch_lock)
+			pthread_mutex_lock(batch_lock);
+
+		nc_lock(nc);
+		n = take_dirty_blocks(nc, all, tid, lun, key, CACHE_WB_BATCH);
+		nc_mutex_unlock(&(nc->mutex));
+
+		qsort(key, n, sizeof(*key), cache_key_cmp);
+
+		for (i = 0; i < n; i ++) {
+			if (destage_run(hc, &key[i], wait) != 0)
+				err = -1;
+		}
+
+		if (batch_lock)
+			pthread_mutex_unlock(batch_lock);
+	} while (n == CACHE_WB_BATCH);
+
+	return err;
+}
+
+int reserve_cache_run(struct host_cache *hc, struct cache_key *key, int max, \
+		      struct cache_block **run, struct numa_cache **rnc)
+{
+	struct numa_cache *nc, *held = NULL;
+	struct cache_block *cb;
+	uint64_t cb_id;
+	int nr;
+
+	for (nr = 0, cb_id = key->cb_id; nr < max; nr ++, cb_id ++) {
+		nc = &(hc->nc[offset2ncid(cb_id * hc->cbs, hc)]);
+		if (nc != held) {
+			if (held)
+				nc_mutex_unlock(&(held->mutex));
+			nc_lock(nc);
+			held = nc;
+		}
+
+		/* no hit is counted for a block found here */
+		if (ht_lookup(&(nc->ht), key->tid, key->lun, cb_id))
+			break;
+
+		if (!admit_cache_block(nc, key->tid, key->lun, cb_id, 0))
+			break;
+
+		cb = get_cache_block(key->tid, key->lun, cb_id, nc);
+		if (cb == NULL)
+			break;
+
+		cb->cb_id = cb_id;
+		cb->tid = key->tid;
+		cb->lun = key->lun;
+		pend_cache_block(cb, nc);
+
+		run[nr] = cb;
+		rnc[nr] = nc;
 	}
 
-	return nodeid;
+	if (held)
+		nc_mutex_unlock(&(held->mutex));
+
+	return nr;
 }
 
+int read_cache_run(struct host_cache *hc, int fd, uint64_t size, \
+		   uint64_t cb_id, int nr, struct cache_block **run, \
+		   struct numa_cache **rnc)
+{
+	struct iovec iov[CACHE_MAX_RUN];
+	uint64_t offset;
+	ssize_t ret, total;
+	int i;
+
+	for (i = 0; i < nr; i ++) {
+		iov[i].iov_base = cb_addr(run[i], rnc[i]);
+		iov[i].iov_len = hc->cbs;
+	}
+
+	offset = cb_id * hc->cbs;
+	total = (ssize_t) nr * hc->cbs;
+
+	/* the last block may be cut by the end of the LUN */
+	if (offset + total > size) {
+		total = size - offset;
+		iov[nr - 1].iov_len = roundup(total - \
+			(ssize_t) (nr - 1) * hc->cbs, hc->dio_align);
+	}
+
+	ret = preadv(fd, iov, nr, offset);
+	if (ret != total) {
+		eprintf("numa cache: read %d blocks at %" PRIu64 \
+			" failed - %zd\n", nr, offset, ret);
+		return -1;
+	}
+
+	/* the blocks are still ours, hash them without the lock */
+	for (i = 0; i < nr; i ++) {
+		if (rnc[i]->data == NULL)
+			continue;
+		cache_fingerprint(iov[i].iov_base, hc->cbs, \
+				  rnc[i]->data[run[i]->data].fp);
+		rnc[i]->data[run[i]->data].hashed = 1;
+	}
+
+	return 0;
+}
+
+void complete_cache_run(struct cache_block **run, struct numa_cache **rnc, \
+			int nr, int is_valid)
+{
+	struct numa_cache *held = NULL;
+	int i;
+
+	for (i = 0; i < nr; i ++) {
+		if (rnc[i] != held) {
+			if (held)
+				nc_mutex_unlock(&(held->mutex));
+			nc_lock(rnc[i]);
+			held = rnc[i];
+		}
+		complete_cache_block(run[i], rnc[i], is_valid);
+	}
+
+	if (held)
+		nc_mutex_unlock(&(held->mutex));
+}
+
+/* read ahead a run of uncached blocks starting at key, return the
+ * number of blocks consumed. a block cached, in flight or not
+ * replaceable is skipped.
+ */
+static int readahead_run(struct host_cache *hc, struct cache_key *key, \
+			 int max)
+{
+	struct cache_block *run[CACHE_MAX_RUN];
+	struct numa_cache *rnc[CACHE_MAX_RUN];
+	struct cache_lu *clu;
+	int nr, ret = -1;
+
+	nr = reserve_cache_run(hc, key, min(max, CACHE_MAX_RUN), run, rnc);
+	if (nr == 0)
+		return 1;
+
+	pthread_rwlock_rdlock(&(hc->lu_lock));
+	clu = cache_lu_lookup(hc, key->tid, key->lun);
+	if (clu)
+		ret = read_cache_run(hc, clu->fd, clu->size, key->cb_id, nr, \
+				     run, rnc);
+	pthread_rwlock_unlock(&(hc->lu_lock));
+
+	complete_cache_run(run, rnc, nr, \
+			   ret == 0 ? CACHE_VALID : CACHE_INVALID);
+
+	return nr;
+}
+
+static void *cache_readahead_fn(void *arg)
+{
+	struct cache_flusher *fl = arg;
+	struct host_cache *hc = fl->hc;
+	struct cache_ra ra;
+	sigset_t set;
+	int n;
+
+	sigfillset(&set);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	if (cache_run_on_node(fl->node) != 0)
+		eprintf("numa cache: numa_run_on_node(%d) failed.\n", fl->node);
+
+	for (;;) {
+		pthread_mutex_lock(&(fl->lock));
+		while (!fl->nr_ra && !fl->stop)
+			pthread_cond_wait(&(fl->ra_cond), &(fl->lock));
+		if (fl->stop) {
+			pthread_mutex_unlock(&(fl->lock));
+			break;
+		}
+		ra = fl->ra[fl->ra_head];
+		fl->ra_head = (fl->ra_head + 1) % CACHE_RA_QUEUE;
+		fl->nr_ra --;
+		pthread_mutex_unlock(&(fl->lock));
+
+		for (; ra.nr > 0; ra.nr -= n, ra.key.cb_id += n)
+			n = readahead_run(hc, &(ra.key), ra.nr);
+	}
+
+	pthread_exit(NULL);
+}
+
+/* readahead is a hint, a window is dropped if the queue is full */
+static void queue_readahead(struct host_cache *hc, struct cache_ra *ra)
+{
+	struct cache_flusher *fl;
+
+	fl = hc->nc[offset2ncid(ra->key.cb_id * hc->cbs, hc)].fl;
+	if (fl == NULL)
+		return;
+
+	pthread_mutex_lock(&(fl->lock));
+	if (fl->nr_ra < CACHE_RA_QUEUE && !fl->stop) {
+		fl->ra[(fl->ra_head + fl->nr_ra) % CACHE_RA_QUEUE] = *ra;
+		fl->nr_ra ++;
+		pthread_cond_signal(&(fl->ra_cond));
+	}
+	pthread_mutex_unlock(&(fl->lock));
+}
+
+void cache_readahead(struct host_cache *hc, int tid, uint64_t lun, \
+		     uint64_t first, uint64_t last)
+{
+	struct cache_stream *s, *lru;
+	struct cache_lu *clu;
+	struct cache_ra ra;
+	uint64_t nb_lu;
+	int i;
+
+	if (hc->ra_max == 0)
+		return;
+
+	pthread_rwlock_rdlock(&(hc->lu_lock));
+	clu = cache_lu_lookup(hc, tid, lun);
+	if (clu == NULL) {
+		pthread_rwlock_unlock(&(hc->lu_lock));
+		return;
+	}
+	nb_lu = (clu->size + hc->cbs - 1) / hc->cbs;
+
+	pthread_mutex_lock(&(clu->ra_lock));
+
+	/* I/O threads may serve commands of one stream a bit out of
+	 * order, so a read close to the stream head still continues it.
+	 */
+	lru = &(clu->st[0]);
+	for (i = 0; i < CACHE_RA_STREAMS; i ++) {
+		s = &(clu->st[i]);
+		if (s->used && first + CACHE_RA_MIN >= s->next && \
+		    first <= max(s->next, s->ra_end))
+			break;
+		if (s->used < lru->used)
+			lru = s;
+	}
+
+	ra.nr = 0;
+	if (i == CACHE_RA_STREAMS) {
+		/* a new stream, or a random read */
+		s = lru;
+		s->next = s->ra_end = last + 1;
+		s->win = 0;
+	} else {
+		s->next = max(s->next, last + 1);
+		s->ra_end = max(s->ra_end, s->next);
+		if (s->win == 0)
+			s->win = min(CACHE_RA_MIN, hc->ra_max);
+
+		/* keep at least half a window read ahead, and grow the
+		 * window as long as the stream goes on
+		 */
+		if ((s->ra_end - s->next) * 2 <= s->win && s->ra_end < nb_lu) {
+			ra.key.tid = tid;
+			ra.key.lun = lun;
+			ra.key.cb_id = s->ra_end;
+			ra.nr = (int) min((uint64_t) s->win, nb_lu - s->ra_end);
+			s->ra_end += ra.nr;
+			s->win = min(s->win * 2, (uint32_t) hc->ra_max);
+		}
+	}
+	s->used = ++ clu->ra_tick;
+
+	pthread_mutex_unlock(&(clu->ra_lock));
+	pthread_rwlock_unlock(&(hc->lu_lock));
+
+	if (ra.nr)
+		queue_readahead(hc, &ra);
+}
+
+void cache_prefetch(struct host_cache *hc, int tid, uint64_t lun, \
+		    uint64_t first, uint64_t last)
+{
+	struct cache_lu *clu;
+	struct cache_ra ra;
+	uint64_t nb_lu;
+
+	pthread_rwlock_rdlock(&(hc->lu_lock));
+	clu = cache_lu_lookup(hc, tid, lun);
+	nb_lu = clu ? (clu->size + hc->cbs - 1) / hc->cbs : 0;
+	pthread_rwlock_unlock(&(hc->lu_lock));
+
+	if (first >= nb_lu || first > last)
+		return;
+
+	/* no more than the cache holds */
+	ra.key.tid = tid;
+	ra.key.lun = lun;
+	ra.key.cb_id = first;
+	ra.nr = (int) min(min(last, nb_lu - 1) - first + 1, \
+			  (uint64_t) (hc->buffer_size / hc->cbs));
+	if (ra.nr)
+		queue_readahead(hc, &ra);
+}
+
+void kick_cache_flusher(struct cache_flusher *fl)
+{
+	pthread_mutex_lock(&(fl->lock));
+	fl->kicked = 1;
+	pthread_cond_signal(&(fl->cond));
+	pthread_mutex_unlock(&(fl->lock));
+}
+
+/* give the memory of blocks from nb_active on back to the system */
+static void release_nc(struct host_cache *hc, struct numa_cache *nc, int nb)
+{
+	size_t pgsz = cache_page_size(hc->page);
+	size_t start;
+
+	start = ((size_t) nb * nc->cbs + pgsz - 1) & ~(pgsz - 1);
+	if (start >= nc->buffer_len)
+		return;
+
+	if (madvise(nc->buffer + start, nc->buffer_len - start, \
+		    nc->shm ? MADV_REMOVE : MADV_DONTNEED) != 0)
+		eprintf("numa cache[%d]: release memory failed, %m\n", nc->id);
+}
+
+/* move nc->nb_active a batch at a time towards nc->nb_target. blocks
+ * are taken from the top, so that the memory given back is one range.
+ * a top block in I/O or dirty stops shrinking until it is clean.
+ * return 1 if the target is not reached yet.
+ */
+static int resize_nc(struct host_cache *hc, struct numa_cache *nc)
+{
+	struct cache_block *cb;
+	int n, shrunk = 0, busy = 0;
+
+	do {
+		nc_lock(nc);
+		for (n = 0; n < CACHE_RESIZE_BATCH && \
+			    nc->nb_active > nc->nb_target; n ++) {
+			cb = &(nc->cb[nc->nb_active - 1]);
+			if (cb->is_valid == CACHE_PENDING || \
+			    (cb->flags & CB_DIRTY) || cb->pin) {
+				busy = 1;
+				break;
+			}
+
+			if (cb->is_valid == CACHE_VALID) {
+				unindex_cache_block(nc, cb);
+				nc->policy->remove(cb, nc);
+			} else
+				list_del_init(&(cb->list));
+
+			/* CB_QUEUED stays until destager drops the index */
+			cb->flags &= CB_QUEUED;
+			cb->is_valid = CACHE_INVALID;
+			cb->cb_id = -1;
+			nc->nb_active --;
+			shrunk = 1;
+		}
+
+		for (; n < CACHE_RESIZE_BATCH && \
+		       nc->nb_active < nc->nb_target; n ++) {
+			cb = &(nc->cb[nc->nb_active ++]);
+			cb->flags &= CB_QUEUED;
+			cb->is_valid = CACHE_INVALID;
+			cb->cb_id = -1;
+			list_add_tail(&(cb->list), &(nc->unused_list));
+		}
+
+		if (n && nc->nr_waiters)
+			pthread_cond_broadcast(&(nc->cond));
+		nc_mutex_unlock(&(nc->mutex));
+	} while (n == CACHE_RESIZE_BATCH);
+
+	if (shrunk)
+		release_nc(hc, nc, nc->nb_active);
+
+	return busy;
+}
+
+/* tgtadm --mode sys --op update --name cache_node_size, sizes per node
+ * as in tgtd -n. a node without one is left alone, growing is bounded
+ * by the memory mapped at startup.
+ */
+int resize_cache(struct host_cache *hc, char *node_size)
+{
+	struct numa_cache *nc;
+	char *list, *tok, *save;
+	uint64_t size;
+	int i, j, nb, nb_min;
+
+	if (hc->nc == NULL) {
+		eprintf("numa cache: no cache to resize\n");
+		return -1;
+	}
+
+	/* blocks and memory are apart with dedup */
+	if (hc->dedup) {
+		eprintf("numa cache: no resize with dedup on\n");
+		return -1;
+	}
+
+	list = strdup(node_size);
+	if (list == NULL)
+		return -1;
+
+	tok = strtok_r(list, ",", &save);
+	for (i = 0; tok && i < hc->nr_numa_nodes; i ++) {
+		size = byte_atoi(tok);
+		eprintf("numa cache: resize node %d to %" PRIu64 " bytes\n", \
+			i, size);
+
+		for (j = 0; j < hc->nr_cache_area; j ++) {
+			nc = &(hc->nc[i * hc->nr_cache_area + j]);
+
+			/* a command needs a run of blocks to make progress */
+			nb_min = min(nc->nb, CACHE_MAX_RUN);
+			nb = (int) min(size / hc->nr_cache_area / nc->cbs, \
+				       (uint64_t) nc->nb);
+			if (nb < nb_min)
+				nb = nb_min;
+
+			nc_lock(nc);
+			nc->nb_target = nb;
+			nc_mutex_unlock(&(nc->mutex));
+		}
+
+		if (hc->fl)
+			kick_cache_flusher(&(hc->fl[i]));
+		tok = strtok_r(NULL, ",", &save);
+	}
+	free(list);
+
+	return 0;
+}
+
+/* drop the block of a lu if it is all in bytes [start, end), else zero
+ * the part in it. nc is held, return 1 if it was dropped for a block
+ * in I/O to finish, or blocks were replaced for a copy of shared data.
+ */
+static int unmap_cache_block(struct numa_cache *nc, struct cache_block *cb, \
+			     uint64_t start, uint64_t end)
+{
+	uint64_t base = cb->cb_id * nc->cbs, from, to;
+	int ret;
+
+	if (cb->is_valid == CACHE_PENDING) {
+		wait_cache_block(nc);
+		return 1;
+	}
+
+	from = max(start, base);
+	to = min(end, base + nc->cbs);
+	if (from == base && to == base + nc->cbs) {
+		invalidate_cache_block(cb->tid, cb->lun, cb->cb_id, nc);
+		return 0;
+	}
+
+	ret = own_cache_block(cb, nc);
+	if (ret >= 0)
+		memset(cb_addr(cb, nc) + (from - base), 0, to - from);
+	else if (!(cb->flags & CB_DIRTY))
+		invalidate_cache_block(cb->tid, cb->lun, cb->cb_id, nc);
+	else {
+		/* dirty and pinned, wait for a slot */
+		wait_cache_block(nc);
+		return 1;
+	}
+
+	return ret == 1;
+}
+
+/* blocks of a lu in bytes [start, end) of one partition. a small range
+ * is looked up block by block, a large one is taken from the lu bucket,
+ * either way the lock is dropped every CACHE_PURGE_BATCH blocks. a fill
+ * in flight is waited for, so it cannot publish data from before.
+ */
+static void unmap_nc(struct host_cache *hc, struct numa_cache *nc, int tid, \
+		     uint64_t lun, uint64_t start, uint64_t end)
+{
+	struct cache_block *cb, *n;
+	uint64_t cb_id, first, last;
+	int b, nr = 0;
+
+	first = start / hc->cbs;
+	last = (end - 1) / hc->cbs;
+	b = cache_lu_bucket(tid, lun);
+
+	nc_lock(nc);
+	if (last - first < (uint64_t) nc->nr_lu_blocks[b]) {
+		for (cb_id = first; cb_id <= last; cb_id ++) {
+			if (offset2ncid(cb_id * hc->cbs, hc) != nc->id)
+				continue;
+retry:
+			cb = ht_lookup(&(nc->ht), tid, lun, cb_id);
+			if (cb && unmap_cache_block(nc, cb, start, end))
+				goto retry;
+
+			if (++ nr == CACHE_PURGE_BATCH) {
+				nc_mutex_unlock(&(nc->mutex));
+				nr = 0;
+				nc_lock(nc);
+			}
+		}
+	} else {
+restart:
+		list_for_each_entry_safe(cb, n, &(nc->lu_blocks[b]), lu_list) {
+			if (cb->tid != tid || cb->lun != lun || \
+			    cb->cb_id < first || cb->cb_id > last)
+				continue;
+			if (unmap_cache_block(nc, cb, start, end))
+				goto restart;
+
+			if (++ nr == CACHE_PURGE_BATCH) {
+				nc_mutex_unlock(&(nc->mutex));
+				nr = 0;
+				nc_lock(nc);
+				goto restart;
+			}
+		}
+	}
+
+	nc_mutex_unlock(&(nc->mutex));
+}
+
+void invalidate_cache_range(struct host_cache *hc, int tid, uint64_t lun, \
+			    uint64_t offset, uint64_t length)
+{
+	int i;
+
+	if (length == 0)
+		return;
+
+	for (i = 0; i < hc->nr_numa_nodes * hc->nr_cache_area; i ++)
+		unmap_nc(hc, &(hc->nc[i]), tid, lun, offset, \
+			 length > UINT64_MAX - offset ? \
+			 UINT64_MAX : offset + length);
+}
+
+/* drop the blocks of deleted lus from the partitions of a node, the
+ * last node done frees the purge
+ */
+static void purge_node(struct host_cache *hc, int node)
+{
+	struct cache_purge *p, *cur;
+	int i;
+
+	pthread_mutex_lock(&(hc->purge_lock));
+	for (;;) {
+		p = NULL;
+		list_for_each_entry(cur, &(hc->purge_list), list) {
+			if (!cur->done[node]) {
+				p = cur;
+				break;
+			}
+		}
+		if (p == NULL)
+			break;
+		pthread_mutex_unlock(&(hc->purge_lock));
+
+		for (i = node * hc->nr_cache_area; \
+		     i < (node + 1) * hc->nr_cache_area; i ++)
+			unmap_nc(hc, &(hc->nc[i]), p->tid, p->lun, \
+				 0, UINT64_MAX);
+
+		pthread_mutex_lock(&(hc->purge_lock));
+		p->done[node] = 1;
+		if (-- p->left == 0) {
+			list_del(&(p->list));
+			free(p->done);
+			free(p);
+			pthread_cond_broadcast(&(hc->purge_cond));
+		}
+	}
+	pthread_mutex_unlock(&(hc->purge_lock));
+}
+
+static void *cache_flusher_fn(void *arg)
+{
+	struct cache_flusher *fl = arg;
+	struct host_cache *hc = fl->hc;
+	struct cache_key *key;
+	struct timespec ts;
+	sigset_t set;
+	int i, stop, resizing = 0;
+
+	sigfillset(&set);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	if (cache_run_on_node(fl->node) != 0)
+		eprintf("numa cache: numa_run_on_node(%d) failed.\n", fl->node);
+
+	key = malloc(CACHE_WB_BATCH * sizeof(*key));
+	if (key == NULL) {
+		eprintf("numa cache: malloc failed\n");
+		pthread_exit(NULL);
+	}
+
+	do {
+		pthread_mutex_lock(&(fl->lock));
+		if (!fl->kicked && !fl->stop) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += resizing ? 1 : CACHE_WB_INTERVAL;
+			pthread_cond_timedwait(&(fl->cond), &(fl->lock), &ts);
+		}
+		fl->kicked = 0;
+		stop = fl->stop;
+		pthread_mutex_unlock(&(fl->lock));
+
+		/* one more pass on stop, nothing is left dirty */
+		resizing = 0;
+		for (i = fl->node * hc->nr_cache_area; \
+		     i < (fl->node + 1) * hc->nr_cache_area; i ++) {
+			destage_nc(hc, &(hc->nc[i]), 1, 0, 0, key, 0, \
+				   &(fl->flush_lock));
+			resizing |= resize_nc(hc, &(hc->nc[i]));
+		}
+		purge_node(hc, fl->node);
+	} while (!stop);
+
+	free(key);
+	pthread_exit(NULL);
+}
+
+int start_cache_flusher(struct host_cache *hc)
+{
+	struct cache_flusher *fl;
+	int i, ret;
+
+	hc->fl = calloc(hc->nr_numa_nodes, sizeof(struct cache_flusher));
+	if (hc->fl == NULL) {
+		eprintf("numa cache: malloc failed\n");
+		return -1;
+	}
+
+	for (i = 0; i < hc->nr_numa_nodes * hc->nr_cache_area; i ++)
+		hc->nc[i].fl = &(hc->fl[ncid2nodeid(i, hc)]);
+
+	for (i = 0; i < hc->nr_numa_nodes; i ++) {
+		fl = &(hc->fl[i]);
+		fl->hc = hc;
+		fl->node = i;
+		pthread_mutex_init(&(fl->lock), NULL);
+		pthread_cond_init(&(fl->cond), NULL);
+		pthread_mutex_init(&(fl->flush_lock), NULL);
+		pthread_cond_init(&(fl->ra_cond), NULL);
+
+		ret = pthread_create(&(fl->thread), NULL, cache_flusher_fn, fl);
+		if (ret) {
+			eprintf("numa cache: failed to create destager on node"
+				" %d, %s\n", i, strerror(ret));
+			return -1;
+		}
+
+		ret = pthread_create(&(fl->ra_thread), NULL, \
+				     cache_readahead_fn, fl);
+		if (ret) {
+			eprintf("numa cache: failed to create readahead on node"
+				" %d, %s\n", i, strerror(ret));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void stop_cache_flusher(struct host_cache *hc)
+{
+	struct cache_flusher *fl;
+	int i;
+
+	if (hc->fl == NULL)
+		return;
+
+	for (i = 0; i < hc->nr_numa_nodes; i ++) {
+		fl = &(hc->fl[i]);
+		pthread_mutex_lock(&(fl->lock));
+		fl->stop = 1;
+		pthread_cond_signal(&(fl->cond));
+		pthread_cond_signal(&(fl->ra_cond));
+		pthread_mutex_unlock(&(fl->lock));
+		pthread_join(fl->ra_thread, NULL);
+		pthread_join(fl->thread, NULL);
+	}
+}
+
+int flush_cache_lu(struct host_cache *hc, int tid, uint64_t lun)
+{
+	struct cache_key *key;
+	int i, err = 0;
+
+	key = malloc(CACHE_WB_BATCH * sizeof(*key));
+	if (key == NULL) {
+		eprintf("numa cache: malloc failed\n");
+		return -1;
+	}
+
+	/* no destage batch may be in flight, its blocks are invisible */
+	for (i = 0; i < hc->nr_numa_nodes; i ++)
+		pthread_mutex_lock(&(hc->fl[i].flush_lock));
+
+	for (i = 0; i < hc->nr_numa_nodes * hc->nr_cache_area; i ++) {
+		if (destage_nc(hc, &(hc->nc[i]), 0, tid, lun, key, 1, \
+			       NULL) != 0)
+			err = -1;
+	}
+
+	for (i = hc->nr_numa_nodes - 1; i >= 0; i --)
+		pthread_mutex_unlock(&(hc->fl[i].flush_lock));
+
+	free(key);
+
+	return err;
+}
+
+/* drop all blocks of a lu */
+static void purge_cache_lu(struct host_cache *hc, int tid, uint64_t lun)
+{
+	invalidate_cache_range(hc, tid, lun, 0, UINT64_MAX);
+}
+
+static void fill_saved_lu(struct cache_shm_lu *s, int tid, uint64_t lun, \
+			  struct stat *st, uint64_t size)
+{
+	memset(s, 0, sizeof(*s));
+	s->tid = tid;
+	s->lun = lun;
+	s->dev = st->st_dev;
+	s->ino = st->st_ino;
+	s->size = size;
+	s->mtime_sec = st->st_mtim.tv_sec;
+	s->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/* blocks kept from last run are good only for the same backing file
+ * as it was then. a block device does not show writes by others in
+ * its mtime, so that is up to the admin.
+ */
+static void claim_saved_lu(struct host_cache *hc, int tid, uint64_t lun, \
+			   int fd, uint64_t size)
+{
+	struct cache_shm_lu now, *s;
+	struct stat st;
+	int i, same;
+
+	pthread_rwlock_wrlock(&(hc->lu_lock));
+	i = find_saved_lu(hc, tid, lun);
+	if (i < 0) {
+		pthread_rwlock_unlock(&(hc->lu_lock));
+		return;
+	}
+
+	s = &(hc->saved_lu[i]);
+	same = fstat(fd, &st) == 0;
+	if (same) {
+		fill_saved_lu(&now, tid, lun, &st, size);
+		same = now.dev == s->dev && now.ino == s->ino && \
+			now.size == s->size && \
+			now.mtime_sec == s->mtime_sec && \
+			now.mtime_nsec == s->mtime_nsec;
+	}
+
+	*s = hc->saved_lu[-- hc->nr_saved_lu];
+	pthread_rwlock_unlock(&(hc->lu_lock));
+
+	if (same) {
+		eprintf("numa cache: tid %d lun %" PRIu64 " is warm\n", \
+			tid, lun);
+	} else {
+		eprintf("numa cache: tid %d lun %" PRIu64 " changed since "
+			"last run, drop its blocks\n", tid, lun);
+		purge_cache_lu(hc, tid, lun);
+	}
+}
+
+/* called after the flusher stopped. lus not added this run are kept
+ * in the table, their blocks are still in the cache.
+ */
+void save_cache(struct host_cache *hc)
+{
+	struct cache_shm_lu_hdr h;
+	struct cache_shm_lu s;
+	struct cache_lu *clu;
+	struct numa_cache *nc;
+	struct stat st;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *fp;
+	int i, nr_clean = 0;
+
+	if (hc->mem == NULL)
+		return;
+
+	snprintf(path, sizeof(path), "%s/tgtd-cache-lu", hc->mem);
+	snprintf(tmp, sizeof(tmp), "%s/tgtd-cache-lu.tmp", hc->mem);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		eprintf("numa cache: open %s failed, %m\n", tmp);
+		return;
+	}
+
+	h.magic = CACHE_SHM_MAGIC;
+	h.version = CACHE_SHM_VERSION;
+	h.generation = hc->generation;
+	h.nr = 0;
+	fwrite(&h, sizeof(h), 1, fp);
+
+	pthread_rwlock_rdlock(&(hc->lu_lock));
+	list_for_each_entry(clu, &(hc->lu_list), list) {
+		if (fstat(clu->fd, &st) < 0)
+			continue;
+		fill_saved_lu(&s, clu->tid, clu->lun, &st, clu->size);
+		fwrite(&s, sizeof(s), 1, fp);
+		h.nr ++;
+	}
+	for (i = 0; i < hc->nr_saved_lu; i ++) {
+		fwrite(&(hc->saved_lu[i]), sizeof(s), 1, fp);
+		h.nr ++;
+	}
+	pthread_rwlock_unlock(&(hc->lu_lock));
+
+	rewind(fp);
+	fwrite(&h, sizeof(h), 1, fp);
+	if (fflush(fp) || fsync(fileno(fp)) || fclose(fp) || \
+	    rename(tmp, path)) {
+		eprintf("numa cache: save %s failed, %m\n", path);
+		return;
+	}
+
+	for (i = 0; i < hc->nr_numa_nodes * hc->nr_cache_area; i ++) {
+		nc = &(hc->nc[i]);
+		if (nc->shm == NULL)
+			continue;
+
+		nc_lock(nc);
+		nc->shm->generation = hc->generation;
+		nc->shm->clean = nc->nr_dirty == 0;
+		nr_clean += nc->shm->clean;
+		nc_mutex_unlock(&(nc->mutex));
+
+		msync(nc->shm, nc->shm_len, MS_SYNC);
+	}
+
+	eprintf("numa cache: saved %u lus, %d partitions clean\n", \
+		h.nr, nr_clean);
+}
+
+struct cache_lu *cache_lu_add(struct host_cache *hc, int tid, uint64_t lun, \
+			      int fd, uint64_t size)
+{
+	struct cache_lu *clu;
+	struct cache_purge *p;
+	int pending;
+
+	if (hc->nc == NULL) {
+		eprintf("numa cache: tgtd has no cache, set --cache_size\n");
+		return NULL;
+	}
+
+	/* blocks of a deleted lu with the same id must be gone first */
+	pthread_mutex_lock(&(hc->purge_lock));
+	do {
+		pending = 0;
+		list_for_each_entry(p, &(hc->purge_list), list) {
+			if (p->tid == tid && p->lun == lun)
+				pending = 1;
+		}
+		if (pending)
+			pthread_cond_wait(&(hc->purge_cond), &(hc->purge_lock));
+	} while (pending);
+	pthread_mutex_unlock(&(hc->purge_lock));
+
+	clu = malloc(sizeof(*clu));
+	if (clu == NULL) {
+		eprintf("numa cache: malloc failed\n");
+		return NULL;
+	}
+
+	if (posix_memalign((void **) &(clu->stat), 64, \
+			   hc->nr_numa_nodes * sizeof(struct cache_stat))) {
+		eprintf("numa cache: malloc failed\n");
+		free(clu);
+		return NULL;
+	}
+	memset(clu->stat, 0, hc->nr_numa_nodes * sizeof(struct cache_stat));
+
+	clu->tid = tid;
+	clu->lun = lun;
+	clu->fd = fd;
+	clu->size = size;
+
+	pthread_mutex_init(&(clu->ra_lock), NULL);
+	clu->ra_tick = 0;
+	memset(clu->st, 0, sizeof(clu->st));
+
+	if (hc->mem)
+		claim_saved_lu(hc, tid, lun, fd, size);
+
+	pthread_rwlock_wrlock(&(hc->lu_lock));
+	list_add_tail(&(clu->list), &(hc->lu_list));
+	pthread_rwlock_unlock(&(hc->lu_lock));
+
+	return clu;
+}
+
+void cache_lu_del(struct host_cache *hc, int tid, uint64_t lun)
+{
+	struct cache_lu *clu;
+	struct cache_purge *p;
+	int i;
+
+	if (flush_cache_lu(hc, tid, lun) != 0)
+		eprintf("numa cache: lost dirty blocks of tid %d lun %" \
+			PRIu64 "\n", tid, lun);
+
+	pthread_rwlock_wrlock(&(hc->lu_lock));
+	clu = cache_lu_lookup(hc, tid, lun);
+	if (clu)
+		list_del(&(clu->list));
+	pthread_rwlock_unlock(&(hc->lu_lock));
+
+	if (clu) {
+		pthread_mutex_destroy(&(clu->ra_lock));
+		free(clu->stat);
+	}
+	free(clu);
+
+	/* the rest is dropped by the destagers */
+	p = malloc(sizeof(*p));
+	if (p)
+		p->done = calloc(hc->nr_numa_nodes, sizeof(uint8_t));
+	if (p == NULL || p->done == NULL || hc->fl == NULL) {
+		if (p)
+			free(p->done);
+		free(p);
+		purge_cache_lu(hc, tid, lun);
+		return;
+	}
+
+	p->tid = tid;
+	p->lun = lun;
+	p->left = hc->nr_numa_nodes;
+
+	pthread_mutex_lock(&(hc->purge_lock));
+	list_add_tail(&(p->list), &(hc->purge_list));
+	pthread_mutex_unlock(&(hc->purge_lock));
+
+	for (i = 0; i < hc->nr_numa_nodes; i ++)
+		kick_cache_flusher(&(hc->fl[i]));
+}
+
+int nc_mutex_init(pthread_mutex_t *mutex)
+{
+	pthread_mutex_init(mutex, NULL);
+	return 0;
+}
+
+int nc_mutex_lock(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_lock(mutex) != 0) {
+		eprintf("lock fail\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* partition lock, time spent waiting for it is counted */
+void nc_lock(struct numa_cache *nc)
+{
+	struct timespec t0, t1;
+
+	if (pthread_mutex_trylock(&(nc->mutex)) == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	nc_mutex_lock(&(nc->mutex));
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	nc->stat.lock_waits ++;
+	nc->stat.lock_wait_ns += (t1.tv_sec - t0.tv_sec) * 1000000000ULL + \
+		t1.tv_nsec - t0.tv_nsec;
+}
+
+int nc_mutex_unlock(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_unlock(mutex) != 0) {
+		eprintf("lock fail\n");
+		return -1;
+	}
+	return 0;
+}
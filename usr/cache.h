@@ -2,6 +2,9 @@
  * Yufei Ren (yufei.ren@stonybrook.edu)
  */
 
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,59 +12,331 @@
 #include <string.h>
 #include <inttypes.h>
 #include <sys/types.h>
-#include <numa.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "list.h"
 #include "log.h"
-#include "tgtd.h"
-#include "scsi.h"
-#include "bs_thread.h"
 
 #define CACHE_INVALID	0
 #define CACHE_VALID	1
+#define CACHE_PENDING	2	/* disk I/O in flight, partition lock dropped */
+
+/* cache_block flags */
+#define CB_DIRTY	0x01	/* newer than disk, write-back LUNs only */
+#define CB_QUEUED	0x02	/* index is in numa_cache dirty array */
+#define CB_NEW		0x04	/* miss in flight, not on policy queues yet */
+#define CB_REF		0x08	/* clock reference bit */
+#define CB_Q1		0x10	/* on policy queue q[1] */
+#define CB_ORPHAN	0x20	/* dropped while pinned, see unpin_cache_block() */
+#define CB_STALE	0x40	/* written around while pending, not published */
+
+/* pages backing cache and network buffers */
+#define CACHE_PAGE_NORMAL	0	/* base pages */
+#define CACHE_PAGE_THP		1	/* transparent hugepages, madvise */
+#define CACHE_PAGE_2M		2	/* hugetlb pages */
+#define CACHE_PAGE_1G		3
+
+/* most entries of the block group to partition map */
+#define CACHE_MAP_MAX		4096
+
+/* also sizes the per node arrays of bs_thread.h */
+#define MAX_NR_NUMA_NODES	128
+
+/* cache files kept across restart, see cache_param.mem */
+#define CACHE_SHM_MAGIC		0x74677463	/* "tgtc" */
+#define CACHE_SHM_VERSION	1
+
+/* recent split_io results remembered, power of 2 */
+#define CACHE_SPLIT_MEMO	4096
+
+/* blocks coalesced in one preadv or pwritev */
+#define CACHE_MAX_RUN		256
+
+/* write-back destager */
+#define CACHE_WB_INTERVAL	5	/* seconds between destage passes */
+#define CACHE_WB_DIRTY_RATIO	50	/* kick destager above this percent */
+#define CACHE_WB_BATCH		4096	/* dirty blocks sorted per pass */
+
+/* pins of data-in in flight in a partition, at most this percent of
+ * its active blocks or data slots, so that replacement finds others
+ */
+#define CACHE_PIN_RATIO		25
+
+/* dirty or pinned blocks a replacement passes before it gives up and
+ * waits for the destager
+ */
+#define CACHE_EVICT_SCAN	64
+
+/* admission, a count-min sketch of misses per partition, 4 bit
+ * counters 16 to a word
+ */
+#define CACHE_SKETCH_ROWS	4
+#define CACHE_SKETCH_WIDTH	4	/* counters per row for each block */
+#define CACHE_ADMIT_FREQ	2	/* misses before a block is cached */
+
+/* dedup, identical clean blocks of a partition share their data. a
+ * partition then has this many blocks for each block of memory.
+ */
+#define CACHE_DEDUP_RATIO	4
+#define CACHE_NO_DATA		UINT32_MAX	/* block without a data slot */
+
+/* online resize, done by the destager a batch per partition lock */
+#define CACHE_RESIZE_BATCH	1024
+
+/* blocks of a partition are also listed by lu, in buckets by a hash of
+ * (tid, lun), so that a lu is purged without scanning the partition
+ */
+#define CACHE_LU_BUCKETS	64
+#define CACHE_PURGE_BATCH	1024	/* blocks dropped per partition lock */
+
+/* readahead */
+#define CACHE_RA_STREAMS	8	/* sequential streams tracked per LUN */
+#define CACHE_RA_MIN		4	/* first window, in cache blocks */
+#define CACHE_RA_MAX		256	/* default largest window */
+#define CACHE_RA_QUEUE		64	/* queued windows per numa node */
 
 struct cache_param {
 	size_t buffer_size;
 	int cbs;
 	int cache_way;	/* # of partitions per node */
 	int cb_group;	/* consecutive cache blocks within a partition */
-	char *mem;	/* malloc or shm */
+	char *mem;	/* directory of cache files, NULL is anonymous memory */
+	char *policy;	/* replacement policy name */
+	int ra_max;	/* largest readahead window in blocks, 0 is off */
+	int admit;	/* admission filter on misses */
+	size_t bypass;	/* commands this large go around the cache, 0 is off */
+	int dedup;	/* share the data of identical clean blocks */
+	char *node_size;	/* cache size of each node, "8G,2G", or NULL */
+	int page;	/* CACHE_PAGE_* */
 };
 
+/* cache block metadata, kept small - there is one per cache block.
+ * data address and block size are derived from the owning numa_cache.
+ */
 struct cache_block {
-	int is_valid;
-	int tid;		/* target id */
-	uint64_t lun;		/* logical unit number */
-	uint64_t dev_id;	/* correspondent device id */
 	uint64_t cb_id;		/* cache block id */
-	uint32_t cbs;		/* cache block size */
-	int hit_count;		/* times of cache hit */
-	char *addr;
-	pthread_mutex_t lock;
-	struct list_head list; /* a block either in hash table or in unused list*/
-	struct list_head hit_list;	/* hit count list - lru */
+	uint64_t lun;		/* logical unit number */
+	int tid;		/* target id */
+	uint8_t is_valid;
+	uint8_t flags;
+	uint32_t pin;		/* data-in sent from it, not evicted or reused */
+	uint32_t data;		/* data slot, the block index without dedup */
+	struct list_head list;	/* policy queue, unused list or ghost queue */
+	struct list_head lu_list;	/* lu bucket, while indexed */
+};
+
+/* open addressing index slot, 8 slots per cache line. tag is taken
+ * from the upper half of the key hash, so most mismatching probes do
+ * not touch struct cache_block.
+ */
+struct cache_slot {
+	uint32_t tag;
+	uint32_t idx;		/* index in numa_cache->cb plus one, 0 is empty */
+};
+
+/* data slot of a partition with dedup on, one per block of memory */
+struct cache_data {
+	uint64_t fp[2];		/* fingerprint of what was read into it */
+	uint32_t ref;		/* blocks and pinned pieces on it, 0 is free */
+	uint8_t hashed;		/* fp is set */
+	uint8_t shared;		/* in the fingerprint table */
 };
 
 struct cache_hash_table {
-	int sz;
+	uint32_t sz;		/* number of slots, power of two */
+	uint32_t mask;
+	struct cache_slot *slot;
+	struct cache_block *base;	/* blocks indexed by slot idx */
+};
+
+/* a sequential read stream, blocks before ra_end are read ahead */
+struct cache_stream {
+	uint64_t next;		/* cb_id the stream is expected to read next */
+	uint64_t ra_end;
+	uint32_t win;		/* readahead window, 0 until seen sequential */
+	uint32_t used;		/* for replacement of stream slots */
+};
+
+/* cache counters. a partition counts under its mutex, lus and nodes
+ * keep one copy per numa node added up on read.
+ */
+struct cache_stat {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t invalidations;
+	uint64_t rd_bytes;	/* copied out of cache */
+	uint64_t wr_bytes;	/* copied into cache */
+	uint64_t lock_waits;	/* contended partition locks */
+	uint64_t lock_wait_ns;
+	uint64_t forwarded;	/* commands handed to another node */
+	uint64_t stolen;	/* commands of another node run here */
+	uint64_t bypassed;	/* missed blocks read or written around */
+	uint64_t dedup;		/* fills that found their data in cache */
+	uint64_t cow;		/* shared data copied for a write */
+} __attribute__((aligned(64)));
+
+/* backing file of a LUN served through the cache, used by destager
+ * and readahead
+ */
+struct cache_lu {
+	int tid;
+	uint64_t lun;
+	int fd;
+	uint64_t size;
+	struct list_head list;
+
+	pthread_mutex_t ra_lock;
+	uint32_t ra_tick;
+	struct cache_stream st[CACHE_RA_STREAMS];
+
+	struct cache_stat *stat;	/* per numa node */
+};
+
+struct cache_key {
+	int tid;
+	uint64_t lun;
+	uint64_t cb_id;
+};
+
+/* blocks of a deleted lu, dropped in the background by the destager
+ * of each node. done[] is per numa node.
+ */
+struct cache_purge {
+	struct list_head list;
+	int tid;
+	uint64_t lun;
+	int left;		/* nodes not done yet */
+	uint8_t *done;
+};
+
+/* a readahead window queued to a numa node */
+struct cache_ra {
+	struct cache_key key;	/* first block */
+	int nr;
+};
+
+/* head of a partition file, its buffer and blocks follow */
+struct cache_shm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t generation;	/* lu table this partition was saved with */
+	uint64_t buffer_size;
+	uint32_t cbs;
+	uint32_t cb_size;	/* sizeof(struct cache_block) */
+	int32_t nb;
+	int32_t clean;		/* nothing dirty when saved */
+};
+
+/* lu table file, which backing file each cached lu was */
+struct cache_shm_lu_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t generation;
+	uint32_t nr;
+};
+
+struct cache_shm_lu {
+	int tid;
+	uint64_t lun;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct host_cache;
+struct numa_cache;
+
+/* replacement policy of a partition, all ops are called with the
+ * partition mutex held. a block is on the policy queues from its first
+ * completion as CACHE_VALID until it is replaced or invalidated. it may
+ * be CACHE_PENDING or dirty meanwhile, evict() skips such blocks and
+ * returns NULL if there is nothing to replace.
+ */
+struct cache_policy {
+	const char *name;
+	int (*init)(struct numa_cache *nc);
+	void (*hit)(struct cache_block *cb, struct numa_cache *nc);
+	void (*insert)(struct cache_block *cb, struct numa_cache *nc);
+	void (*remove)(struct cache_block *cb, struct numa_cache *nc);
+	struct cache_block *(*evict)(struct numa_cache *nc);
+};
+
+/* one destager and one readahead thread per numa node */
+struct cache_flusher {
+	struct host_cache *hc;
+	int node;
+	pthread_t thread;
 	pthread_mutex_t lock;
-	struct cache_block *tablecell;
+	pthread_cond_t cond;
+	pthread_mutex_t flush_lock;	/* held across a destage batch */
+	int kicked;
+	int stop;
+
+	/* readahead queue, protected by lock */
+	pthread_t ra_thread;
+	pthread_cond_t ra_cond;
+	struct cache_ra ra[CACHE_RA_QUEUE];
+	int ra_head;
+	int nr_ra;
 };
 
 struct numa_cache {
 	int id;
 	int on_numa_node;	/* numa node this cache located */
 	size_t buffer_size;	/* cache size for this numa cache */
+	size_t buffer_len;	/* mapped length of buffer */
 	char *buffer;
 	uint32_t cbs;		/* cache block size */
 	int nb;			/* number of cache blocks */
+	int nb_active;		/* blocks in use, the rest are given back */
+	int nb_target;		/* nb_active is moved to it by the destager */
+	uint64_t *sketch;	/* admission counters, NULL admits all */
+	uint32_t sketch_mask;	/* width of a row minus one */
+	uint32_t sketch_ops;	/* misses recorded */
+	uint32_t sketch_age;	/* next word to halve */
+	/* dedup, NULL data is off. protected by mutex */
+	struct cache_data *data;
+	uint32_t nr_data;
+	uint32_t *data_free;	/* stack of free slots */
+	uint32_t nr_data_free;
+	uint32_t *fpt;		/* shared slots by fingerprint, slot plus one */
+	uint32_t fpt_mask;
 	struct cache_block *cb;
 	/* hash table and linked list are used for cache management */
 	struct cache_hash_table ht;
-	struct cache_block unused_list;
-	struct cache_block hit_list;
+	struct list_head unused_list;
+	struct list_head lu_blocks[CACHE_LU_BUCKETS];	/* indexed blocks */
+	int nr_lu_blocks[CACHE_LU_BUCKETS];
+
+	/* replacement policy state, protected by mutex */
+	struct cache_policy *policy;
+	struct list_head q[2];		/* resident blocks, lru and clock use q[0] */
+	int nr_q[2];
+	struct list_head *hand;		/* clock hand */
+	int arc_p;			/* arc target size of q[0] */
+	struct cache_block *ghost;	/* keys of evicted blocks, 2q and arc */
+	struct cache_hash_table ght;
+	struct list_head ghost_free;
+	struct list_head ghost_q[2];
+	int nr_ghost_q[2];
 
 	pthread_mutex_t mutex;
+	pthread_cond_t cond;	/* waiters for CACHE_PENDING blocks */
+	int nr_waiters;		/* protected by mutex */
+	int nr_pinned;		/* pins held, protected by mutex */
+
+	/* write-back, protected by mutex */
+	uint32_t *dirty;	/* indexes of CB_QUEUED blocks */
+	struct cache_shm_hdr *shm;	/* head of partition file, or NULL */
+	size_t shm_len;
+	struct cache_stat stat;		/* protected by mutex */
+	int nr_queued;
+	int nr_dirty;		/* number of CB_DIRTY blocks */
+	struct cache_flusher *fl;
 };
 
 struct host_cache {
@@ -73,11 +348,34 @@ struct host_cache {
 	int dio_align;	/* memory alignment and IO size for direct IO */
 	unsigned seed;
 	struct numa_cache *nc;  /* pointer to numa caches */
+	int *nc_map;		/* block group to partition, by partition size */
+	int nc_map_sz;
+	uint64_t *split_memo;	/* key hash of (tid, lun, lba, length) | node + 1 */
+	struct cache_policy *policy;
+	int ra_max;		/* largest readahead window, 0 is off */
+	int admit;		/* admission filter on misses */
+	size_t bypass;		/* commands this large go around the cache */
+	int dedup;		/* share data of identical clean blocks */
+	int page;		/* CACHE_PAGE_* of buffers */
+	char *mem;		/* directory of cache files, or NULL */
+	uint64_t generation;	/* of cache files, bumped each start */
+	struct cache_shm_lu *saved_lu;	/* lus of last run not added yet */
+	int nr_saved_lu;
+	struct cache_stat *node_stat;	/* per numa node */
+
+	pthread_rwlock_t lu_lock;
+	struct list_head lu_list;	/* struct cache_lu */
+	struct cache_flusher *fl;	/* destager of each numa node */
+
+	pthread_mutex_t purge_lock;
+	pthread_cond_t purge_cond;	/* a purge is done */
+	struct list_head purge_list;	/* struct cache_purge */
 };
 
 static inline int offset2ncid(uint64_t offset, struct host_cache *hc)
 {
-	return (int) ( (offset / (uint64_t) (hc->cbs * hc->cb_group)) % (hc->nr_numa_nodes * hc->nr_cache_area) );
+	return hc->nc_map[(offset / (uint64_t) (hc->cbs * hc->cb_group)) % \
+			  hc->nc_map_sz];
 }
 
 static inline int ncid2nodeid(int nc_id, struct host_cache *hc)
@@ -85,14 +383,55 @@ static inline int ncid2nodeid(int nc_id, struct host_cache *hc)
 	return nc_id / hc->nr_cache_area;
 }
 
+static inline char *cb_addr(struct cache_block *cb, struct numa_cache *nc)
+{
+	return nc->buffer + (uint64_t) cb->data * nc->cbs;
+}
+
 void init_cache_param(struct cache_param *cp);
 
+/* memory fault in by a thread on the owning node */
+struct cache_fault {
+	char *addr;
+	size_t len;
+	int node;
+	int keep;	/* contents are kept, fault in by reading */
+	pthread_t thread;
+};
+
+int cache_nr_nodes(void);
+
+int cache_run_on_node(int node);
+
+struct bitmask;
+
+struct bitmask *cache_save_run_mask(void);
+
+void cache_restore_run_mask(struct bitmask *mask);
+
+void cache_set_preferred(int node);
+
+int cache_node_distance(int from, int to);
+
+void *cache_numa_alloc(size_t size, int node);
+
+int cache_page_mode(const char *name);
+
+int resize_cache(struct host_cache *hc, char *node_size);
+
+void *cache_alloc_onnode(size_t size, int node, int page, size_t *len);
+
+void cache_free_onnode(void *addr, size_t len);
+
+void cache_fault_in(struct cache_fault *f, int nr);
+
 int alloc_nc(struct numa_cache *nc, struct host_cache *hc);
 
 int init_cache(struct host_cache *hc, struct cache_param *cp);
 
 int nc_mutex_init(pthread_mutex_t *mutex);
 int nc_mutex_lock(pthread_mutex_t *mutex);
+void nc_lock(struct numa_cache *nc);
 int nc_mutex_unlock(pthread_mutex_t *mutex);
 
 /* cache replacement */
@@ -101,27 +440,161 @@ struct cache_block *get_cache_block(int tid, uint64_t lun, uint64_t cb_id, \
 
 void insert_cache_block(struct cache_block *cb, struct numa_cache *nc);
 
+/* whether a missed block should be cached. with no unused block left,
+ * only blocks that missed before lately or have a ghost are, the others
+ * are read or written around the cache. record counts the miss.
+ */
+int admit_cache_block(struct numa_cache *nc, int tid, uint64_t lun, \
+		      uint64_t cb_id, int record);
+
+int sketch_init(struct numa_cache *nc);
+
+/* a write went around the cache, drop the copies of blocks it hit */
+void bypass_cache_block(int tid, uint64_t lun, uint64_t cb_id, \
+			struct numa_cache *nc);
+
+/* dedup, see struct cache_data. read_cache_run() fingerprints the
+ * blocks it fills, completion then moves a block onto a slot with the
+ * same contents. own_cache_block() is called before a block is written,
+ * it returns 1 if shared data was copied, which may replace other
+ * blocks, and -1 if no slot can be freed now. nc is held for all but
+ * cache_fingerprint().
+ */
+int dedup_init(struct numa_cache *nc);
+
+void cache_fingerprint(const void *buf, size_t len, uint64_t *fp);
+
+void share_cache_block(struct cache_block *cb, struct numa_cache *nc);
+
+int own_cache_block(struct cache_block *cb, struct numa_cache *nc);
+
+void put_cache_data(struct numa_cache *nc, uint32_t d);
+
+void drop_cache_data(struct cache_block *cb, struct numa_cache *nc);
+
+struct cache_policy *find_cache_policy(const char *name);
+
+/* in-flight cache blocks
+ * a block is marked CACHE_PENDING before the partition mutex is dropped
+ * for disk I/O. It stays in hash table, so that other threads on the
+ * same block wait for it, and policies do not replace it.
+ * complete_cache_block() publishes the result.
+ */
+void pend_cache_block(struct cache_block *cb, struct numa_cache *nc);
+
+void complete_cache_block(struct cache_block *cb, struct numa_cache *nc, \
+			  int is_valid);
+
+void wait_cache_block(struct numa_cache *nc);
+
+/* runs of consecutive blocks of a LUN, possibly across partitions.
+ * reserve_cache_run() marks up to max uncached blocks from key
+ * CACHE_PENDING and stops at the first block that is cached, in flight
+ * or can not be replaced. read_cache_run() fills a reserved run with
+ * one preadv, returns 0 or -1. the caller publishes the run with
+ * complete_cache_run(). no partition mutex may be held.
+ */
+int reserve_cache_run(struct host_cache *hc, struct cache_key *key, int max, \
+		      struct cache_block **run, struct numa_cache **rnc);
+
+int read_cache_run(struct host_cache *hc, int fd, uint64_t size, \
+		   uint64_t cb_id, int nr, struct cache_block **run, \
+		   struct numa_cache **rnc);
+
+void complete_cache_run(struct cache_block **run, struct numa_cache **rnc, \
+			int nr, int is_valid);
+
+/* write-back
+ * dirty blocks are never replaced, the destager of the node writes
+ * them back in LBA order, coalescing adjacent blocks.
+ */
+void dirty_cache_block(struct cache_block *cb, struct numa_cache *nc);
+
+void kick_cache_flusher(struct cache_flusher *fl);
+
+int start_cache_flusher(struct host_cache *hc);
+
+void stop_cache_flusher(struct host_cache *hc);
+
+void save_cache(struct host_cache *hc);
+
+/* write back all dirty blocks of a LUN, return -1 on I/O error */
+int flush_cache_lu(struct host_cache *hc, int tid, uint64_t lun);
+
+struct cache_lu *cache_lu_add(struct host_cache *hc, int tid, uint64_t lun, \
+			      int fd, uint64_t size);
+
+/* write back dirty blocks of a LUN, the others are dropped in the
+ * background. cache_lu_add() of the same LUN waits for that.
+ */
+void cache_lu_del(struct host_cache *hc, int tid, uint64_t lun);
+
+static inline void count_cache_lu(struct cache_lu *clu, int node, \
+				  uint64_t hits, uint64_t misses, \
+				  uint64_t rd_bytes, uint64_t wr_bytes)
+{
+	struct cache_stat *st = &(clu->stat[node]);
+
+	__atomic_fetch_add(&(st->hits), hits, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(st->misses), misses, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(st->rd_bytes), rd_bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(st->wr_bytes), wr_bytes, __ATOMIC_RELAXED);
+}
+
+/* feed the stream detector of a LUN with a READ of blocks first..last,
+ * windows ahead of a sequential stream are read in the background.
+ */
+void cache_readahead(struct host_cache *hc, int tid, uint64_t lun, \
+		     uint64_t first, uint64_t last);
+
+/* PRE_FETCH of blocks first..last, read into the cache in the background
+ * as a readahead window is.
+ */
+void cache_prefetch(struct host_cache *hc, int tid, uint64_t lun, \
+		    uint64_t first, uint64_t last);
+
 void invalidate_cache_block(int tid, uint64_t lun, \
 			    uint64_t cb_id, struct numa_cache *nc);
 
-/* hash table functions */
-
-int ht_hash_key(uint64_t lba, struct cache_hash_table *ht);
+/* put a dropped block on the unused list, or leave that to the last
+ * unpin. nc is held.
+ */
+void free_cache_block(struct cache_block *cb, struct numa_cache *nc);
 
-/* search hash table, if hit, sort current cell and hit count list */
+/* keep a block and its data while addr in it is sent. -1 if the
+ * partition has CACHE_PIN_RATIO of its blocks pinned, the data is to
+ * be copied then.
+ */
+int pin_cache_block(struct cache_block *cb, struct numa_cache *nc);
 
-void sort_tablecell_list(struct cache_block *cb, struct cache_block *head);
+void unpin_cache_block(struct cache_block *cb, struct numa_cache *nc, \
+		       char *addr);
 
-/* consider hit times */
-void sort_hit_list(struct cache_block *cb, struct cache_block *head);
+/* make a block visible to lookups and list it under its lu, or undo it */
+void index_cache_block(struct numa_cache *nc, struct cache_block *cb);
 
-/* pure lru without hit involved */
-void lru_tablecell_list(struct cache_block *cb, struct cache_block *head);
+void unindex_cache_block(struct numa_cache *nc, struct cache_block *cb);
 
-void lru_hit_list(struct cache_block *cb, struct cache_block *head);
+int cache_lu_bucket(int tid, uint64_t lun);
 
-/* split io-request into sub-tasks
- * return value is a numa node id
+/* drop cached data of bytes [offset, offset + length) of a LUN, a block
+ * partly in the range has that part zeroed. called around UNMAP.
  */
-int split_io(struct scsi_cmd *cmd, struct host_cache *hc);
+void invalidate_cache_range(struct host_cache *hc, int tid, uint64_t lun, \
+			    uint64_t offset, uint64_t length);
+
+/* hash table functions */
+
+uint64_t ht_hash_key(int tid, uint64_t lun, uint64_t cb_id);
+
+int ht_init(struct cache_hash_table *ht, struct cache_block *base, int nb, \
+	    int node);
+
+struct cache_block *ht_lookup(struct cache_hash_table *ht, int tid, \
+			      uint64_t lun, uint64_t cb_id);
+
+void ht_insert(struct cache_hash_table *ht, struct cache_block *cb);
+
+void ht_delete(struct cache_hash_table *ht, struct cache_block *cb);
 
+#endif
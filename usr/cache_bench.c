@@ -0,0 +1,497 @@
+/*
+ * cache-bench - microbenchmark of the NUMA-aware cache
+ *
+ * threads pinned round-robin to numa nodes read a synthetic LUN through
+ * libtgtcache. op lookup only takes the blocks, copy also moves the data
+ * in and out of them, split runs each read through split_io() as tgtd
+ * does. ops go to a hot set of 90% of the cache blocks with the hit
+ * ratio asked for, the others to blocks never read before.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+
+#include "libtgtcache.h"
+#include "cache_tgt.h"
+#include "util.h"
+
+#define BENCH_TID	1
+#define BENCH_HIST	976	/* log-linear, 16 buckets per power of 2 */
+
+enum {
+	BENCH_LOOKUP,
+	BENCH_COPY,
+	BENCH_SPLIT,
+};
+
+enum {
+	BENCH_UNIFORM,
+	BENCH_ZIPF,
+	BENCH_SEQ,
+};
+
+struct bench_thread {
+	pthread_t thread;
+	int id;
+	int node;
+	uint64_t rng;
+	uint64_t seq;
+	uint64_t cold;
+	char *buf;
+	char *src;
+
+	uint64_t ops;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t around;
+	uint64_t hist[BENCH_HIST];
+} __attribute__((aligned(64)));
+
+static char program_name[] = "cache-bench";
+
+static struct host_cache hc;
+static struct scsi_lu bench_lu;
+
+static int nr_threads = 1;
+static int op = BENCH_COPY;
+static int dist = BENCH_UNIFORM;
+static double theta = 0.99;
+static double hit_ratio = 0.9;
+static uint32_t io_size = 4096;
+static int seconds = 5;
+
+static uint64_t hot, nr_op_blocks;
+static double zetan, zipf_alpha, zipf_eta;
+static int bench_stop;
+static pthread_barrier_t bench_barrier;
+
+static char *short_options = "ht:b:c:w:p:o:d:z:r:s:T:A:";
+
+struct option const long_options[] = {
+	{"help", no_argument, NULL, 'h'},
+	{"threads", required_argument, NULL, 't'},
+	{"block", required_argument, NULL, 'b'},
+	{"cache", required_argument, NULL, 'c'},
+	{"way", required_argument, NULL, 'w'},
+	{"policy", required_argument, NULL, 'p'},
+	{"op", required_argument, NULL, 'o'},
+	{"dist", required_argument, NULL, 'd'},
+	{"theta", required_argument, NULL, 'z'},
+	{"hit", required_argument, NULL, 'r'},
+	{"size", required_argument, NULL, 's'},
+	{"time", required_argument, NULL, 'T'},
+	{"admit", required_argument, NULL, 'A'},
+	{NULL, 0, NULL, 0},
+};
+
+static void usage(int status)
+{
+	if (status != 0)
+		fprintf(stderr, "Try `%s --help' for more information.\n", \
+			program_name);
+	else {
+		printf("Usage: %s [OPTION]\n", program_name);
+		printf("\
+NUMA-aware cache microbenchmark\n\
+  -t, --threads n         threads, pinned round-robin to numa nodes\n\
+  -b, --block size        cache block size, 4096 by default\n\
+  -c, --cache size        cache size, 1G by default\n\
+  -w, --way n             partitions per numa node\n\
+  -p, --policy name       lru, clock, 2q or arc\n\
+  -o, --op op             lookup, copy or split, copy by default\n\
+  -d, --dist dist         uniform, zipf or seq, uniform by default\n\
+  -z, --theta theta       zipf skew in (0, 1), 0.99 by default\n\
+  -r, --hit ratio         share of ops on the hot set, 0.9 by default\n\
+  -s, --size size         bytes per op, 4096 by default\n\
+  -T, --time seconds      5 by default\n\
+  -A, --admit on|off      admission filter on misses\n\
+  -h, --help              display this help and exit\n");
+	}
+	exit(status);
+}
+
+static inline uint64_t bench_rand(struct bench_thread *t)
+{
+	t->rng ^= t->rng >> 12;
+	t->rng ^= t->rng << 25;
+	t->rng ^= t->rng >> 27;
+
+	return t->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static inline double bench_rand01(struct bench_thread *t)
+{
+	return (bench_rand(t) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* zipf ranks as generated by YCSB, Gray et al., SIGMOD 1994 */
+static void zipf_init(uint64_t n)
+{
+	double zeta2 = 1 + pow(0.5, theta);
+	uint64_t i;
+
+	zetan = 0;
+	for (i = 1; i <= n; i ++)
+		zetan += 1 / pow(i, theta);
+
+	zipf_alpha = 1 / (1 - theta);
+	zipf_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+}
+
+static uint64_t zipf_next(struct bench_thread *t, uint64_t n)
+{
+	double u = bench_rand01(t), uz = u * zetan;
+	uint64_t r;
+
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + pow(0.5, theta))
+		return 1;
+
+	r = n * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha);
+
+	return min(r, n - 1);
+}
+
+/* first block of the next op */
+static uint64_t next_block(struct bench_thread *t)
+{
+	uint64_t n = hot - nr_op_blocks + 1, cb_id;
+
+	if (bench_rand01(t) >= hit_ratio) {
+		cb_id = hot + ((uint64_t) t->id << 40) + t->cold;
+		t->cold += nr_op_blocks;
+		return cb_id;
+	}
+
+	switch (dist) {
+	case BENCH_ZIPF:
+		return zipf_next(t, n);
+	case BENCH_SEQ:
+		cb_id = (t->seq + t->id * (n / nr_threads)) % n;
+		t->seq += nr_op_blocks;
+		return cb_id;
+	default:
+		return bench_rand(t) % n;
+	}
+}
+
+/* read [off, off + len) of block cb_id into dst, NULL is no copy */
+static void read_block(struct bench_thread *t, uint64_t cb_id, uint32_t off, \
+		       uint32_t len, char *dst)
+{
+	struct numa_cache *nc;
+	struct cache_block *cb;
+
+	nc = &(hc.nc[offset2ncid(cb_id * hc.cbs, &hc)]);
+	nc_lock(nc);
+
+retry:
+	if (hc.admit && !ht_lookup(&(nc->ht), BENCH_TID, 0, cb_id) && \
+	    !admit_cache_block(nc, BENCH_TID, 0, cb_id, 1)) {
+		nc_mutex_unlock(&(nc->mutex));
+		if (dst)
+			memcpy(dst, t->src + off, len);
+		t->around ++;
+		return;
+	}
+
+	cb = get_cache_block(BENCH_TID, 0, cb_id, nc);
+	if (cb == NULL || cb->is_valid == CACHE_PENDING) {
+		wait_cache_block(nc);
+		goto retry;
+	}
+
+	if (cb->is_valid == CACHE_VALID) {
+		if (dst)
+			memcpy(dst, cb_addr(cb, nc) + off, len);
+		nc_mutex_unlock(&(nc->mutex));
+		t->hits ++;
+		return;
+	}
+
+	/* a miss, filled from src as if read from disk */
+	cb->cb_id = cb_id;
+	cb->tid = BENCH_TID;
+	cb->lun = 0;
+	pend_cache_block(cb, nc);
+	if (dst) {
+		nc_mutex_unlock(&(nc->mutex));
+		memcpy(cb_addr(cb, nc), t->src, hc.cbs);
+		memcpy(dst, cb_addr(cb, nc) + off, len);
+		nc_lock(nc);
+	}
+	complete_cache_block(cb, nc, CACHE_VALID);
+	nc_mutex_unlock(&(nc->mutex));
+	t->misses ++;
+}
+
+static void split_read(struct bench_thread *t, uint64_t cb_id)
+{
+	struct sub_io_request ior;
+	struct tcp_data_buf tb;
+	struct scsi_cmd cmd;
+	uint8_t scb[16];
+	int i;
+
+	memset(&cmd, 0, sizeof(cmd));
+	memset(scb, 0, sizeof(scb));
+	for (i = 0; i < MAX_NR_NUMA_NODES; i ++)
+		tb.addr[i] = t->buf;
+
+	scb[0] = READ_16;
+	put_unaligned_be64(cb_id * hc.cbs >> bench_lu.blk_shift, &scb[2]);
+	cmd.scb = scb;
+	cmd.tid = BENCH_TID;
+	cmd.dev = &bench_lu;
+	cmd.netbuf = &tb;
+	scsi_set_in_length(&cmd, io_size);
+
+	split_io(&cmd, &hc);
+
+	for (i = 0; i < cmd.nr_sior; i ++) {
+		get_sior(&cmd, i, &ior, &hc);
+		read_block(t, ior.cb_id, ior.in_offset, ior.length, \
+			   scsi_get_in_buffer(&cmd) + ior.m_offset);
+	}
+}
+
+static void bench_op(struct bench_thread *t, uint64_t cb_id)
+{
+	uint32_t done, len;
+	uint64_t i;
+
+	if (op == BENCH_SPLIT) {
+		split_read(t, cb_id);
+		return;
+	}
+
+	for (i = 0, done = 0; i < nr_op_blocks; i ++, done += len) {
+		len = min(io_size - done, (uint32_t) hc.cbs);
+		read_block(t, cb_id + i, 0, len, \
+			   op == BENCH_COPY ? t->buf + done : NULL);
+	}
+}
+
+static inline int hist_index(uint64_t v)
+{
+	int e;
+
+	if (v < 16)
+		return v;
+	e = 63 - __builtin_clzll(v);
+
+	return (e - 3) * 16 + ((v >> (e - 4)) & 15);
+}
+
+static inline uint64_t hist_value(int i)
+{
+	if (i < 16)
+		return i;
+
+	return (uint64_t) (16 + i % 16) << (i / 16 - 1);
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *bench_fn(void *arg)
+{
+	struct bench_thread *t = arg;
+	uint64_t cb_id, start, end;
+
+	cache_run_on_node(t->node);
+
+	/* warm the hot set, each thread a share of it */
+	for (cb_id = t->id; cb_id < hot; cb_id += nr_threads)
+		read_block(t, cb_id, 0, hc.cbs, op == BENCH_LOOKUP ? \
+			   NULL : t->buf);
+	t->hits = t->misses = t->around = 0;
+
+	pthread_barrier_wait(&bench_barrier);
+
+	while (!__atomic_load_n(&bench_stop, __ATOMIC_RELAXED)) {
+		cb_id = next_block(t);
+		start = now_ns();
+		bench_op(t, cb_id);
+		end = now_ns();
+
+		t->hist[hist_index(end - start)] ++;
+		t->ops ++;
+	}
+
+	return NULL;
+}
+
+static uint64_t percentile(uint64_t *hist, uint64_t total, double p)
+{
+	uint64_t sum = 0, want = ceil(total * p);
+	int i;
+
+	for (i = 0; i < BENCH_HIST; i ++) {
+		sum += hist[i];
+		if (sum >= want && sum)
+			return hist_value(i);
+	}
+
+	return 0;
+}
+
+static int str_to_val(const char *s, const char *names[], int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i ++)
+		if (!strcasecmp(s, names[i]))
+			return i;
+
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *ops[] = {"lookup", "copy", "split"};
+	static const char *dists[] = {"uniform", "zipf", "seq"};
+	struct cache_param cp;
+	struct bench_thread *th;
+	uint64_t hist[BENCH_HIST];
+	uint64_t total, ops_sum = 0, hits = 0, misses = 0, around = 0;
+	uint64_t start, end, nb;
+	double secs;
+	int ch, longindex, i, j;
+
+	init_cache_param(&cp);
+
+	while ((ch = getopt_long(argc, argv, short_options, long_options, \
+				 &longindex)) >= 0) {
+		switch (ch) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'b':
+			cp.cbs = byte_atoi(optarg);
+			break;
+		case 'c':
+			cp.buffer_size = byte_atoi(optarg);
+			break;
+		case 'w':
+			cp.cache_way = atoi(optarg);
+			break;
+		case 'p':
+			cp.policy = optarg;
+			break;
+		case 'o':
+			op = str_to_val(optarg, ops, ARRAY_SIZE(ops));
+			break;
+		case 'd':
+			dist = str_to_val(optarg, dists, ARRAY_SIZE(dists));
+			break;
+		case 'z':
+			theta = atof(optarg);
+			break;
+		case 'r':
+			hit_ratio = atof(optarg);
+			break;
+		case 's':
+			io_size = byte_atoi(optarg);
+			break;
+		case 'T':
+			seconds = atoi(optarg);
+			break;
+		case 'A':
+			cp.admit = !strcmp(optarg, "on");
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	if (nr_threads <= 0 || op < 0 || dist < 0 || cp.cbs <= 0 || \
+	    cp.cbs % 512 || io_size == 0 || theta <= 0 || theta >= 1 || \
+	    hit_ratio < 0 || hit_ratio > 1 || seconds <= 0)
+		usage(1);
+
+	if (tgtcache_init(&hc, &cp) != 0)
+		exit(1);
+
+	for (i = 0, nb = 0; i < hc.nr_numa_nodes * hc.nr_cache_area; i ++)
+		nb += hc.nc[i].nb;
+	hot = nb * 9 / 10;
+	nr_op_blocks = (io_size + hc.cbs - 1) / hc.cbs;
+	if (hot < nr_op_blocks) {
+		fprintf(stderr, "%s: cache too small for %u byte ops\n", \
+			program_name, io_size);
+		exit(1);
+	}
+	if (dist == BENCH_ZIPF)
+		zipf_init(hot - nr_op_blocks + 1);
+
+	bench_lu.blk_shift = 9;
+	bench_lu.size = UINT64_MAX;
+
+	th = calloc(nr_threads, sizeof(*th));
+	if (th == NULL)
+		exit(1);
+	pthread_barrier_init(&bench_barrier, NULL, nr_threads + 1);
+
+	for (i = 0; i < nr_threads; i ++) {
+		th[i].id = i;
+		th[i].node = i % hc.nr_numa_nodes;
+		th[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+		th[i].buf = cache_numa_alloc(nr_op_blocks * hc.cbs, th[i].node);
+		th[i].src = cache_numa_alloc(hc.cbs, th[i].node);
+		if (th[i].buf == NULL || th[i].src == NULL)
+			exit(1);
+		memset(th[i].src, i, hc.cbs);
+		pthread_create(&th[i].thread, NULL, bench_fn, &th[i]);
+	}
+
+	pthread_barrier_wait(&bench_barrier);
+	start = now_ns();
+	sleep(seconds);
+	__atomic_store_n(&bench_stop, 1, __ATOMIC_RELAXED);
+
+	memset(hist, 0, sizeof(hist));
+	for (i = 0; i < nr_threads; i ++) {
+		pthread_join(th[i].thread, NULL);
+		ops_sum += th[i].ops;
+		hits += th[i].hits;
+		misses += th[i].misses;
+		around += th[i].around;
+		for (j = 0; j < BENCH_HIST; j ++)
+			hist[j] += th[i].hist[j];
+	}
+	end = now_ns();
+	secs = (end - start) / 1e9;
+	total = hits + misses + around;
+
+	printf("%d threads on %d nodes, %s, %s, %d byte blocks, " \
+	       "%u byte ops, %" PRIu64 " hot blocks\n", nr_threads, \
+	       hc.nr_numa_nodes, ops[op], dists[dist], hc.cbs, io_size, hot);
+	printf("ops/s %.0f, GB/s %.3f, hit %.1f%% (%.1f%% asked), " \
+	       "around %.1f%%\n", ops_sum / secs, \
+	       ops_sum * (double) io_size / secs / 1e9, \
+	       total ? 100.0 * hits / total : 0, 100 * hit_ratio, \
+	       total ? 100.0 * around / total : 0);
+	printf("latency ns p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64 \
+	       ", p99.9 %" PRIu64 ", max %" PRIu64 "\n", \
+	       percentile(hist, ops_sum, 0.5), \
+	       percentile(hist, ops_sum, 0.9), \
+	       percentile(hist, ops_sum, 0.99), \
+	       percentile(hist, ops_sum, 0.999), \
+	       percentile(hist, ops_sum, 1));
+
+	tgtcache_exit(&hc);
+
+	return 0;
+}
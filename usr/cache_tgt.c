@@ -0,0 +1,390 @@
+/* tgtd side of the NUMA cache, see cache_tgt.h */
+
+#include "cache_tgt.h"
+#include "util.h"
+
+/* LBA of a READ or WRITE, the only commands split. decoded here rather
+ * than by scsi_rw_offset(), so that cache-bench links without scsi.c.
+ */
+static uint64_t cache_rw_lba(uint8_t *scb)
+{
+	switch (scb[0]) {
+	case READ_6:
+	case WRITE_6:
+		return ((scb[1] & 0x1f) << 16) + (scb[2] << 8) + scb[3];
+	case READ_16:
+	case WRITE_16:
+		return get_unaligned_be64(&scb[2]);
+	default:
+		return get_unaligned_be32(&scb[2]);
+	}
+}
+
+/* split_io memo. a slot holds the key hash with the node in its low
+ * byte, picked by the hash bits above it. read and written without
+ * lock. a stale or colliding slot only sends the command to a worse
+ * node, never to a wrong block.
+ */
+static inline uint64_t split_memo_key(int tid, uint8_t *lun, uint64_t lba, \
+				      uint32_t length)
+{
+	uint64_t l;
+
+	memcpy(&l, lun, sizeof(l));
+
+	return ht_hash_key(0, ht_hash_key(tid, l, lba), length) & ~0xffULL;
+}
+
+static inline uint64_t *split_memo_slot(struct host_cache *hc, uint64_t key)
+{
+	return &(hc->split_memo[(key >> 8) & (CACHE_SPLIT_MEMO - 1)]);
+}
+
+static int lookup_split_memo(struct host_cache *hc, uint64_t key)
+{
+	uint64_t v;
+
+	v = __atomic_load_n(split_memo_slot(hc, key), \
+			    __ATOMIC_RELAXED);
+	if ((v & ~0xffULL) != key || (v & 0xff) == 0)
+		return -1;
+
+	return (int) (v & 0xff) - 1;
+}
+
+static void update_split_memo(struct host_cache *hc, uint64_t key, int nodeid)
+{
+	__atomic_store_n(split_memo_slot(hc, key), \
+			 key | (uint64_t) (nodeid + 1), __ATOMIC_RELAXED);
+}
+
+/* node a read or write was split to lately, -1 if not known. lets the
+ * submitter and network drivers pick the node before split_io runs.
+ */
+int cache_cmd_node(struct host_cache *hc, int tid, uint8_t *lun, \
+		   uint8_t *scb, uint32_t length)
+{
+	switch (scb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		break;
+	default:
+		return -1;
+	}
+
+	return lookup_split_memo(hc, \
+		split_memo_key(tid, lun, cache_rw_lba(scb), length));
+}
+
+int split_io(struct scsi_cmd *cmd, struct host_cache *hc)
+{
+	/* V is in request data (each V is a logic block)
+	 *
+	 * |uuuVVVVV|VVVVVVVV|VVVuuuuu|u...
+	 *  ^  ^                ^      ^
+         *  a_shadow
+	 *     cmd->offset
+	 *                      cmd->offset + length
+	 *                             b_shadow
+	 */
+
+	int i;
+	int nodeid;
+	int aff[MAX_NR_NUMA_NODES];
+	int aff_max;
+	uint32_t length;
+	uint64_t a_shadow;
+	uint64_t b_shadow;
+	uint64_t lba;
+	uint64_t key;
+
+	struct iser_membuf *data_buf;
+	struct tcp_data_buf *tcp_buf;
+
+	dprintf("numa cache: start split io\n");
+
+	switch (cmd->scb[0])
+	{
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		length = scsi_get_out_length(cmd);
+		break;
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		length = scsi_get_in_length(cmd);
+		break;
+	default:
+		dprintf("numa cache: command not support 0x%x\n", \
+			cmd->scb[0]);
+		return 0;
+		break;
+	}
+
+	/* other commands keep the offset sbc gave them */
+	lba = cache_rw_lba(cmd->scb);
+	cmd->offset = lba << cmd->dev->blk_shift;
+
+	cmd->nr_sior = 0;
+
+	/* take care of x.999999999  = 1 */
+	a_shadow = (uint64_t) cmd->offset - (cmd->offset % (uint64_t) hc->cbs);
+	b_shadow = (uint64_t) (cmd->offset + (uint64_t) length - 1) - ((cmd->offset + (uint64_t) length - 1) % (uint64_t) hc->cbs) + hc->cbs;
+	cmd->nr_sior = (b_shadow - a_shadow) / (uint64_t) hc->cbs;
+
+	/* sub-IOs are computed on demand by get_sior() */
+	cmd->sior_cb_id = a_shadow / hc->cbs;
+	cmd->sior_head = (uint32_t) (cmd->offset - a_shadow);
+	cmd->sior_length = length;
+	dprintf("numa cache: tid %d lun %ld cb_id %ld, %d blocks, head %u, len %u\n", \
+		cmd->tid, cmd->dev->lun, cmd->sior_cb_id, cmd->nr_sior, \
+		cmd->sior_head, length);
+
+	key = split_memo_key(cmd->tid, cmd->lun, lba, length);
+	nodeid = lookup_split_memo(hc, key);
+	if (nodeid < 0) {
+		for (i = 0; i < hc->nr_numa_nodes; i ++)
+			aff[i] = 0;
+
+		for (i = 0; i < cmd->nr_sior; i ++)
+			aff[ncid2nodeid(offset2ncid((cmd->sior_cb_id + i) * \
+						    hc->cbs, hc), hc)] ++;
+
+		nodeid = 0;
+		aff_max = aff[0];
+		for (i = 1; i < hc->nr_numa_nodes; i ++) {
+			if (aff[i] > aff_max) {
+				nodeid = i;
+				aff_max = aff[i];
+			}
+		}
+
+		update_split_memo(hc, key, nodeid);
+	}
+
+	dprintf("numa cache: start parse numa node split io\n");
+
+	/* data allocated for the task alone stays where it is */
+	if (cmd->netbuf == NULL) {
+		cmd->nodeid = nodeid;
+		return nodeid;
+	}
+
+	/* reset network buffer location */
+	data_buf = NULL;
+	tcp_buf = NULL;
+	if (cmd->rdma == 1) {
+		data_buf = (struct iser_membuf *) cmd->netbuf;
+		/* ONLY read operation need reset nodeid */
+	switch (cmd->scb[0])
+	{
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		data_buf->cur_node = nodeid;
+		break;
+	default:
+		break;
+	}
+		cmd->nodeid = nodeid;
+		data_buf->addr = data_buf->numa_addr[data_buf->cur_node];
+	} else {
+		tcp_buf = (struct tcp_data_buf *) cmd->netbuf;
+		/* write data is already in the buffer it was received in */
+	switch (cmd->scb[0])
+	{
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		tcp_buf->cur_node = nodeid;
+		break;
+	default:
+		break;
+	}
+		cmd->nodeid = nodeid;
+		tcp_buf->cur_addr = tcp_buf->addr[tcp_buf->cur_node];
+	}
+	dprintf("numa cache: parse this task to node %d\n", nodeid);
+	dprintf("numa cache: update network buf address\n");
+
+	switch (cmd->scb[0])
+	{
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+		if (cmd->rdma == 1) {
+			scsi_set_out_buffer(cmd, data_buf->addr);
+		} else {
+			scsi_set_out_buffer(cmd, tcp_buf->cur_addr);
+		}
+		break;
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		if (cmd->rdma == 1) {
+			scsi_set_in_buffer(cmd, data_buf->addr);
+		} else {
+			scsi_set_in_buffer(cmd, tcp_buf->cur_addr);
+		}
+		break;
+	default:
+		dprintf("numa cache: command not support 0x%x\n", \
+			cmd->scb[0]);
+		return 0;
+		break;
+	}
+
+	return nodeid;
+}
+
+void cache_unpin_cmd(struct host_cache *hc, struct scsi_cmd *cmd)
+{
+	struct numa_cache *nc, *held = NULL;
+	int i;
+
+	for (i = 0; i < cmd->nr_zc; i ++) {
+		if (cmd->zc[i].cb == NULL)
+			continue;
+
+		nc = &(hc->nc[cmd->zc[i].nc_id]);
+		if (nc != held) {
+			if (held)
+				nc_mutex_unlock(&(held->mutex));
+			nc_lock(nc);
+			held = nc;
+		}
+		unpin_cache_block(cmd->zc[i].cb, nc, cmd->zc[i].addr);
+	}
+	if (held)
+		nc_mutex_unlock(&(held->mutex));
+
+	free(cmd->zc);
+	cmd->zc = NULL;
+	cmd->nr_zc = 0;
+}
+
+static void sum_cache_stat(struct cache_stat *sum, struct cache_stat *st, \
+			   int nr)
+{
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < nr; i ++) {
+		sum->hits += __atomic_load_n(&(st[i].hits), __ATOMIC_RELAXED);
+		sum->misses += __atomic_load_n(&(st[i].misses), __ATOMIC_RELAXED);
+		sum->rd_bytes += __atomic_load_n(&(st[i].rd_bytes), __ATOMIC_RELAXED);
+		sum->wr_bytes += __atomic_load_n(&(st[i].wr_bytes), __ATOMIC_RELAXED);
+		sum->forwarded += __atomic_load_n(&(st[i].forwarded), __ATOMIC_RELAXED);
+		sum->stolen += __atomic_load_n(&(st[i].stolen), __ATOMIC_RELAXED);
+	}
+}
+
+static unsigned hit_permille(struct cache_stat *st)
+{
+	uint64_t n = st->hits + st->misses;
+
+	return n ? (unsigned) (st->hits * 1000 / n) : 0;
+}
+
+/* tgtadm --mode sys --op show */
+void cache_show(struct host_cache *hc, struct concat_buf *b)
+{
+	struct numa_cache *nc;
+	struct cache_stat st;
+	struct cache_lu *clu;
+	int i, cached, dirty, active, target;
+	uint32_t used;
+
+	concat_printf(b, "NUMA cache:\n");
+	concat_printf(b, _TAB1 "Policy: %s\n", hc->policy->name);
+	concat_printf(b, _TAB1 "Block size: %d\n", hc->cbs);
+	concat_printf(b, _TAB1 "Size: %zu\n", hc->buffer_size);
+	concat_printf(b, _TAB1 "Kept in: %s\n", hc->mem ? hc->mem : "memory");
+	concat_printf(b, _TAB1 "Admission: %s\n", hc->admit ? "on" : "off");
+	concat_printf(b, _TAB1 "Bypass: %zu\n", hc->bypass);
+	concat_printf(b, _TAB1 "Dedup: %s\n", hc->dedup ? "on" : "off");
+
+	for (i = 0; i < hc->nr_numa_nodes * hc->nr_cache_area; i ++) {
+		nc = &(hc->nc[i]);
+
+		nc_mutex_lock(&(nc->mutex));
+		st = nc->stat;
+		cached = nc->nr_q[0] + nc->nr_q[1];
+		dirty = nc->nr_dirty;
+		active = nc->nb_active;
+		target = nc->nb_target;
+		used = nc->nr_data - nc->nr_data_free;
+		nc_mutex_unlock(&(nc->mutex));
+
+		concat_printf(b, _TAB1 "Partition %d: node %d\n", i, \
+			      nc->on_numa_node);
+		concat_printf(b, _TAB2 "Blocks: %d, cached %d, dirty %d\n", \
+			      nc->nb, cached, dirty);
+		if (active != nc->nb || target != nc->nb)
+			concat_printf(b, _TAB2 "In use: %d, target %d\n", \
+				      active, target);
+		concat_printf(b, _TAB2 "Hits: %" PRIu64 ", misses %" PRIu64 \
+			      ", hit ratio %u.%u%%\n", st.hits, st.misses, \
+			      hit_permille(&st) / 10, hit_permille(&st) % 10);
+		concat_printf(b, _TAB2 "Evictions: %" PRIu64 \
+			      ", invalidations %" PRIu64 \
+			      ", bypassed %" PRIu64 "\n", \
+			      st.evictions, st.invalidations, st.bypassed);
+		concat_printf(b, _TAB2 "Lock waits: %" PRIu64 ", %" PRIu64 \
+			      " us\n", st.lock_waits, st.lock_wait_ns / 1000);
+		if (nc->data)
+			concat_printf(b, _TAB2 "Data: %u of %u, deduped %" \
+				      PRIu64 ", copied %" PRIu64 "\n", \
+				      used, nc->nr_data, st.dedup, st.cow);
+	}
+
+	for (i = 0; i < hc->nr_numa_nodes; i ++) {
+		sum_cache_stat(&st, &(hc->node_stat[i]), 1);
+		concat_printf(b, _TAB1 "Node %d: forwarded %" PRIu64 \
+			      ", stolen %" PRIu64 "\n", i, st.forwarded, \
+			      st.stolen);
+	}
+
+	pthread_rwlock_rdlock(&(hc->lu_lock));
+	list_for_each_entry(clu, &(hc->lu_list), list) {
+		sum_cache_stat(&st, clu->stat, hc->nr_numa_nodes);
+		concat_printf(b, _TAB1 "LUN %d:%" PRIu64 ": hits %" PRIu64 \
+			      ", misses %" PRIu64 ", read %" PRIu64 \
+			      ", written %" PRIu64 "\n", clu->tid, clu->lun, \
+			      st.hits, st.misses, st.rd_bytes, st.wr_bytes);
+	}
+	pthread_rwlock_unlock(&(hc->lu_lock));
+}
+
+/* tgtadm --op stat, one line per lu */
+void cache_stat_show(struct host_cache *hc, struct concat_buf *b)
+{
+	struct cache_stat st;
+	struct cache_lu *clu;
+
+	concat_printf(b, "tgt lun cache_hits cache_misses "
+		      "rd_copy(bytes) wr_copy(bytes)\n");
+
+	pthread_rwlock_rdlock(&(hc->lu_lock));
+	list_for_each_entry(clu, &(hc->lu_list), list) {
+		sum_cache_stat(&st, clu->stat, hc->nr_numa_nodes);
+		concat_printf(b, "%3d %3" PRIu64 " %10" PRIu64 " %12" PRIu64 \
+			      " %14" PRIu64 " %14" PRIu64 "\n", \
+			      clu->tid, clu->lun, st.hits, st.misses, \
+			      st.rd_bytes, st.wr_bytes);
+	}
+	pthread_rwlock_unlock(&(hc->lu_lock));
+}
@@ -0,0 +1,59 @@
+/* tgtd side of the NUMA cache, commands are split and served with
+ * scsi_cmd. cache.h itself does not know tgtd, libtgtcache is built
+ * without this.
+ */
+#ifndef __CACHE_TGT_H__
+#define __CACHE_TGT_H__
+
+#include "cache.h"
+#include "tgtd.h"
+#include "scsi.h"
+#include "bs_thread.h"
+
+/* i-th sub-IO of a command split by split_io() */
+static inline void get_sior(struct scsi_cmd *cmd, int i, \
+			    struct sub_io_request *ior, struct host_cache *hc)
+{
+	uint64_t end;
+
+	ior->tid = cmd->tid;
+	ior->lun = cmd->dev->lun;
+	ior->dev_id = cmd->dev_id;
+	ior->cb_id = cmd->sior_cb_id + i;
+	ior->offset = ior->cb_id * hc->cbs;
+	ior->nc_id = offset2ncid(ior->offset, hc);
+
+	if (i == 0) {
+		ior->in_offset = cmd->sior_head;
+		ior->m_offset = 0;
+	} else {
+		ior->in_offset = 0;
+		ior->m_offset = (uint64_t) i * hc->cbs - cmd->sior_head;
+	}
+
+	end = (uint64_t) (i + 1) * hc->cbs - cmd->sior_head;
+	if (end > cmd->sior_length)
+		end = cmd->sior_length;
+	ior->length = end - ior->m_offset;
+}
+
+/* split io-request into sub-tasks
+ * return value is a numa node id
+ */
+int split_io(struct scsi_cmd *cmd, struct host_cache *hc);
+
+int cache_cmd_node(struct host_cache *hc, int tid, uint8_t *lun, \
+		   uint8_t *scb, uint32_t length);
+
+/* release the blocks a command sent its read hits from, once the data
+ * is on the wire
+ */
+void cache_unpin_cmd(struct host_cache *hc, struct scsi_cmd *cmd);
+
+struct concat_buf;
+
+void cache_show(struct host_cache *hc, struct concat_buf *b);
+
+void cache_stat_show(struct host_cache *hc, struct concat_buf *b);
+
+#endif
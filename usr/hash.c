@@ -1,51 +1,216 @@
 #include "cache.h"
 
-int ht_hash_key(uint64_t lba, struct cache_hash_table *ht)
+/* 64-bit finalizer of MurmurHash3, every input bit affects every
+ * output bit, so consecutive cb_ids and different LUNs spread out.
+ */
+static inline uint64_t ht_mix64(uint64_t k)
 {
-	return (int) (lba % ht->sz);
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
 }
 
-struct cache_block *get_cache_block(int tid, uint64_t lun, uint64_t cb_id, \
-				    struct numa_cache *nc)
+uint64_t ht_hash_key(int tid, uint64_t lun, uint64_t cb_id)
+{
+	return ht_mix64(cb_id ^ ht_mix64(((uint64_t) tid << 48) ^ lun));
+}
+
+static inline uint32_t ht_tag(uint64_t key)
+{
+	return (uint32_t) (key >> 32);
+}
+
+static inline int cb_match(struct cache_block *cb, int tid, uint64_t lun, \
+			   uint64_t cb_id)
+{
+	return (cb->cb_id == cb_id) && (cb->tid == tid) && (cb->lun == lun);
+}
+
+int ht_init(struct cache_hash_table *ht, struct cache_block *base, int nb, \
+	    int node)
+{
+	/* keep load factor at or below one half */
+	ht->sz = 1;
+	while (ht->sz < (uint32_t) nb * 2)
+		ht->sz <<= 1;
+	ht->mask = ht->sz - 1;
+	ht->base = base;
+
+	ht->slot = (struct cache_slot *) \
+		cache_numa_alloc(ht->sz * sizeof(struct cache_slot), node);
+	if (ht->slot == NULL)
+		return -1;
+
+	memset(ht->slot, '\0', ht->sz * sizeof(struct cache_slot));
+
+	return 0;
+}
+
+struct cache_block *ht_lookup(struct cache_hash_table *ht, int tid, \
+			      uint64_t lun, uint64_t cb_id)
 {
-	int key;
-	struct list_head *pos;
-	struct cache_block *clist;	/* hash table cell list */
+	struct cache_slot *s;
 	struct cache_block *cur;
-	struct cache_hash_table *ht = &(nc->ht);
-	struct cache_block *hit_head = &(nc->hit_list);
-	int is_found;
+	uint64_t key;
+	uint32_t i, tag;
+
+	key = ht_hash_key(tid, lun, cb_id);
+	tag = ht_tag(key);
+
+	for (i = key & ht->mask; ; i = (i + 1) & ht->mask) {
+		s = &(ht->slot[i]);
+		if (s->idx == 0)
+			return NULL;
+		if (s->tag != tag)
+			continue;
+
+		cur = &(ht->base[s->idx - 1]);
+		if (cb_match(cur, tid, lun, cb_id))
+			return cur;
+	}
+}
 
-	key = ht_hash_key(cb_id, ht);
-	dprintf("numa cache: this io key is %d\n", key);
+void ht_insert(struct cache_hash_table *ht, struct cache_block *cb)
+{
+	uint64_t key;
+	uint32_t i;
 
-	clist = &(ht->tablecell[key]);
+	key = ht_hash_key(cb->tid, cb->lun, cb->cb_id);
 
-	/* search */
-	cur = NULL;
-	is_found = 0;
-	list_for_each_entry(cur, &(clist->list), list) {
-		if ((cur->cb_id == cb_id) && (cur->tid == tid) \
-		    && (cur->lun == lun)) {
-			dprintf("numa cache: hit cache info %ld %d %ld.\n", \
-				cb_id, tid, lun);
-			is_found = 1;
-			break;
+	for (i = key & ht->mask; ht->slot[i].idx; i = (i + 1) & ht->mask)
+		;
+
+	ht->slot[i].tag = ht_tag(key);
+	ht->slot[i].idx = (uint32_t) (cb - ht->base) + 1;
+
+	return;
+}
+
+/* backward shift deletion, no tombstones are left behind */
+void ht_delete(struct cache_hash_table *ht, struct cache_block *cb)
+{
+	struct cache_block *cur;
+	uint32_t idx, i, j, home;
+
+	idx = (uint32_t) (cb - ht->base) + 1;
+
+	i = ht_hash_key(cb->tid, cb->lun, cb->cb_id) & ht->mask;
+	while (ht->slot[i].idx != idx) {
+		if (ht->slot[i].idx == 0) {
+			eprintf("numa cache: block %" PRIu64 " not indexed\n", \
+				cb->cb_id);
+			return;
 		}
+		i = (i + 1) & ht->mask;
+	}
+
+	for (j = (i + 1) & ht->mask; ht->slot[j].idx; j = (j + 1) & ht->mask) {
+		cur = &(ht->base[ht->slot[j].idx - 1]);
+		home = ht_hash_key(cur->tid, cur->lun, cur->cb_id) & ht->mask;
+
+		/* slot j may move to i only if its home is not in (i, j] */
+		if (((j - home) & ht->mask) < ((j - i) & ht->mask))
+			continue;
+
+		ht->slot[i] = ht->slot[j];
+		i = j;
+	}
+
+	ht->slot[i].tag = 0;
+	ht->slot[i].idx = 0;
+
+	return;
+}
+
+int cache_lu_bucket(int tid, uint64_t lun)
+{
+	return ht_mix64(((uint64_t) tid << 48) ^ lun) & (CACHE_LU_BUCKETS - 1);
+}
+
+void index_cache_block(struct numa_cache *nc, struct cache_block *cb)
+{
+	int b = cache_lu_bucket(cb->tid, cb->lun);
+
+	ht_insert(&(nc->ht), cb);
+	list_add_tail(&(cb->lu_list), &(nc->lu_blocks[b]));
+	nc->nr_lu_blocks[b] ++;
+}
+
+void unindex_cache_block(struct numa_cache *nc, struct cache_block *cb)
+{
+	ht_delete(&(nc->ht), cb);
+	list_del_init(&(cb->lu_list));
+	nc->nr_lu_blocks[cache_lu_bucket(cb->tid, cb->lun)] --;
+}
+
+/* replace a block of the policy, its data slot is given back */
+static struct cache_block *evict_cache_block(struct numa_cache *nc)
+{
+	struct cache_block *cur;
+
+	/* the policy picks a clean block, dirty ones wait for destager */
+	cur = nc->policy->evict(nc);
+	if (cur == NULL) {
+		dprintf("numa cache: no block can be replaced\n");
+		if (nc->nr_dirty && nc->fl)
+			kick_cache_flusher(nc->fl);
+		return NULL;
 	}
+	dprintf("numa cache: %s replace cache info %ld %d %ld\n", \
+		nc->policy->name, cur->cb_id, cur->tid, cur->lun);
 
-	if (is_found) {
-		dprintf("numa cache: hit cache in hash table\n");
-		/* cur->hit_count ++; */
-		/* lrure-sort hash tablecell list */
-		dprintf("numa cache: re-sort hash tablecell\n");
-		/* sort_tablecell_list(cur, clist); */
-		lru_tablecell_list(cur, clist);
+	/* delete from hash table */
+	unindex_cache_block(nc, cur);
+	drop_cache_data(cur, nc);
+
+	cur->is_valid = CACHE_INVALID;
+	cur->flags &= ~(CB_REF | CB_Q1);
+	nc->stat.evictions ++;
 
-		/* re-sort hit list */
-		dprintf("numa cache: re-sort hit list\n");
-		/* sort_hit_list(cur, hit_head); */
-		lru_hit_list(cur, hit_head);
+	return cur;
+}
+
+/* a free data slot, blocks are replaced while all slots are shared by
+ * the blocks left
+ */
+static int alloc_cache_data(struct numa_cache *nc, uint32_t *d)
+{
+	struct cache_block *cb;
+
+	while (nc->nr_data_free == 0) {
+		cb = evict_cache_block(nc);
+		if (cb == NULL)
+			return -1;
+		list_add_tail(&(cb->list), &(nc->unused_list));
+	}
+
+	*d = nc->data_free[-- nc->nr_data_free];
+	nc->data[*d].ref = 1;
+	nc->data[*d].hashed = 0;
+
+	return 0;
+}
+
+struct cache_block *get_cache_block(int tid, uint64_t lun, uint64_t cb_id, \
+				    struct numa_cache *nc)
+{
+	struct cache_block *cur;
+
+	/* search */
+	cur = ht_lookup(&(nc->ht), tid, lun, cb_id);
+	if (cur) {
+		/* I/O in flight on this block, caller has to wait */
+		if (cur->is_valid == CACHE_PENDING)
+			return cur;
+
+		dprintf("numa cache: hit cache info %ld %d %ld.\n", \
+			cb_id, tid, lun);
+		nc->policy->hit(cur, nc);
+		nc->stat.hits ++;
 
 		return cur;
 	}
@@ -53,39 +218,25 @@ struct cache_block *get_cache_block(int tid, uint64_t lun, uint64_t cb_id, \
 	/* admit a cache block */
 	/* check ununsed list */
 	dprintf("numa cache: check unused list\n");
-	if (!list_empty(&(nc->unused_list.list))) {
+	if (!list_empty(&(nc->unused_list))) {
 		dprintf("numa cache: find a block in unused list\n");
-		cur = list_first_entry(&(nc->unused_list.list), \
+		cur = list_first_entry(&(nc->unused_list), \
 			struct cache_block, list);
-		list_del(&(cur->list));
-
-		cur->hit_count = 0;
-		cur->is_valid = CACHE_INVALID;
-
-		return cur;
+		list_del_init(&(cur->list));
+	} else {
+		cur = evict_cache_block(nc);
+		if (cur == NULL)
+			return NULL;
 	}
-		
-	/* check hit list */
-	dprintf("numa cache: check hit count list - should not empty\n");
-	if (list_empty(&(nc->hit_list.hit_list))) {
-		eprintf("numa cache: there must be a bug here!\n");
-	}
-
-	/* get the last item */
-	pos = nc->hit_list.hit_list.prev;
-	cur = list_entry(pos, struct cache_block, hit_list);
-	dprintf("numa cache: LRU replace cache info %ld %d %ld\n",
-		cur->cb_id, cur->tid, cur->lun);
 
-	dprintf("numa cache: delete from hash table\n");
-	/* delete from hash table */
-	list_del(&(cur->list));
-
-	/* delete from hit list */
-	list_del(&(cur->hit_list));
+	/* with dedup, a block has no data until it is taken */
+	if (nc->data && alloc_cache_data(nc, &(cur->data)) != 0) {
+		list_add(&(cur->list), &(nc->unused_list));
+		return NULL;
+	}
 
-	cur->hit_count = 0;
 	cur->is_valid = CACHE_INVALID;
+	nc->stat.misses ++;
 
 	return cur;
 }
@@ -93,99 +244,332 @@ struct cache_block *get_cache_block(int tid, uint64_t lun, uint64_t cb_id, \
 void invalidate_cache_block(int tid, uint64_t lun, uint64_t cb_id, \
 			    struct numa_cache *nc)
 {
-	int key;
-	struct cache_block *clist;	/* hash table cell list */
 	struct cache_block *cur;
-	struct cache_hash_table *ht = &(nc->ht);
-	int is_found;
 
-	key = ht_hash_key(cb_id, ht);
-	dprintf("numa cache: this io key is %d\n", key);
-
-	clist = &(ht->tablecell[key]);
-
-	/* search */
-	cur = NULL;
-	is_found = 0;
-	list_for_each_entry(cur, &(clist->list), list) {
-		if ((cur->cb_id == cb_id) && (cur->tid == tid) \
-		    && (cur->lun == lun)) {
-			is_found = 1;
-			break;
-		}
-	}
+	cur = ht_lookup(&(nc->ht), tid, lun, cb_id);
 
-	if (is_found) {
+	/* the owner of an in-flight block publishes it */
+	if (cur && cur->is_valid != CACHE_PENDING) {
 		/* move cache block into unused list */
 		dprintf("numa cache: invalidate a cache block\n");
-		list_del(&(cur->list));
-		list_del(&(cur->hit_list));
+		unindex_cache_block(nc, cur);
+		nc->policy->remove(cur, nc);
 
+		/* CB_QUEUED stays until destager drops the stale index */
+		if (cur->flags & CB_DIRTY)
+			nc->nr_dirty --;
+		cur->flags &= ~(CB_DIRTY | CB_REF | CB_Q1);
 		cur->is_valid = CACHE_INVALID;
+		nc->stat.invalidations ++;
 
-		list_add_tail(&(cur->list), &(nc->unused_list.list));
+		free_cache_block(cur, nc);
 	}
 
 	return;
 }
 
-void sort_tablecell_list(struct cache_block *cb, struct cache_block *head)
+int sketch_init(struct numa_cache *nc)
 {
-	struct list_head *pos;
-	struct cache_block *pre;
+	uint32_t w = 64;
 
-	dprintf("numa cache: sort cache block: start for\n");
-	for (pos = &(cb->list); pos != &(head->list); pos = pos->prev) {
-		pre = list_entry(pos, struct cache_block, list);
-		if (pre->hit_count > cb->hit_count)
-			break;
+	while (w < (uint32_t) nc->nb * CACHE_SKETCH_WIDTH)
+		w <<= 1;
+
+	nc->sketch = (uint64_t *) \
+		cache_numa_alloc(CACHE_SKETCH_ROWS * w / 2, nc->on_numa_node);
+	if (nc->sketch == NULL)
+		return -1;
+
+	memset(nc->sketch, '\0', CACHE_SKETCH_ROWS * w / 2);
+	nc->sketch_mask = w - 1;
+	nc->sketch_ops = 0;
+	nc->sketch_age = 0;
+
+	return 0;
+}
+
+/* estimated number of misses of a block, each row takes its own slot
+ * by double hashing. record adds this miss first.
+ */
+static uint32_t sketch_count(struct numa_cache *nc, uint64_t key, int record)
+{
+	uint32_t h1 = (uint32_t) key, h2 = (uint32_t) (key >> 32) | 1;
+	uint32_t w = nc->sketch_mask + 1, freq = 15, i, c;
+	uint64_t *word;
+	int r, shift;
+
+	for (r = 0; r < CACHE_SKETCH_ROWS; r ++) {
+		i = r * w + ((h1 + r * h2) & nc->sketch_mask);
+		word = &(nc->sketch[i / 16]);
+		shift = (i % 16) * 4;
+		c = (*word >> shift) & 0xf;
+		if (record && c < 15) {
+			*word += 1ULL << shift;
+			c ++;
+		}
+		if (c < freq)
+			freq = c;
 	}
-	dprintf("numa cache: sort cache block: end for\n");
 
-	list_del(&(cb->list));
-	/* insert cb into pos's next */
-	cb->list.next = pos->next;
-	cb->list.prev = pos;
-	pos->next = &(cb->list);
-	cb->list.next->prev = &(cb->list);
+	/* halve a word of counters every few misses, all of them every
+	 * w misses, so that a block missed once fades out before the
+	 * rows fill up and admit a scan
+	 */
+	if (record && (++ nc->sketch_ops % (16 / CACHE_SKETCH_ROWS)) == 0) {
+		word = &(nc->sketch[nc->sketch_age]);
+		*word = (*word >> 1) & 0x7777777777777777ULL;
+		nc->sketch_age = (nc->sketch_age + 1) % \
+			(CACHE_SKETCH_ROWS * w / 16);
+	}
 
-	return;
+	return freq;
 }
 
-void sort_hit_list(struct cache_block *cb, struct cache_block *head)
+int admit_cache_block(struct numa_cache *nc, int tid, uint64_t lun, \
+		      uint64_t cb_id, int record)
 {
-	struct list_head *pos;
-	struct cache_block *pre;
+	uint32_t freq;
+
+	if (nc->sketch == NULL)
+		return 1;
 
-	dprintf("numa cache: sort hit list: start for\n");
-	for (pos = &(cb->hit_list); pos != &(head->hit_list); pos = pos->prev) {
-		pre = list_entry(pos, struct cache_block, hit_list);
-		if (pre->hit_count > cb->hit_count)
-			break;
+	freq = sketch_count(nc, ht_hash_key(tid, lun, cb_id), record);
+
+	if (freq >= CACHE_ADMIT_FREQ)
+		return 1;
+
+	/* nothing is replaced for it yet */
+	if (!list_empty(&(nc->unused_list)) && \
+	    (nc->data == NULL || nc->nr_data_free))
+		return 1;
+
+	/* replaced lately, 2q and arc remember it */
+	if (nc->ghost && ht_lookup(&(nc->ght), tid, lun, cb_id))
+		return 1;
+
+	return 0;
+}
+
+void bypass_cache_block(int tid, uint64_t lun, uint64_t cb_id, \
+			struct numa_cache *nc)
+{
+	struct cache_block *cur;
+
+	/* a block in flight is not published, see complete_cache_block() */
+	cur = ht_lookup(&(nc->ht), tid, lun, cb_id);
+	if (cur && cur->is_valid == CACHE_PENDING)
+		cur->flags |= CB_STALE;
+	else
+		invalidate_cache_block(tid, lun, cb_id, nc);
+}
+
+static inline uint64_t fp_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* MurmurHash3 x64 128-bit of a cache block, len is a multiple of 16 */
+void cache_fingerprint(const void *buf, size_t len, uint64_t *fp)
+{
+	const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+	const uint64_t *p = (const uint64_t *) buf;
+	uint64_t h1 = len, h2 = len, k1, k2;
+	size_t i;
+
+	for (i = 0; i < len / 16; i ++) {
+		k1 = p[2 * i];
+		k2 = p[2 * i + 1];
+
+		k1 *= c1;
+		k1 = fp_rotl(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = fp_rotl(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2;
+		k2 = fp_rotl(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = fp_rotl(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
 	}
-	dprintf("numa cache: sort hit list: end for\n");
 
-	list_del(&(cb->hit_list));
-	/* insert cb into pos's next */
-	cb->hit_list.next = pos->next;
-	cb->hit_list.prev = pos;
-	pos->next = &(cb->hit_list);
-	cb->hit_list.next->prev = &(cb->hit_list);
+	h1 += h2;
+	h2 += h1;
+	h1 = ht_mix64(h1);
+	h2 = ht_mix64(h2);
+	h1 += h2;
+	h2 += h1;
 
-	return;
+	fp[0] = h1;
+	fp[1] = h2;
 }
 
-void lru_hit_list(struct cache_block *cb, struct cache_block *head)
+int dedup_init(struct numa_cache *nc)
 {
-	list_del(&(cb->hit_list));
-	list_add(&(cb->hit_list), &(head->hit_list));
-	return;
+	uint32_t i, sz = 1;
+
+	nc->nr_data = nc->buffer_size / nc->cbs;
+	while (sz < nc->nr_data * 2)
+		sz <<= 1;
+	nc->fpt_mask = sz - 1;
+
+	nc->data = (struct cache_data *) \
+		cache_numa_alloc(nc->nr_data * sizeof(struct cache_data), \
+				 nc->on_numa_node);
+	nc->data_free = (uint32_t *) \
+		cache_numa_alloc(nc->nr_data * sizeof(uint32_t), \
+				 nc->on_numa_node);
+	nc->fpt = (uint32_t *) \
+		cache_numa_alloc(sz * sizeof(uint32_t), nc->on_numa_node);
+	if (nc->data == NULL || nc->data_free == NULL || nc->fpt == NULL)
+		return -1;
+
+	memset(nc->data, '\0', nc->nr_data * sizeof(struct cache_data));
+	memset(nc->fpt, '\0', sz * sizeof(uint32_t));
+
+	/* lowest slots are handed out first */
+	for (i = 0; i < nc->nr_data; i ++)
+		nc->data_free[i] = nc->nr_data - 1 - i;
+	nc->nr_data_free = nc->nr_data;
+
+	return 0;
 }
 
-void lru_tablecell_list(struct cache_block *cb, struct cache_block *head)
+static inline char *data_addr(struct numa_cache *nc, uint32_t d)
 {
-	list_del(&(cb->list));
-	list_add(&(cb->list), &(head->list));
-	return;
+	return nc->buffer + (uint64_t) d * nc->cbs;
+}
+
+/* a shared slot with the fingerprint and contents of slot d */
+static uint32_t fpt_lookup(struct numa_cache *nc, uint32_t d)
+{
+	struct cache_data *cd = &(nc->data[d]), *cur;
+	uint32_t i, s;
+
+	for (i = cd->fp[0] & nc->fpt_mask; nc->fpt[i]; \
+	     i = (i + 1) & nc->fpt_mask) {
+		s = nc->fpt[i] - 1;
+		cur = &(nc->data[s]);
+		if (cur->fp[0] != cd->fp[0] || cur->fp[1] != cd->fp[1])
+			continue;
+
+		/* the fingerprint of a block filled and then written is
+		 * stale, the contents decide
+		 */
+		if (memcmp(data_addr(nc, s), data_addr(nc, d), nc->cbs) == 0)
+			return s;
+	}
+
+	return CACHE_NO_DATA;
+}
+
+static void fpt_insert(struct numa_cache *nc, uint32_t d)
+{
+	uint32_t i;
+
+	for (i = nc->data[d].fp[0] & nc->fpt_mask; nc->fpt[i]; \
+	     i = (i + 1) & nc->fpt_mask)
+		;
+
+	nc->fpt[i] = d + 1;
+	nc->data[d].shared = 1;
+}
+
+/* backward shift deletion, as ht_delete() */
+static void fpt_delete(struct numa_cache *nc, uint32_t d)
+{
+	uint32_t i, j, home;
+
+	i = nc->data[d].fp[0] & nc->fpt_mask;
+	while (nc->fpt[i] != d + 1) {
+		if (nc->fpt[i] == 0)
+			return;
+		i = (i + 1) & nc->fpt_mask;
+	}
+
+	for (j = (i + 1) & nc->fpt_mask; nc->fpt[j]; j = (j + 1) & nc->fpt_mask) {
+		home = nc->data[nc->fpt[j] - 1].fp[0] & nc->fpt_mask;
+		if (((j - home) & nc->fpt_mask) < ((j - i) & nc->fpt_mask))
+			continue;
+
+		nc->fpt[i] = nc->fpt[j];
+		i = j;
+	}
+
+	nc->fpt[i] = 0;
+	nc->data[d].shared = 0;
 }
 
+void put_cache_data(struct numa_cache *nc, uint32_t d)
+{
+	if (-- nc->data[d].ref)
+		return;
+
+	if (nc->data[d].shared)
+		fpt_delete(nc, d);
+	nc->data_free[nc->nr_data_free ++] = d;
+}
+
+void drop_cache_data(struct cache_block *cb, struct numa_cache *nc)
+{
+	if (nc->data == NULL)
+		return;
+
+	put_cache_data(nc, cb->data);
+	cb->data = CACHE_NO_DATA;
+}
+
+void share_cache_block(struct cache_block *cb, struct numa_cache *nc)
+{
+	struct cache_data *cd = &(nc->data[cb->data]);
+	uint32_t s;
+
+	if (!cd->hashed || cd->shared)
+		return;
+
+	s = fpt_lookup(nc, cb->data);
+	if (s == CACHE_NO_DATA) {
+		fpt_insert(nc, cb->data);
+		return;
+	}
+
+	nc->data[s].ref ++;
+	put_cache_data(nc, cb->data);
+	cb->data = s;
+	nc->stat.dedup ++;
+}
+
+int own_cache_block(struct cache_block *cb, struct numa_cache *nc)
+{
+	uint32_t d;
+	int ret;
+
+	if (nc->data == NULL)
+		return 0;
+
+	/* only this block, it just leaves the table */
+	if (nc->data[cb->data].ref == 1) {
+		if (nc->data[cb->data].shared)
+			fpt_delete(nc, cb->data);
+		nc->data[cb->data].hashed = 0;
+		return 0;
+	}
+
+	/* not replaced itself while a slot is freed */
+	cb->pin ++;
+	ret = alloc_cache_data(nc, &d);
+	cb->pin --;
+	if (ret != 0)
+		return -1;
+
+	memcpy(data_addr(nc, d), cb_addr(cb, nc), nc->cbs);
+	put_cache_data(nc, cb->data);
+	cb->data = d;
+	nc->stat.cow ++;
+
+	return 1;
+}
@@ -56,6 +56,8 @@ int conn_init(struct iscsi_connection *conn)
 		return -ENOMEM;
 	}
 	conn->rsp_buffer_size = INCOMING_BUFSIZE;
+	conn->tx_iov = NULL;
+	conn->tx_iov_max = 0;
 
 	conn->refcount = 1;
 	conn->state = STATE_FREE;
@@ -75,6 +77,7 @@ void conn_exit(struct iscsi_connection *conn)
 	list_del(&conn->clist);
 	free(conn->req_buffer);
 	free(conn->rsp_buffer);
+	free(conn->tx_iov);
 	free(conn->initiator);
 	if (conn->initiator_alias)
 		free(conn->initiator_alias);
@@ -37,9 +37,11 @@
 #include "tgtd.h"
 #include "util.h"
 
-#ifdef NUMA_CACHE
+#include "cache_tgt.h"
+
 extern struct tcp_data_buf_head tcp_buf_list;
-#endif
+extern int tcp_pool_size;
+extern struct host_cache hc;
 static void iscsi_tcp_event_handler(int fd, int events, void *data);
 
 static int listen_fds[8];
@@ -274,22 +276,22 @@ int iscsi_tcp_init_portal(char *addr, int port, int tpgt)
 	return !nr_sock;
 }
 
-#ifdef NUMA_CACHE
 int iscsi_add_tcp_buf(struct tcp_data_buf_head *td, int pool_size, int block_size)
 {
-	int ret;
+	int ret = 0;
 	int i, j;
 	int nr_numa_nodes;
 	struct tcp_data_buf *cur;
 
-	nr_numa_nodes = numa_num_configured_nodes();
+	nr_numa_nodes = cache_nr_nodes();
+
+	struct cache_fault f[nr_numa_nodes];
 
 	struct bitmask *nodemask;
-	nodemask = numa_get_run_node_mask();
+	nodemask = cache_save_run_mask();
 
 	/* init td */
 	pthread_mutex_init(&td->mutex, NULL);
-	pthread_cond_init(&td->cond, NULL);
 
 	INIT_LIST_HEAD(&(td->head.list));
 
@@ -297,6 +299,7 @@ int iscsi_add_tcp_buf(struct tcp_data_buf_head *td, int pool_size, int block_siz
 	td->t = malloc(pool_size / block_size * sizeof(struct tcp_data_buf));
 	if (td->t == NULL) {
 		eprintf("numa cache: malloc failed.\n");
+		cache_restore_run_mask(nodemask);
 		return -1;
 	}
 
@@ -304,22 +307,27 @@ int iscsi_add_tcp_buf(struct tcp_data_buf_head *td, int pool_size, int block_siz
 	       pool_size / block_size * sizeof(struct tcp_data_buf));
 
 	for (i = 0; i < nr_numa_nodes; i ++) {
-		ret = numa_run_on_node(i);
+		ret = cache_run_on_node(i);
 		if (ret == -1) {
 			eprintf("numa cache: numa_run_on_node(%d) failed.\n", i);
-			return -1;
+			goto out;
 		}
 
 		dprintf("numa cache: alloc %d bytes in node %d\n", \
 			pool_size, i);
-		td->addr[i] = (char *) numa_alloc_onnode(pool_size, i);
+		td->addr[i] = (char *) cache_alloc_onnode(pool_size, i, \
+							  hc.page, &(td->len[i]));
 		if (td->addr[i] == NULL) {
 			eprintf("numa cache: numa_alloc_onnode(%d, %d) failed.\n", \
 				pool_size, i);
-			return -1;
+			ret = -1;
+			goto out;
 		}
 
-		memset(td->addr[i], '\0', pool_size);
+		f[i].addr = td->addr[i];
+		f[i].len = td->len[i];
+		f[i].node = i;
+		f[i].keep = 0;
 
 		for (j = 0; j < pool_size / block_size; j ++) {
 			cur = td->t + j;
@@ -327,6 +335,12 @@ int iscsi_add_tcp_buf(struct tcp_data_buf_head *td, int pool_size, int block_siz
 		}
 	}
 
+	cache_fault_in(f, nr_numa_nodes);
+
+	/* backing stores may pin the pools for their I/O */
+	for (i = 0; i < nr_numa_nodes; i ++)
+		bs_add_fixed_buffer(td->addr[i], td->len[i]);
+
 	/* add all blocks into tcp list */
 	for (i = 0; i < pool_size / block_size; i ++) {
 		cur = td->t + i;
@@ -335,19 +349,43 @@ int iscsi_add_tcp_buf(struct tcp_data_buf_head *td, int pool_size, int block_siz
 		INIT_LIST_HEAD(&(cur->list));
 		list_add_tail(&(cur->list), &(td->head.list));
 
-		dprintf("numa cache: tcp_buf[%d], sz %d, addr %" PRIx64 "\n", i, cur->sz, cur->addr[0]);
+		dprintf("numa cache: tcp_buf[%d], sz %d, addr %p\n", i, cur->sz, cur->addr[0]);
 	}
 
-	numa_run_on_node_mask(nodemask);
+out:
+	cache_restore_run_mask(nodemask);
 
-	return 0;
+	return ret;
 }
 
-int iscsi_delete_tcp_buf(struct tcp_data_buf_head *tdbuf, int pool_size, int block_size)
+/* a pool buffer, NULL if there is no pool or all are in use */
+struct tcp_data_buf *iscsi_get_tcp_buf(struct tcp_data_buf_head *td)
 {
-	return 0;
+	struct tcp_data_buf *b = NULL;
+
+	if (td->t == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&td->mutex);
+	if (!list_empty(&(td->head.list))) {
+		b = list_first_entry(&(td->head.list), struct tcp_data_buf, \
+				     list);
+		list_del(&b->list);
+	}
+	pthread_mutex_unlock(&td->mutex);
+
+	return b;
+}
+
+void iscsi_put_tcp_buf(struct tcp_data_buf_head *td, struct tcp_data_buf *b)
+{
+	dprintf("numa cache: free tcp buf - sz %d addr %p\n", \
+		b->sz, b->addr[0]);
+
+	pthread_mutex_lock(&td->mutex);
+	list_add_tail(&(b->list), &(td->head.list));
+	pthread_mutex_unlock(&td->mutex);
 }
-#endif
 
 int iscsi_add_portal(char *addr, int port, int tpgt)
 {
@@ -393,6 +431,13 @@ static int iscsi_tcp_init(void)
 		iscsi_add_portal(NULL, 3260, 1);
 	}
 
+	/* per node data buffers only pay off for cached lus, without
+	 * them data is allocated per task
+	 */
+	if (hc.nc && iscsi_add_tcp_buf(&tcp_buf_list, tcp_pool_size, \
+				       TCP_TRANSFER_SIZE))
+		eprintf("numa cache: no tcp buffer pool\n");
+
 	return 0;
 }
 
@@ -428,6 +473,16 @@ static size_t iscsi_tcp_write_begin(struct iscsi_connection *conn, void *buf,
 	return write(tcp_conn->fd, buf, nbytes);
 }
 
+static size_t iscsi_tcp_writev_begin(struct iscsi_connection *conn,
+				     struct iovec *iov, int iovcnt)
+{
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	int opt = 1;
+
+	setsockopt(tcp_conn->fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
+	return writev(tcp_conn->fd, iov, iovcnt);
+}
+
 static void iscsi_tcp_write_end(struct iscsi_connection *conn)
 {
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
@@ -508,53 +563,13 @@ static void iscsi_tcp_free_task(struct iscsi_task *task)
 
 static void *iscsi_tcp_alloc_data_buf(struct iscsi_connection *conn, size_t sz)
 {
-#ifndef NUMA_CACHE
 	return valloc(sz);
-#else
-	struct tcp_data_buf_head *t = &tcp_buf_list;
-	struct tcp_data_buf *b;
-
-	pthread_mutex_lock(&t->mutex);
-
-	while (list_empty(&(t->head.list))) {
-		pthread_cond_wait(&(t->cond), &(t->mutex));
-	}
-
-	b = list_first_entry(&t->head.list, struct tcp_data_buf, list);
-	list_del(&b->list);
-
-	pthread_mutex_unlock(&t->mutex);
-
-	return (void *) b;
-#endif
 }
 
 static void iscsi_tcp_free_data_buf(struct iscsi_connection *conn, void *buf)
 {
-#ifndef NUMA_CACHE
 	if (buf)
 		free(buf);
-#else
-	if (buf == NULL)
-		return;
-
-	struct tcp_data_buf *tdbuf = (struct tcp_data_buf *) buf;
-
-	struct tcp_data_buf_head *t = &tcp_buf_list;
-
-	dprintf("numa cache: free tcp buf - sz %d addr %" PRIx64 "\n", \
-		tdbuf->sz, tdbuf->addr[0]);
-
-	pthread_mutex_lock(&t->mutex);
-
-	list_add_tail(&(tdbuf->list), &(t->head.list));
-
-	pthread_mutex_unlock(&t->mutex);
-
-	pthread_cond_signal(&t->cond);
-
-	return;
-#endif
 }
 
 static int iscsi_tcp_getsockname(struct iscsi_connection *conn,
@@ -591,6 +606,7 @@ static struct iscsi_transport iscsi_tcp = {
 	.ep_read		= iscsi_tcp_read,
 	.ep_write_begin		= iscsi_tcp_write_begin,
 	.ep_write_end		= iscsi_tcp_write_end,
+	.ep_writev_begin	= iscsi_tcp_writev_begin,
 	.ep_close		= iscsi_tcp_close,
 	.ep_force_close		= iscsi_tcp_conn_force_close,
 	.ep_release		= iscsi_tcp_release,
@@ -44,9 +44,11 @@
 
 #define MAX_QUEUE_CMD	128
 
-#ifdef NUMA_CACHE
+#include "cache_tgt.h"
+
 struct tcp_data_buf_head tcp_buf_list;
-#endif
+int tcp_pool_size = TCP_BUF_SZ_MB * 1024 * 1024;
+extern struct host_cache hc;
 
 LIST_HEAD(iscsi_portals_list);
 
@@ -1146,6 +1148,11 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 	hton24(rsp->dlength, datalen);
 	conn->rsp.data = scsi_get_in_buffer(&task->scmd);
 	conn->rsp.data += task->offset;
+	if (task->scmd.nr_zc && conn->tp->ep_writev_begin) {
+		conn->rsp.zc = task->scmd.zc;
+		conn->rsp.nr_zc = task->scmd.nr_zc;
+		conn->rsp.zc_offset = task->offset;
+	}
 
 	task->offset += datalen;
 
@@ -1182,37 +1189,36 @@ static struct iscsi_task *iscsi_alloc_task(struct iscsi_connection *conn,
 {
 	struct iscsi_hdr *req = (struct iscsi_hdr *) &conn->req.bhs;
 	struct iscsi_task *task;
-#ifndef NUMA_CACHE
 	void *buf;
-#endif
 
 	task = conn->tp->alloc_task(conn, ext_len);
 	if (!task)
 		return NULL;
 
-	if (data_len) {
-#ifndef NUMA_CACHE
+	/* data that fits a pool buffer can be moved to the node split_io
+	 * picks, the rest is allocated as it comes
+	 */
+	if (data_len && data_len <= TCP_TRANSFER_SIZE)
+		task->tdbuf = iscsi_get_tcp_buf(&tcp_buf_list);
+
+	if (task->tdbuf) {
+		dprintf("numa cache: get tcp_buf, sz %d, addr %p\n", \
+			task->tdbuf->sz, task->tdbuf->addr[0]);
+		task->tdbuf->cur_node = 0;
+		task->tdbuf->cur_addr = task->tdbuf->addr[0];
+		task->data = task->tdbuf->addr[0];
+	} else if (data_len) {
 		buf = conn->tp->alloc_data_buf(conn, data_len);
 		if (!buf) {
 			conn->tp->free_task(task);
 			return NULL;
 		}
 		task->data = buf;
-#else
-		task->tdbuf = (struct tcp_data_buf *) \
-			conn->tp->alloc_data_buf(conn, data_len);
-		dprintf("numa cache: get tcp_buf, sz %d, addr %" PRIx64 "\n", \
-			task->tdbuf->sz, task->tdbuf->addr[0]);
-		task->data = task->tdbuf->addr[0];
-		dprintf("numa cache: valloc %d bytes\n", data_len);
-#endif
 	}
 
-#ifdef NUMA_CACHE
 	task->scmd.rdma = 0;
 	dprintf("numa cache: this scmd is for iscsi\n");
 	task->scmd.netbuf = task->tdbuf;
-#endif
 
 	memcpy(&task->req, req, sizeof(*req));
 	task->conn = conn;
@@ -1228,12 +1234,15 @@ void iscsi_free_task(struct iscsi_task *task)
 	struct iscsi_connection *conn = task->conn;
 
 	list_del(&task->c_siblings);
-#ifndef NUMA_CACHE
-	conn->tp->free_data_buf(conn, scsi_get_in_buffer(&task->scmd));
-	conn->tp->free_data_buf(conn, scsi_get_out_buffer(&task->scmd));
-#else
-	conn->tp->free_data_buf(conn, task->tdbuf);
-#endif
+	if (task->tdbuf)
+		iscsi_put_tcp_buf(&tcp_buf_list, task->tdbuf);
+	else
+		conn->tp->free_data_buf(conn, task->data);
+	/* read data of a bidi command is allocated apart */
+	if (scsi_get_data_dir(&task->scmd) == DATA_BIDIRECTIONAL)
+		conn->tp->free_data_buf(conn, \
+					scsi_get_in_buffer(&task->scmd));
+	cache_unpin_cmd(&hc, &task->scmd);
 
 	conn->tp->free_task(task);
 	
@@ -1659,6 +1668,18 @@ static int iscsi_scsi_cmd_rx_start(struct iscsi_connection *conn)
 
 	task->tag = req->itt;
 
+	/* receive data on the node split_io chose last time */
+	if (task->tdbuf) {
+		int nodeid = cache_cmd_node(&hc, conn->session->target->tid, \
+					    req->lun, req->cdb, \
+					    ntohl(req->data_length));
+		if (nodeid >= 0) {
+			task->tdbuf->cur_node = nodeid;
+			task->tdbuf->cur_addr = task->tdbuf->addr[nodeid];
+			task->data = task->tdbuf->cur_addr;
+		}
+	}
+
 	if (ahs_len) {
 		task->ahs = (uint8_t *) task->extdata + sizeof(req->cdb);
 		conn->req.ahs = task->ahs;
@@ -2185,6 +2206,106 @@ again:
 	return 0;
 }
 
+static char zc_pad[PAD_WORD_LEN];
+
+/* iovec of rsp.datasize bytes at zc_offset of the pieces, then pad */
+static int zc_build_iov(struct iscsi_connection *conn, int pad)
+{
+	struct iscsi_pdu *rsp = &conn->rsp;
+	struct iovec *iov;
+	uint32_t pos = 0, skip, len, left = rsp->datasize;
+	int i, n = 0;
+
+	if (conn->tx_iov_max < rsp->nr_zc + 1) {
+		iov = realloc(conn->tx_iov, (rsp->nr_zc + 1) * sizeof(*iov));
+		if (!iov)
+			return -ENOMEM;
+		conn->tx_iov = iov;
+		conn->tx_iov_max = rsp->nr_zc + 1;
+	}
+
+	for (i = 0; i < rsp->nr_zc && left; i++) {
+		len = rsp->zc[i].length;
+		if (pos + len <= rsp->zc_offset) {
+			pos += len;
+			continue;
+		}
+
+		skip = rsp->zc_offset > pos ? rsp->zc_offset - pos : 0;
+		len = min_t(uint32_t, len - skip, left);
+		conn->tx_iov[n].iov_base = rsp->zc[i].addr + skip;
+		conn->tx_iov[n].iov_len = len;
+		left -= len;
+		pos += rsp->zc[i].length;
+		n++;
+	}
+
+	if (pad) {
+		conn->tx_iov[n].iov_base = zc_pad;
+		conn->tx_iov[n].iov_len = pad;
+		n++;
+	}
+
+	conn->tx_iov_first = 0;
+	conn->tx_iovcnt = n;
+
+	return 0;
+}
+
+static uint32_t zc_crc32c(struct iscsi_connection *conn, uint32_t crc)
+{
+	int i, pad;
+
+	pad = roundup(conn->rsp.datasize, conn->tp->data_padding) -
+		conn->rsp.datasize;
+	zc_build_iov(conn, pad);
+	for (i = 0; i < conn->tx_iovcnt; i++)
+		crc = crc32c(crc, conn->tx_iov[i].iov_base,
+			     conn->tx_iov[i].iov_len);
+
+	return crc;
+}
+
+static int do_sendv(struct iscsi_connection *conn, int next_state)
+{
+	struct iovec *iov;
+	int ret, cnt;
+again:
+	iov = conn->tx_iov + conn->tx_iov_first;
+	cnt = min_t(int, conn->tx_iovcnt, IOV_MAX);
+	ret = conn->tp->ep_writev_begin(conn, iov, cnt);
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto again;
+		/* the socket is full, go on at EPOLLOUT */
+		if (errno == EAGAIN)
+			return 0;
+
+		conn->state = STATE_CLOSE;
+		return -EIO;
+	}
+
+	conn->tx_size -= ret;
+	iscsi_update_conn_stats_tx(conn, ret, -1);
+
+	while (conn->tx_iovcnt && ret >= iov->iov_len) {
+		ret -= iov->iov_len;
+		iov++;
+		conn->tx_iov_first++;
+		conn->tx_iovcnt--;
+	}
+	if (ret) {
+		iov->iov_base += ret;
+		iov->iov_len -= ret;
+	}
+
+	if (conn->tx_size)
+		goto again;
+	conn->tx_iostate = next_state;
+
+	return 0;
+}
+
 int iscsi_tx_handler(struct iscsi_connection *conn)
 {
 	int ret = 0, hdigest, ddigest;
@@ -2271,25 +2392,41 @@ again:
 			pad = conn->tx_size & (conn->tp->data_padding - 1);
 			if (pad) {
 				pad = PAD_WORD_LEN - pad;
-				memset(conn->tx_buffer + conn->tx_size, 0, pad);
+				if (!conn->rsp.zc)
+					memset(conn->tx_buffer + conn->tx_size,
+					       0, pad);
 				conn->tx_size += pad;
 			}
+			if (conn->rsp.zc && zc_build_iov(conn, pad)) {
+				conn->state = STATE_CLOSE;
+				ret = -ENOMEM;
+				goto out;
+			}
 		} else
 			conn->tx_iostate = IOSTATE_TX_END;
 		if (conn->tx_iostate != IOSTATE_TX_DATA)
 			break;
 	case IOSTATE_TX_DATA:
-		ret = do_send(conn, ddigest ?
-			      IOSTATE_TX_INIT_DDIGEST : IOSTATE_TX_END);
+		if (conn->rsp.zc) {
+			ret = do_sendv(conn, ddigest ?
+				       IOSTATE_TX_INIT_DDIGEST : IOSTATE_TX_END);
+		} else {
+			ret = do_send(conn, ddigest ?
+				      IOSTATE_TX_INIT_DDIGEST : IOSTATE_TX_END);
+		}
 		if (ret < 0)
 			goto out;
 		if (conn->tx_iostate != IOSTATE_TX_INIT_DDIGEST)
 			break;
 	case IOSTATE_TX_INIT_DDIGEST:
 		crc = ~0;
-		crc = crc32c(crc, conn->rsp.data,
-			     roundup(conn->rsp.datasize,
-				     conn->tp->data_padding));
+		if (conn->rsp.zc) {
+			crc = zc_crc32c(conn, crc);
+		} else {
+			crc = crc32c(crc, conn->rsp.data,
+				     roundup(conn->rsp.datasize,
+					     conn->tp->data_padding));
+		}
 		*(uint32_t *)conn->tx_digest = ~crc;
 		conn->tx_iostate = IOSTATE_TX_DDIGEST;
 		conn->tx_buffer = conn->tx_digest;
@@ -2390,10 +2527,6 @@ int iscsi_transportid(int tid, uint64_t itn_id, char *buf, int size)
 int iscsi_param_parse_portals(char *p, int do_add,
 			int do_delete)
 {
-#ifdef NUMA_CACHE
-	int pool_size;
-	pool_size = TCP_BUF_SZ_MB * 1024 *1024;
-#endif
 	while (*p) {
 		if (!strncmp(p, "portal", 6)) {
 			dprintf("numa cache: parse portal - %s\n", p);
@@ -2446,7 +2579,6 @@ int iscsi_param_parse_portals(char *p, int do_add,
 					return -1;
 				}
 			}
-#ifdef NUMA_CACHE
 		} else if (!strncmp(p, "pool_sz_mb", 10)) {
 			dprintf("numa cache: parse pool_sz_mb - %s\n", p);
 			/* allocate and de-allocate memory blocks */
@@ -2462,9 +2594,8 @@ int iscsi_param_parse_portals(char *p, int do_add,
 				i++;
 			}
 
-			pool_size = atoi(buf) * 1024 * 1024;
-			dprintf("numa cache: pool_size is %d\n", pool_size);
-#endif
+			tcp_pool_size = atoi(buf) * 1024 * 1024;
+			dprintf("numa cache: pool_size is %d\n", tcp_pool_size);
 		}
 
 		p += strcspn(p, ",");
@@ -2472,15 +2603,6 @@ int iscsi_param_parse_portals(char *p, int do_add,
 			++p;
 	}
 
-#ifdef NUMA_CACHE
-	/* how to add tcp buf per portal? */
-	if (do_add) {
-		iscsi_add_tcp_buf(&tcp_buf_list, pool_size, TCP_TRANSFER_SIZE);
-	}
-	if (do_delete) {
-		iscsi_delete_tcp_buf(&tcp_buf_list, pool_size, TCP_TRANSFER_SIZE);
-	}
-#endif
 	return 0;
 }
 
@@ -22,18 +22,13 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <netdb.h>
-#ifdef NUMA_CACHE
-#include <numa.h>
-#endif
 #include "transport.h"
 #include "list.h"
 #include "param.h"
 #include "log.h"
 #include "tgtd.h"
 #include "util.h"
-#ifdef NUMA_CACHE
 #include "bs_thread.h"
-#endif
 #include "iscsi_proto.h"
 #include "iscsi_if.h"
 
@@ -60,7 +55,6 @@
 
 #define sid_to_tsih(sid) ((sid) >> 48)
 
-#ifdef NUMA_CACHE
 /* for NUMA-cache TCP driver */
 #define TCP_TRANSFER_SIZE  (512 * 1024)
 #define TCP_BUF_SZ_MB  128
@@ -68,11 +62,10 @@
 struct tcp_data_buf_head {
 	struct tcp_data_buf *t;		/* control messages */
 	char *addr[MAX_NR_NUMA_NODES];	/* data blocks */
+	size_t len[MAX_NR_NUMA_NODES];	/* mapped length of addr */
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
 	struct tcp_data_buf head;
 };
-#endif
 
 struct iscsi_pdu {
 	struct iscsi_hdr bhs;
@@ -80,6 +73,10 @@ struct iscsi_pdu {
 	unsigned int ahssize;
 	void *data;
 	unsigned int datasize;
+	/* data-in taken from the pieces of a read, see struct scsi_zc */
+	struct scsi_zc *zc;
+	int nr_zc;
+	uint32_t zc_offset;
 };
 
 struct iscsi_session {
@@ -149,9 +146,7 @@ struct iscsi_task {
 
 	struct scsi_cmd scmd;
 
-#ifdef NUMA_CACHE
 	struct tcp_data_buf *tdbuf;
-#endif
 	unsigned long extdata[0];
 };
 
@@ -195,6 +190,11 @@ struct iscsi_connection {
 	unsigned char *tx_buffer;
 	int rx_size;
 	int tx_size;
+	/* rsp.zc left to send, tx_size counts it */
+	struct iovec *tx_iov;
+	int tx_iov_max;
+	int tx_iov_first;
+	int tx_iovcnt;
 
 	uint32_t ttt;
 	int text_datasize;
@@ -342,10 +342,10 @@ extern void iscsi_update_conn_stats_rx(struct iscsi_connection *conn, int size,
 extern void iscsi_update_conn_stats_tx(struct iscsi_connection *conn, int size, int opcode);
 extern void iscsi_rsp_set_residual(struct iscsi_cmd_rsp *rsp, struct scsi_cmd *scmd);
 
-#ifdef NUMA_CACHE
 extern int iscsi_add_tcp_buf(struct tcp_data_buf_head *td, int pool_size, int block_size);
-int iscsi_delete_tcp_buf(struct tcp_data_buf_head *tdbuf, int pool_size, int block_size);
-#endif
+extern struct tcp_data_buf *iscsi_get_tcp_buf(struct tcp_data_buf_head *td);
+extern void iscsi_put_tcp_buf(struct tcp_data_buf_head *td,
+			      struct tcp_data_buf *b);
 
 
 /* iscsid.c iscsi_task */
@@ -42,9 +42,7 @@
 #include "driver.h"
 #include "scsi.h"
 #include "work.h"
-#ifdef NUMA_CACHE
-#include "cache.h"
-#endif
+#include "cache_tgt.h"
 
 #if defined(HAVE_VALGRIND) && !defined(NDEBUG)
 #include <valgrind/memcheck.h>
@@ -52,9 +50,7 @@
 #define VALGRIND_MAKE_MEM_DEFINED(addr, len)
 #endif
 
-#ifdef NUMA_CACHE
 extern struct host_cache hc;
-#endif
 
 static struct iscsi_transport iscsi_iser;
 
@@ -277,7 +273,6 @@ static void iser_rdmad_init(struct iser_work_req *rdmad,
 	INIT_LIST_HEAD(&rdmad->wr_list);
 }
 
-#ifdef NUMA_CACHE
 static void iser_rdmad_init_numa(struct iser_work_req *rdmad,
 				 struct iser_task *task,
 				 struct ibv_mr *srmr,
@@ -285,7 +280,6 @@ static void iser_rdmad_init_numa(struct iser_work_req *rdmad,
 {
 	rdmad->numa_sge[numa_node].lkey = srmr->lkey;
 }
-#endif
 
 static void iser_task_init(struct iser_task *task,
 			   struct iser_conn *conn,
@@ -302,11 +296,9 @@ static void iser_task_init(struct iser_task *task,
 	iser_rxd_init(&task->rxd, task, pdu_buf, buf_size, srmr);
 	iser_txd_init(&task->txd, task, pdu_buf, buf_size, srmr);
 	iser_rdmad_init(&task->rdmad, task, conn->dev->membuf_mr);
-#ifdef NUMA_CACHE
 	for (i = 0; i < hc.nr_numa_nodes; i ++) {
 		iser_rdmad_init_numa(&task->rdmad, task, conn->dev->numa_membuf_mr[i], i);
 	}
-#endif
 
 	INIT_LIST_HEAD(&task->in_buf_list);
 	INIT_LIST_HEAD(&task->out_buf_list);
@@ -439,7 +431,6 @@ static void iser_prep_rdma_wr_send_req(struct iser_task *task,
 	rdma_buf = list_first_entry(&task->in_buf_list, struct iser_membuf, task_list);
 	rdmad->sge.addr = uint64_from_ptr(rdma_buf->addr);
 
-#ifdef NUMA_CACHE
 	if (task->is_read || task->is_write) {
 		dprintf("numa cache: change addr to numa node %d\n", \
 			rdma_buf->cur_node);
@@ -447,7 +438,6 @@ static void iser_prep_rdma_wr_send_req(struct iser_task *task,
 		/* update lkey for numa-aware */
 		rdmad->sge.lkey = rdmad->numa_sge[rdma_buf->cur_node].lkey;
 	}
-#endif
 
 	if (likely(task->rdma_wr_remains <= rdma_buf->size)) {
 		rdmad->sge.length = task->rdma_wr_remains;
@@ -500,22 +490,26 @@ static void iser_prep_rdma_rd_send_req(struct iser_task *task,
 
 	rdmad->sge.length = cur_req_sz;
 
-#ifdef NUMA_CACHE
 	/* reset addr */
 	/* At this moment, there is no information about the content
 	 * of this task. Data is still on the initiator
-	 * side. Therefore, we randomly choose a NUMA node to handle
-	 * this I/O request in the future.
+	 * side. Therefore, we choose the NUMA node split_io gave the
+	 * same request last time, or a random one.
 	 */
 	if (task->is_read || task->is_write) {
-		rdma_buf->cur_node = rand_r(&(hc.seed)) % hc.nr_numa_nodes;
+		struct iscsi_cmd *req_bhs = (struct iscsi_cmd *) task->pdu.bhs;
+
+		rdma_buf->cur_node = cache_cmd_node(&hc, \
+			task->conn->h.session->target->tid, req_bhs->lun, \
+			req_bhs->cdb, be32_to_cpu(req_bhs->data_length));
+		if (rdma_buf->cur_node < 0)
+			rdma_buf->cur_node = rand_r(&(hc.seed)) % hc.nr_numa_nodes;
 		dprintf("numa cache: WRITE change addr to numa node %d\n", \
 			rdma_buf->cur_node);
 		rdmad->sge.addr = uint64_from_ptr(rdma_buf->numa_addr[rdma_buf->cur_node]);
 		/* update lkey for numa-aware cache */
 		rdmad->sge.lkey = rdmad->numa_sge[rdma_buf->cur_node].lkey;
 	}
-#endif
 
 	rdmad->send_wr.next = (next_wr ? &next_wr->send_wr : NULL);
 	rdmad->send_wr.opcode = IBV_WR_RDMA_READ;
@@ -705,14 +699,15 @@ static int iser_init_rdma_buf_pool(struct iser_device *dev)
 	dev->membuf_listbuf = list_buf;
 	INIT_LIST_HEAD(&dev->membuf_free);
 	INIT_LIST_HEAD(&dev->membuf_alloc);
+	bs_add_fixed_buffer(pool_buf, pool_size);
 
-#ifdef NUMA_CACHE
 	struct bitmask *nodemask;
-	nodemask = numa_get_run_node_mask();
+	size_t len;
+	nodemask = cache_save_run_mask();
 	/* each numa node alloc pool_size memory */
 	for (i = 0; i < hc.nr_numa_nodes; i ++) {
 		/* set up run on node */
-		ret = numa_run_on_node(i);
+		ret = cache_run_on_node(i);
 		if (ret == -1) {
 			eprintf("numa cache: numa_run_on_node(%d) failed.\n", \
 				i);
@@ -720,7 +715,8 @@ static int iser_init_rdma_buf_pool(struct iser_device *dev)
 		}
 
 		/* alloc memory */
-		dev->numa_membuf_regbuf[i] = (char *) numa_alloc_onnode(pool_size, i);
+		dev->numa_membuf_regbuf[i] = (char *) \
+			cache_alloc_onnode(pool_size, i, hc.page, &len);
 		if (dev->numa_membuf_regbuf[i] == NULL) {
 			eprintf("numa_alloc_onnode numa_cache buffer failed\n");
 			return -1;
@@ -735,7 +731,7 @@ static int iser_init_rdma_buf_pool(struct iser_device *dev)
 						    IBV_ACCESS_LOCAL_WRITE);
 		if (!dev->numa_membuf_mr[i]) {
 			eprintf("ibv_reg_mr numa memory failed, %m\n");
-			numa_free(dev->numa_membuf_regbuf[i], pool_size);
+			cache_free_onnode(dev->numa_membuf_regbuf[i], len);
 			return -1;
 		}
 
@@ -744,10 +740,10 @@ static int iser_init_rdma_buf_pool(struct iser_device *dev)
 			dev->numa_membuf_mr[i],
 			dev->numa_membuf_mr[i]->lkey);
 
+		bs_add_fixed_buffer(dev->numa_membuf_regbuf[i], pool_size);
 	}
 
-	numa_run_on_node_mask(nodemask);
-#endif
+	cache_restore_run_mask(nodemask);
 
 	for (i = 0; i < membuf_num; i++) {
 		rdma_buf = (void *) list_buf;
@@ -756,11 +752,9 @@ static int iser_init_rdma_buf_pool(struct iser_device *dev)
 		list_add_tail(&rdma_buf->pool_list, &dev->membuf_free);
 		INIT_LIST_HEAD(&rdma_buf->task_list);
 
-#ifdef NUMA_CACHE
 		for (j = 0; j < hc.nr_numa_nodes; j ++) {
 			rdma_buf->numa_addr[j] = dev->numa_membuf_regbuf[j] + membuf_size * i;
 		}
-#endif
 
 		rdma_buf->addr = pool_buf;
 		rdma_buf->size = membuf_size;
@@ -782,6 +776,7 @@ static void iser_destroy_rdma_buf_pool(struct iser_device *dev)
 	if (err)
 		eprintf("ibv_dereg_mr failed: (errno=%d %m)\n", errno);
 
+	bs_del_fixed_buffer(dev->membuf_regbuf);
 	iser_free_pool(dev->membuf_regbuf, dev->rdma_hugetbl_shmid);
 	free(dev->membuf_listbuf);
 
@@ -2145,10 +2140,8 @@ static void iser_scsi_cmd_iosubmit(struct iser_task *task, int not_last)
 	scmd->mreq = NULL;
 	scmd->sense_len = 0;
 
-#ifdef NUMA_CACHE
 	scmd->netbuf = data_buf;
 	scmd->rdma = 1;
-#endif
 	dprintf("task:%p tag:0x%04"PRIx64 "\n", task, task->tag);
 
 	set_task_in_scsi(task);
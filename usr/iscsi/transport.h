@@ -2,6 +2,7 @@
 #define __TRANSPORT_H
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include "list.h"
 
 struct iscsi_connection;
@@ -25,6 +26,8 @@ struct iscsi_transport {
 	size_t (*ep_write_begin)(struct iscsi_connection *conn, void *buf,
 				 size_t nbytes);
 	void (*ep_write_end)(struct iscsi_connection *conn);
+	size_t (*ep_writev_begin)(struct iscsi_connection *conn,
+				  struct iovec *iov, int iovcnt);
 	int (*ep_rdma_read)(struct iscsi_connection *conn);
 	int (*ep_rdma_write)(struct iscsi_connection *conn);
 	size_t (*ep_close)(struct iscsi_connection *conn);
@@ -0,0 +1,178 @@
+/* libtgtcache - the NUMA-aware cache of tgtd for other software */
+
+#include <errno.h>
+#include <stdarg.h>
+
+#include "libtgtcache.h"
+#include "util.h"
+
+/* log.c belongs to the daemon, messages of the cache go to stderr */
+int is_debug;
+
+static void tgtcache_log(const char *fmt, va_list ap)
+{
+	fprintf(stderr, "tgtcache: ");
+	vfprintf(stderr, fmt, ap);
+}
+
+void log_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	tgtcache_log(fmt, ap);
+	va_end(ap);
+}
+
+void log_warning(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	tgtcache_log(fmt, ap);
+	va_end(ap);
+}
+
+void log_debug(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	tgtcache_log(fmt, ap);
+	va_end(ap);
+}
+
+int tgtcache_init(struct host_cache *hc, struct cache_param *cp)
+{
+	return init_cache(hc, cp);
+}
+
+void tgtcache_exit(struct host_cache *hc)
+{
+	stop_cache_flusher(hc);
+	save_cache(hc);
+}
+
+struct cache_lu *tgtcache_open(struct host_cache *hc, int tid, uint64_t lun, \
+			       int fd, uint64_t size)
+{
+	return cache_lu_add(hc, tid, lun, fd, size);
+}
+
+void tgtcache_close(struct host_cache *hc, struct cache_lu *clu)
+{
+	cache_lu_del(hc, clu->tid, clu->lun);
+}
+
+/* copy the part of block cb_id in [offset, offset + len) out of it */
+static void copy_block(struct host_cache *hc, struct cache_block *cb, \
+		       struct numa_cache *nc, uint64_t cb_id, char *buf, \
+		       size_t len, uint64_t offset)
+{
+	uint64_t base = cb_id * hc->cbs, from, to;
+
+	from = max(offset, base);
+	to = min(offset + len, base + hc->cbs);
+	memcpy(buf + (from - offset), cb_addr(cb, nc) + (from - base), \
+	       to - from);
+}
+
+ssize_t tgtcache_pread(struct host_cache *hc, struct cache_lu *clu, \
+		       void *buf, size_t len, uint64_t offset)
+{
+	struct cache_block *run[CACHE_MAX_RUN];
+	struct numa_cache *rnc[CACHE_MAX_RUN];
+	struct cache_block *cb;
+	struct numa_cache *nc;
+	struct cache_key key;
+	uint64_t cb_id, last;
+	int i, nr;
+
+	if (offset >= clu->size || len == 0)
+		return 0;
+	if (len > clu->size - offset)
+		len = clu->size - offset;
+
+	last = (offset + len - 1) / hc->cbs;
+	for (cb_id = offset / hc->cbs; cb_id <= last; ) {
+		nc = &(hc->nc[offset2ncid(cb_id * hc->cbs, hc)]);
+		nc_lock(nc);
+
+		cb = get_cache_block(clu->tid, clu->lun, cb_id, nc);
+		if (cb == NULL || cb->is_valid == CACHE_PENDING) {
+			wait_cache_block(nc);
+			nc_mutex_unlock(&(nc->mutex));
+			continue;
+		}
+
+		if (cb->is_valid == CACHE_VALID) {
+			copy_block(hc, cb, nc, cb_id, buf, len, offset);
+			nc_mutex_unlock(&(nc->mutex));
+			cb_id ++;
+			continue;
+		}
+
+		/* a miss, the blocks after it are read with it */
+		cb->cb_id = cb_id;
+		cb->tid = clu->tid;
+		cb->lun = clu->lun;
+		pend_cache_block(cb, nc);
+		nc_mutex_unlock(&(nc->mutex));
+
+		run[0] = cb;
+		rnc[0] = nc;
+		key.tid = clu->tid;
+		key.lun = clu->lun;
+		key.cb_id = cb_id + 1;
+		nr = 1 + reserve_cache_run(hc, &key, \
+			min(last - cb_id + 1, (uint64_t) CACHE_MAX_RUN) - 1, \
+			run + 1, rnc + 1);
+
+		if (read_cache_run(hc, clu->fd, clu->size, cb_id, nr, \
+				   run, rnc) != 0) {
+			complete_cache_run(run, rnc, nr, CACHE_INVALID);
+			errno = EIO;
+			return -1;
+		}
+
+		/* still ours until published */
+		for (i = 0; i < nr; i ++)
+			copy_block(hc, run[i], rnc[i], cb_id + i, buf, len, \
+				   offset);
+		complete_cache_run(run, rnc, nr, CACHE_VALID);
+		cb_id += nr;
+	}
+
+	return len;
+}
+
+ssize_t tgtcache_pwrite(struct host_cache *hc, struct cache_lu *clu, \
+			const void *buf, size_t len, uint64_t offset)
+{
+	struct numa_cache *nc;
+	uint64_t cb_id, last;
+	ssize_t ret;
+
+	ret = pwrite(clu->fd, buf, len, offset);
+	if (ret <= 0)
+		return ret;
+
+	/* as a write around the cache, fills in flight are not published */
+	last = (offset + ret - 1) / hc->cbs;
+	for (cb_id = offset / hc->cbs; cb_id <= last; cb_id ++) {
+		nc = &(hc->nc[offset2ncid(cb_id * hc->cbs, hc)]);
+		nc_lock(nc);
+		bypass_cache_block(clu->tid, clu->lun, cb_id, nc);
+		nc_mutex_unlock(&(nc->mutex));
+	}
+
+	return ret;
+}
+
+int tgtcache_sync(struct host_cache *hc, struct cache_lu *clu)
+{
+	if (flush_cache_lu(hc, clu->tid, clu->lun) != 0)
+		return -1;
+
+	return fdatasync(clu->fd);
+}
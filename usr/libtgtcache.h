@@ -0,0 +1,34 @@
+/* libtgtcache - the NUMA-aware cache of tgtd for other software
+ *
+ * make -C usr libtgtcache builds libtgtcache.a, link it
+ * with -lpthread -ldl. all of cache.h comes with it, the calls below
+ * serve a file through the cache. a read fills the partition each
+ * block maps to, a write goes to the file and drops the blocks it
+ * covers. messages are printed to stderr.
+ */
+#ifndef __LIBTGTCACHE_H__
+#define __LIBTGTCACHE_H__
+
+#include "cache.h"
+
+/* cache_param defaults come from init_cache_param() */
+int tgtcache_init(struct host_cache *hc, struct cache_param *cp);
+
+void tgtcache_exit(struct host_cache *hc);
+
+/* a file of size bytes, cached blocks are keyed by (tid, lun) */
+struct cache_lu *tgtcache_open(struct host_cache *hc, int tid, uint64_t lun, \
+			       int fd, uint64_t size);
+
+void tgtcache_close(struct host_cache *hc, struct cache_lu *clu);
+
+/* as pread and pwrite, -1 and errno on error */
+ssize_t tgtcache_pread(struct host_cache *hc, struct cache_lu *clu, \
+		       void *buf, size_t len, uint64_t offset);
+
+ssize_t tgtcache_pwrite(struct host_cache *hc, struct cache_lu *clu, \
+			const void *buf, size_t len, uint64_t offset);
+
+int tgtcache_sync(struct host_cache *hc, struct cache_lu *clu);
+
+#endif
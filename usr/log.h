@@ -43,6 +43,7 @@ union semun {
 
 extern int log_daemon;
 extern int log_level;
+extern int is_debug;
 
 struct logmsg {
 	short int prio;
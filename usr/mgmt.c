@@ -40,6 +40,9 @@
 #include "tgtadm.h"
 #include "driver.h"
 #include "util.h"
+#include "cache_tgt.h"
+
+extern struct host_cache hc;
 
 enum mgmt_task_state {
 	MTASK_STATE_HDR_RECV,
@@ -332,6 +335,9 @@ static tgtadm_err sys_mgmt(int lld_no, struct mgmt_task *mtask)
 			}
 			if (adm_err == TGTADM_SUCCESS)
 				eprintf("set debug to: %d\n", is_debug);
+		} else if (!strncmp(mtask->req_buf, "cache_node_size=", 16)) {
+			if (!resize_cache(&hc, mtask->req_buf + 16))
+				adm_err = TGTADM_SUCCESS;
 		} else if (tgt_drivers[lld_no]->update)
 			adm_err = tgt_drivers[lld_no]->update(req->mode, req->op,
 							  req->tid,
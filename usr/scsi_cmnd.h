@@ -18,7 +18,6 @@ struct scsi_data_buffer {
 	int32_t resid;
 };
 
-#ifdef NUMA_CACHE
 struct sub_io_request {
 	int tid;		/* target id */
 	uint64_t lun;		/* logical unit number */
@@ -30,7 +29,16 @@ struct sub_io_request {
 	uint64_t cb_id;		/* cache block id */
 	int nc_id;		/* NUMA cache id */
 };
-#endif
+
+/* a piece of the data-in of a command, in a pinned cache block or in
+ * the command buffer
+ */
+struct scsi_zc {
+	char *addr;
+	uint32_t length;
+	int nc_id;
+	void *cb;		/* struct cache_block, or NULL */
+};
 
 struct scsi_cmd {
 	struct target *c_target;
@@ -38,9 +46,7 @@ struct scsi_cmd {
 	struct list_head c_hlist;
 	struct list_head qlist;
 
-#ifdef NUMA_CACHE
 	int tid;
-#endif
 	uint64_t dev_id;
 
 	struct scsi_lu *dev;
@@ -60,22 +66,26 @@ struct scsi_cmd {
 	uint64_t tag;
 	int result;
 	struct mgmt_req *mreq;
-#ifdef NUMA_CACHE
+	/* split of the command into cache blocks, see get_sior() */
 	int nr_sior;
-	struct sub_io_request sior[1024];
-#endif
+	uint64_t sior_cb_id;	/* first cache block */
+	uint32_t sior_head;	/* offset of the command in the first block */
+	uint32_t sior_length;	/* length of the command */
+
+	/* data-in pieces of a read with cache hits, sent without a copy
+	 * into the buffer. NULL if all of it is in the buffer.
+	 */
+	struct scsi_zc *zc;
+	int nr_zc;
 
 	unsigned char sense_buffer[SCSI_SENSE_BUFFERSIZE];
 	int sense_len;
 
-#ifdef NUMA_CACHE
 	int nodeid;	/* for numa node id */
 	int rdma;
-#endif
 	struct list_head bs_list;
-#ifdef NUMA_CACHE
+	struct scsi_cmd *bs_next;	/* completion list of a worker pool */
 	void *netbuf;
-#endif
 	struct it_nexus *it_nexus;
 	struct it_nexus_lu_info *itn_lu_info;
 };
@@ -1780,6 +1780,7 @@ enum {
 	Opt_mode_page,
 	Opt_path,
 	Opt_bsoflags, Opt_thinprovisioning,
+	Opt_cache_wb,
 	Opt_err,
 };
 
@@ -1801,6 +1802,7 @@ static match_table_t tokens = {
 	{Opt_path, "path=%s"},
 	{Opt_bsoflags, "bsoflags=%s"},
 	{Opt_thinprovisioning, "thin_provisioning=%s"},
+	{Opt_cache_wb, "cache_wb=%s"},
 	{Opt_err, NULL},
 };
 
@@ -1899,6 +1901,10 @@ tgtadm_err lu_config(struct scsi_lu *lu, char *params, match_fn_t *fn)
 			lu_vpd[PCODE_OFFSET(0xb0)]->vpd_update(lu, NULL);
 			lu_vpd[PCODE_OFFSET(0xb2)]->vpd_update(lu, NULL);
 			break;
+		case Opt_cache_wb:
+			match_strncpy(buf, &args[0], sizeof(buf));
+			attrs->cache_wb = atoi(buf);
+			break;
 		case Opt_online:
 			match_strncpy(buf, &args[0], sizeof(buf));
 			if (atoi(buf))
@@ -39,6 +39,9 @@
 #include "tgtadm.h"
 #include "parser.h"
 #include "spc.h"
+#include "cache_tgt.h"
+
+extern struct host_cache hc;
 
 static LIST_HEAD(device_type_list);
 
@@ -456,13 +459,14 @@ __device_lookup(int tid, uint64_t lun, struct target **t)
 }
 
 enum {
-	Opt_path, Opt_bstype, Opt_bsoflags, Opt_blocksize, Opt_err,
+	Opt_path, Opt_bstype, Opt_bsoflags, Opt_bsopts, Opt_blocksize, Opt_err,
 };
 
 static match_table_t device_tokens = {
 	{Opt_path, "path=%s"},
 	{Opt_bstype, "bstype=%s"},
 	{Opt_bsoflags, "bsoflags=%s"},
+	{Opt_bsopts, "bsopts=%s"},
 	{Opt_blocksize, "blocksize=%s"},
 	{Opt_err, NULL},
 };
@@ -473,7 +477,7 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 		      int backing)
 {
 	char *p, *path = NULL, *bstype = NULL;
-	char *bsoflags = NULL, *blocksize = NULL;
+	char *bsoflags = NULL, *bsopts = NULL, *blocksize = NULL;
 	int lu_bsoflags = 0;
 	tgtadm_err adm_err = TGTADM_SUCCESS;
 	struct target *target;
@@ -502,6 +506,9 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 		case Opt_bsoflags:
 			bsoflags = match_strdup(&args[0]);
 			break;
+		case Opt_bsopts:
+			bsopts = match_strdup(&args[0]);
+			break;
 		case Opt_blocksize:
 			blocksize = match_strdup(&args[0]);
 			break;
@@ -579,6 +586,8 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 	lu->tgt = target;
 	lu->lun = lun;
 	lu->bsoflags = lu_bsoflags;
+	lu->bsopts = bsopts;
+	bsopts = NULL;
 
 	tgt_cmd_queue_init(&lu->cmd_queue);
 	INIT_LIST_HEAD(&lu->registration_list);
@@ -683,12 +692,16 @@ out:
 		free(path);
 	if (bsoflags)
 		free(bsoflags);
+	if (bsopts)
+		free(bsopts);
 	return adm_err;
 
 fail_bs_init:
 	if (lu->bst->bs_exit)
 		lu->bst->bs_exit(lu);
 fail_lu_init:
+	if (lu->bsopts)
+		free(lu->bsopts);
 	free(lu);
 	goto out;
 }
@@ -745,6 +758,8 @@ tgtadm_err tgt_device_destroy(int tid, uint64_t lun, int force)
 		free(reg);
 	}
 
+	if (lu->bsopts)
+		free(lu->bsopts);
 	free(lu);
 
 	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
@@ -1022,6 +1037,8 @@ tgtadm_err tgt_stat_system(struct concat_buf *b)
 	list_for_each_entry(target, &target_list, target_siblings)
 		adm_err = tgt_stat_target(target, b);
 
+	cache_stat_show(&hc, b);
+
 	return adm_err;
 }
 
@@ -1095,9 +1112,7 @@ int target_cmd_queue(int tid, struct scsi_cmd *cmd)
 
 	cmd->c_target = target = itn->nexus_target;
 	cmd->it_nexus = itn;
-#ifdef NUMA_CACHE
 	cmd->tid = target->tid;
-#endif
 
 	dev_id = scsi_get_devid(target->lid, cmd->lun);
 	cmd->dev_id = dev_id;
@@ -2015,7 +2030,7 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 		}
 
 		concat_printf(b, _TAB1 "LUN information:\n");
-		list_for_each_entry(lu, &target->device_list, device_siblings)
+		list_for_each_entry(lu, &target->device_list, device_siblings) {
 			concat_printf(b,
 				_TAB2 "LUN: %" PRIu64 "\n"
 				_TAB3 "Type: %s\n"
@@ -2029,7 +2044,8 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 				_TAB3 "Thin-provisioning: %s\n"
 				_TAB3 "Backing store type: %s\n"
 				_TAB3 "Backing store path: %s\n"
-				_TAB3 "Backing store flags: %s\n",
+				_TAB3 "Backing store flags: %s\n"
+				_TAB3 "Backing store options: %s\n",
 				lu->lun,
 				print_type(lu->attrs.device_type),
 				lu->attrs.scsi_id,
@@ -2046,7 +2062,13 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 					"None",
 				lu->path ? : "None",
 					open_flags_to_str(strflags,
-							  lu->bsoflags));
+							  lu->bsoflags),
+				lu->bsopts ? : "None");
+			concat_printf(b, _TAB3 "Cache: %s\n",
+				      lu->attrs.cache ? "Yes" : "No");
+			concat_printf(b, _TAB3 "Cache write-back: %s\n",
+				      lu->attrs.cache_wb ? "Yes" : "No");
+		}
 
 		if (!strcmp(tgt_drivers[target->lid]->name, "iscsi") ||
 		    !strcmp(tgt_drivers[target->lid]->name, "iser")) {
@@ -2370,6 +2392,8 @@ tgtadm_err system_show(int mode, struct concat_buf *b)
 	list_for_each_entry(devt, &device_type_list, device_type_siblings)
 		concat_printf(b, _TAB1 "%s\n", print_type(devt->type));
 
+	cache_show(&hc, b);
+
 	if (global_target.account.nr_inaccount) {
 		int i, aid;
 		concat_printf(b, _TAB1 "%s\n", "Account information:\n");
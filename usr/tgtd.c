@@ -41,14 +41,10 @@
 #include "driver.h"
 #include "work.h"
 #include "util.h"
-#ifdef NUMA_CACHE
-#include "cache.h"
-#endif
+#include "cache_tgt.h"
 
 unsigned long pagesize, pageshift;
-#ifdef NUMA_CACHE
 struct host_cache hc;
-#endif
 
 int system_active = 1;
 static int ep_fd;
@@ -60,23 +56,26 @@ static struct option const long_options[] = {
 	{"foreground", no_argument, 0, 'f'},
 	{"control-port", required_argument, 0, 'C'},
 	{"nr_iothreads", required_argument, 0, 't'},
+	{"nr_workers", required_argument, 0, 'T'},
 	{"debug", required_argument, 0, 'd'},
 	{"version", no_argument, 0, 'V'},
 	{"help", no_argument, 0, 'h'},
-#ifdef NUMA_CACHE
 	{"cache_size", required_argument, 0, 's'},
 	{"cache_bs", required_argument, 0, 'c'},
 	{"cache_group", required_argument, 0, 'g'},
 	{"cache_way", required_argument, 0, 'w'},
-#endif
+	{"cache_policy", required_argument, 0, 'p'},
+	{"cache_ra", required_argument, 0, 'r'},
+	{"cache_node_size", required_argument, 0, 'n'},
+	{"cache_page", required_argument, 0, 'P'},
+	{"cache_mem", required_argument, 0, 'm'},
+	{"cache_admit", required_argument, 0, 'a'},
+	{"cache_bypass", required_argument, 0, 'b'},
+	{"cache_dedup", required_argument, 0, 'D'},
 	{0, 0, 0, 0},
 };
 
-#ifndef NUMA_CACHE
-static char *short_options = "fC:d:t:Vh";
-#else
-static char *short_options = "fC:d:t:Vhc:g:s:w:";
-#endif
+static char *short_options = "fC:d:t:T:Vhc:g:s:w:p:r:n:P:m:a:b:D:";
 static char *spare_args;
 
 static void usage(int status)
@@ -91,10 +90,22 @@ static void usage(int status)
 		"Usage: %s [OPTION]\n"
 		"-f, --foreground        make the program run in the foreground\n"
 		"-C, --control-port NNNN use port NNNN for the mgmt channel\n"
-		"-t, --nr_iothreads NNNN specify the number of I/O threads\n"
-		"-s, --cache_size NNNN   specify the size of numa-aware cache for each numa node\n"
+		"-t, --nr_iothreads NNNN specify the number of I/O threads a LU may use at once\n"
+		"-T, --nr_workers NNNN   specify the number of I/O threads shared by all LUs, 0 sizes it to the cpus\n"
+		"-s, --cache_size NNNN   specify the size of numa-aware cache, split over numa nodes by free memory, 0 (default) caches no LU\n"
+		"-n, --cache_node_size NNNN[,NNNN...]\n"
+		"                        specify the size of numa-aware cache of each numa node\n"
+		"-P, --cache_page PAGE   back cache and network buffers with 4k, thp, 2m or 1g pages\n"
+		"-m, --cache_mem DIR     keep numa-aware cache in files under DIR (tmpfs or DAX) across restart\n"
 		"-c, --cache_bs NNNN     specify the size of numa-aware cache block\n"
 		"-w, --cache-way NNNN    specify number of numa-aware cache per node\n"
+		"-p, --cache_policy NAME numa-aware cache replacement, lru, clock, 2q or arc\n"
+		"-r, --cache_ra NNNN     largest readahead window in cache blocks, 0 disables\n"
+		"-a, --cache_admit on|off\n"
+		"                        admit a block only on a repeated miss once the cache is full\n"
+		"-b, --cache_bypass NNNN read and write commands of NNNN bytes or more around the cache\n"
+		"-D, --cache_dedup on|off\n"
+		"                        keep identical blocks read from disk once in memory\n"
 		"-d, --debug debuglevel  print debugging information\n"
 		"-V, --version           print version and exit\n"
 		"-h, --help              display this help and exit\n",
@@ -525,10 +536,10 @@ int main(int argc, char **argv)
 	int err, ch, longindex, nr_lld = 0;
 	int is_daemon = 1, is_debug = 0;
 	int ret;
-#ifdef NUMA_CACHE
 	struct cache_param cp;
 	init_cache_param(&cp);
-#endif
+	/* the cache takes memory only when sized */
+	cp.buffer_size = 0;
 	sa_new.sa_handler = signal_catch;
 	sigemptyset(&sa_new.sa_mask);
 	sa_new.sa_flags = 0;
@@ -558,12 +569,16 @@ int main(int argc, char **argv)
 			if (ret)
 				bad_optarg(ret, ch, optarg);
 			break;
+		case 'T':
+			ret = str_to_int_ge(optarg, nr_workers, 0);
+			if (ret)
+				bad_optarg(ret, ch, optarg);
+			break;
 		case 'd':
 			ret = str_to_int_range(optarg, is_debug, 0, 1);
 			if (ret)
 				bad_optarg(ret, ch, optarg);
 			break;
-#ifdef NUMA_CACHE
 		case 'c':
 			cp.cbs = (int) byte_atoi(optarg);
 			if (cp.cbs == 0)
@@ -584,7 +599,50 @@ int main(int argc, char **argv)
 			if (cp.cache_way == 0)
 				bad_optarg(cp.cache_way, ch, optarg);
 			break;
-#endif
+		case 'p':
+			if (find_cache_policy(optarg) == NULL)
+				bad_optarg(EINVAL, ch, optarg);
+			cp.policy = optarg;
+			break;
+		case 'r':
+			ret = str_to_int_range(optarg, cp.ra_max, 0, 65536);
+			if (ret)
+				bad_optarg(ret, ch, optarg);
+			break;
+		case 'n':
+			if (byte_atoi(optarg) == 0)
+				bad_optarg(EINVAL, ch, optarg);
+			cp.node_size = optarg;
+			break;
+		case 'm':
+			cp.mem = optarg;
+			break;
+		case 'P':
+			cp.page = cache_page_mode(optarg);
+			if (cp.page < 0)
+				bad_optarg(EINVAL, ch, optarg);
+			break;
+		case 'a':
+			if (!strcmp(optarg, "on"))
+				cp.admit = 1;
+			else if (!strcmp(optarg, "off"))
+				cp.admit = 0;
+			else
+				bad_optarg(EINVAL, ch, optarg);
+			break;
+		case 'b':
+			cp.bypass = byte_atoi(optarg);
+			if (cp.bypass == 0)
+				bad_optarg(EINVAL, ch, optarg);
+			break;
+		case 'D':
+			if (!strcmp(optarg, "on"))
+				cp.dedup = 1;
+			else if (!strcmp(optarg, "off"))
+				cp.dedup = 0;
+			else
+				bad_optarg(EINVAL, ch, optarg);
+			break;
 		case 'V':
 			version();
 			break;
@@ -622,6 +680,11 @@ int main(int argc, char **argv)
 	if (err)
 		exit(1);
 
+	/* drivers size their buffers by whether the cache has memory */
+	err = init_cache(&hc, &cp);
+	if (err)
+		exit(1);
+
 	nr_lld = lld_init();
 	if (!nr_lld) {
 		fprintf(stderr, "No available low level driver!\n");
@@ -642,16 +705,13 @@ int main(int argc, char **argv)
 
 	bs_init();
 
-#ifdef NUMA_CACHE
-	err = init_cache(&hc, &cp);
-	if (err)
-		exit(1);
-#endif
-
 	event_loop();
 
 	lld_exit();
 
+	stop_cache_flusher(&hc);
+	save_cache(&hc);
+
 	work_timer_stop();
 
 	ipc_exit();
@@ -81,6 +81,8 @@ struct lu_phy_attr {
 	char no_auto_lbppbe;    /* Do not update it automatically when the
 				   backing file changes */
 	uint16_t la_lba;	/* Lowest aligned LBA */
+	char cache;		/* LU is cached by the NUMA cache */
+	char cache_wb;		/* write-back NUMA cache */
 
 	/* VPD pages 0x80 -> 0xff masked with 0x80*/
 	struct vpd *lu_vpd[1 << PCODE_SHIFT];
@@ -193,6 +195,7 @@ struct scsi_lu {
 	uint64_t lun;
 	char *path;
 	int bsoflags;
+	char *bsopts;	/* backing store options, ';' separated */
 	unsigned int blk_shift;
 
 	/* the list of devices belonging to a target */
@@ -253,6 +256,7 @@ enum mgmt_req_result {
 extern int system_active;
 extern int is_debug;
 extern int nr_iothreads;
+extern int nr_workers;
 extern struct list_head bst_list;
 
 extern int ipc_init(void);
@@ -373,6 +377,11 @@ extern int setup_param(char *name, int (*parser)(char *));
 
 extern int bs_init(void);
 
+struct iovec;
+extern int bs_add_fixed_buffer(void *addr, size_t len);
+extern void bs_del_fixed_buffer(void *addr);
+extern int bs_fixed_buffers(struct iovec **iov, unsigned int *gen);
+
 struct event_data {
 	union {
 		event_handler_t handler;
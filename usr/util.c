@@ -215,7 +215,6 @@ int spc_memcpy(uint8_t *dst, uint32_t *dst_remain_len,
 	return copy_len;
 }
 
-#ifdef NUMA_CACHE
 size_t byte_atoi(char *str)
 {
 	double theNum;
@@ -247,5 +246,4 @@ size_t byte_atoi(char *str)
 
 	return (size_t) theNum;
 }
-#endif
 
@@ -22,11 +22,9 @@
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define ALIGN(x,a) (((x)+(a)-1)&~((a)-1))
 
-#ifdef NUMA_CACHE
 #define kKilo_to_Unit	1024
 #define kMega_to_Unit	1024 * 1024
 #define kGiga_to_Unit	1024 * 1024 * 1024
-#endif
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define __cpu_to_be16(x) bswap_16(x)
@@ -76,9 +74,7 @@ extern char *open_flags_to_str(char *dest, int flags);
 extern int spc_memcpy(uint8_t *dst, uint32_t *dst_remain_len,
 		      uint8_t *src, uint32_t src_len);
 
-#ifdef NUMA_CACHE
 extern size_t byte_atoi(char *str);
-#endif
 
 #define zalloc(size)			\
 ({					\